@@ -0,0 +1,56 @@
+#!/bin/sh
+set -e
+set -f # disable globbing.
+
+CFLAGS="${CFLAGS}"
+CC="${CC:-clang}"
+WARNINGS="$(tr -s '\n' ' ' < compile_flags.txt)"
+# E.g. `SQLITE_OPTIONS_FILE=sqlite_options_server.txt`. Lines starting with
+# `#` are comments.
+SQLITE_OPTIONS_FILE="${SQLITE_OPTIONS_FILE:-sqlite_options.txt}"
+SQLITE_OPTIONS="$(grep -v '^#' "$SQLITE_OPTIONS_FILE" | tr -s '\n' ' ')"
+
+error() {
+	printf "ERROR: %s\n" "$1"
+	exit 1
+}
+
+# Usage: ./bench.sh <name> [args passed to the benchmark...]
+# `load` starts the server itself.
+if [ $# -eq 0 ]; then
+	error "Missing benchmark name!"
+fi
+
+NAME="$1"
+shift
+
+case $NAME in
+  db)
+    # shellcheck disable=SC2086
+    "$CC" $WARNINGS -g3 -O3 -march=native bench_db.c sqlite3.o -o bench_db.bin $CFLAGS $SQLITE_OPTIONS -lm
+    ;;
+  micro)
+    # shellcheck disable=SC2086
+    "$CC" $WARNINGS -g3 -O3 -march=native bench_micro.c -o bench_micro.bin $CFLAGS
+    BENCH_COMMIT="$(git rev-parse --short HEAD 2>/dev/null || true)"
+    export BENCH_COMMIT
+    ;;
+  load)
+    # shellcheck disable=SC2086
+    "$CC" $WARNINGS -g3 -O3 -march=native bench_load.c -o bench_load.bin $CFLAGS
+    # Against a release build of the server, on localhost, from an empty
+    # database. E.g. `BENCH_BUILD=release-pgo` to compare build modes.
+    ./build.sh "${BENCH_BUILD:-release}"
+    BENCH_DIR="$(mktemp -d)"
+    cp main.bin main.css main.js "$BENCH_DIR"
+    (cd "$BENCH_DIR" && LOG_SAMPLE_RATE=0 exec ./main.bin > /dev/null) &
+    SERVER_PID=$!
+    trap 'kill $SERVER_PID; rm -rf "$BENCH_DIR"' EXIT
+    sleep 1
+    ;;
+	*)
+		error "Benchmark \"$NAME\" unsupported!"
+		;;
+esac
+
+"./bench_$NAME.bin" "$@"
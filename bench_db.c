@@ -0,0 +1,348 @@
+#include "bench_hist.c"
+#include "db.c"
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <sys/wait.h>
+
+// Storage benchmark on a synthetic dataset, through the same entrypoints as
+// the server (`db_setup`, `db_create_poll`, `db_get_poll`, `db_cast_vote`):
+// - Load: create the polls, then cast the votes, in one process.
+// - Run: worker processes concurrently get polls and cast votes.
+// Polls are picked with a Zipfian distribution: a few polls get most of the
+// traffic, like in production.
+// Usage: `./bench_db.bin [polls_count] [votes_count] [workers]
+// [ops_per_worker] [write_percent]`.
+//
+// Environment variables:
+// - `BENCH_DB_BACKEND`: `sqlite` (default) or `kv`.
+// - `BENCH_DB_PRAGMAS`: SQL run by each process after `db_setup`, to evaluate
+//   pragmas, e.g. `PRAGMA cache_size = -65536; PRAGMA synchronous = FULL;
+//   PRAGMA wal_autocheckpoint = 10000`. Use `PRAGMA busy_timeout = 0` to see
+//   the raw lock contention in the `busy` count.
+// - `BENCH_DB_CHECKPOINTER=1`: checkpoint in a background process, as the
+//   server does, instead of in the committing connection.
+// - `BENCH_DB_ZIPF_THETA`: the skew, in [0, 1), default 0.99 (as YCSB). 0 is
+//   uniform.
+//
+// Results are printed in logfmt, one line per phase and operation.
+
+typedef enum {
+  BENCH_OP_CREATE_POLL,
+  BENCH_OP_GET_POLL,
+  BENCH_OP_CAST_VOTE,
+  BENCH_OP_MAX, // Pseudo-value.
+} BenchOp;
+
+static const char *bench_op_to_s[BENCH_OP_MAX] = {
+    [BENCH_OP_CREATE_POLL] = "create_poll",
+    [BENCH_OP_GET_POLL] = "get_poll",
+    [BENCH_OP_CAST_VOTE] = "cast_vote",
+};
+
+typedef struct {
+  BenchHist latency;
+  u64 errors;
+  // Included in `errors`.
+  u64 busy;
+} BenchOpResult;
+
+// Written by each worker process in shared memory, read by the parent once
+// the workers exited.
+typedef struct {
+  BenchOpResult ops[BENCH_OP_MAX];
+  u64 start_ns, end_ns;
+} BenchWorkerResult;
+
+// Zipfian ranks in `[0, n)`, 0 being the most popular, in constant time per
+// pick after an O(n) setup. See "Quickly Generating Billion-Record Synthetic
+// Databases", Gray et al., which YCSB also uses.
+typedef struct {
+  u64 n;
+  double theta, alpha, zetan, eta;
+} BenchZipf;
+
+[[nodiscard]] static double bench_zeta(u64 n, double theta) {
+  double sum = 0;
+  for (u64 i = 1; i <= n; i++) {
+    sum += 1 / pow((double)i, theta);
+  }
+  return sum;
+}
+
+[[nodiscard]] static BenchZipf bench_zipf_make(u64 n, double theta) {
+  ASSERT(n > 0);
+  ASSERT(theta >= 0 && theta < 1);
+
+  BenchZipf res = {.n = n, .theta = theta};
+  res.alpha = 1 / (1 - theta);
+  res.zetan = bench_zeta(n, theta);
+  if (n > 1) {
+    res.eta = (1 - pow(2 / (double)n, 1 - theta)) /
+              (1 - bench_zeta(2, theta) / res.zetan);
+  }
+  return res;
+}
+
+[[nodiscard]] static u64 bench_zipf_next(const BenchZipf *zipf) {
+  const double u = (double)arc4random() / 4294967296.0;
+  const double uz = u * zipf->zetan;
+  if (uz < 1 || 1 == zipf->n) {
+    return 0;
+  }
+  if (uz < 1 + pow(0.5, zipf->theta)) {
+    return 1;
+  }
+
+  const double rank =
+      (double)zipf->n * pow(zipf->eta * u - zipf->eta + 1, zipf->alpha);
+  const u64 res = (u64)rank;
+  return res < zipf->n ? res : zipf->n - 1;
+}
+
+static const char *bench_backend_name = "sqlite";
+static const char *bench_pragmas = nullptr;
+
+static String bench_req_id = S("bench");
+static String bench_options[] = {S("Lisbon"), S("Lyon"), S("Tokyo")};
+
+// In each process: SQLite connections must not be used across `fork`.
+static void bench_db_setup(const DbBackend *backend, const char *path,
+                           Arena *arena) {
+  if (DB_ERR_NONE != db_setup(backend, path, arena)) {
+    exit(EINVAL);
+  }
+
+  if (&db_backend_sqlite != backend || nullptr == bench_pragmas) {
+    return;
+  }
+
+  int db_err = 0;
+  if (SQLITE_OK !=
+      (db_err = sqlite3_exec(db, bench_pragmas, nullptr, nullptr, nullptr))) {
+    fprintf(stderr, "failed to execute pragmas: %s: %d\n", bench_pragmas,
+            db_err);
+    exit(EINVAL);
+  }
+}
+
+static void bench_op_run(BenchOp op, Id128 poll_id, BenchOpResult *result,
+                         Arena arena) {
+  StringSlice poll_options = {.data = bench_options,
+                              .len = static_array_len(bench_options)};
+  const u64 busy_before = db_sqlite_busy_count;
+  const u64 start_ns = clock_monotonic_ns();
+
+  DatabaseError err = DB_ERR_NONE;
+  switch (op) {
+  case BENCH_OP_CREATE_POLL: {
+    Poll poll = {
+        .id = poll_id,
+        .name = S("Where do we go on vacation?"),
+        .options = poll_options,
+        .created_by = S("bench"),
+    };
+    err = db_create_poll(bench_req_id, poll, &arena);
+  } break;
+  case BENCH_OP_GET_POLL:
+    err = db_get_poll(bench_req_id, poll_id, &arena).err;
+    break;
+  case BENCH_OP_CAST_VOTE: {
+    String user_id = make_unique_id_u128_string(&arena);
+    // Vote for one random option.
+    StringSlice vote = {
+        .data = &bench_options[arc4random_uniform(
+            (u32)static_array_len(bench_options))],
+        .len = 1,
+    };
+    err = db_cast_vote(bench_req_id, poll_id, user_id, vote, &arena);
+  } break;
+  case BENCH_OP_MAX:
+  default:
+    ASSERT(0);
+  }
+
+  bench_hist_record_n(&result->latency, clock_monotonic_ns() - start_ns, 1);
+  result->errors += DB_ERR_NONE != err;
+  result->busy += db_sqlite_busy_count - busy_before;
+}
+
+static void bench_worker_run(const DbBackend *backend, const char *path,
+                             const Id128 *poll_ids, const BenchZipf *zipf,
+                             u64 ops, u64 write_percent,
+                             BenchWorkerResult *result, Arena *arena) {
+  // SQLite connections must not cross `fork(2)`. The kv backend is inherited
+  // as set up by the parent, like in the server: its writers serialize on the
+  // mutex in the shared memory.
+  if (&db_backend_sqlite == backend) {
+    bench_db_setup(backend, path, arena);
+  }
+
+  result->start_ns = clock_monotonic_ns();
+  for (u64 i = 0; i < ops; i++) {
+    const BenchOp op = arc4random_uniform(100) < write_percent
+                           ? BENCH_OP_CAST_VOTE
+                           : BENCH_OP_GET_POLL;
+    const Id128 poll_id = poll_ids[bench_zipf_next(zipf)];
+    bench_op_run(op, poll_id, &result->ops[op], *arena);
+  }
+  result->end_ns = clock_monotonic_ns();
+}
+
+static void bench_print(const char *phase, BenchOp op, u64 workers,
+                        const BenchOpResult *result, u64 duration_ns) {
+  ASSERT(duration_ns > 0);
+
+  const BenchHist *hist = &result->latency;
+  printf("backend=%s phase=%s op=%s workers=%" PRIu64 " count=%" PRIu64
+         " errors=%" PRIu64 " busy=%" PRIu64 " ops_per_s=%" PRIu64
+         " p50_ns=%" PRIu64 " p99_ns=%" PRIu64 " p999_ns=%" PRIu64
+         " max_ns=%" PRIu64 " pragmas=\"%s\"\n",
+         bench_backend_name, phase, AT(bench_op_to_s, BENCH_OP_MAX, op),
+         workers, hist->total, result->errors, result->busy,
+         hist->total * 1'000'000'000 / duration_ns,
+         bench_hist_percentile(hist, 500'000),
+         bench_hist_percentile(hist, 990'000),
+         bench_hist_percentile(hist, 999'000), hist->max,
+         nullptr != bench_pragmas ? bench_pragmas : "");
+}
+
+[[nodiscard]] static u64 bench_file_size(const char *path) {
+  struct stat st = {0};
+  return 0 == stat(path, &st) ? (u64)st.st_size : 0;
+}
+
+int main(int argc, char *argv[]) {
+  u64 polls_count = 100'000;
+  u64 votes_count = 1'000'000;
+  u64 workers = 4;
+  u64 ops = 10'000;
+  u64 write_percent = 20;
+  if (argc >= 2) {
+    polls_count = strtoull(argv[1], nullptr, 10);
+  }
+  if (argc >= 3) {
+    votes_count = strtoull(argv[2], nullptr, 10);
+  }
+  if (argc >= 4) {
+    workers = strtoull(argv[3], nullptr, 10);
+  }
+  if (argc >= 5) {
+    ops = strtoull(argv[4], nullptr, 10);
+  }
+  if (argc >= 6) {
+    write_percent = strtoull(argv[5], nullptr, 10);
+  }
+  if (0 == polls_count || 0 == workers || write_percent > 100) {
+    fprintf(stderr, "invalid arguments\n");
+    return EINVAL;
+  }
+
+  const DbBackend *backend = &db_backend_sqlite;
+  const char *path = "bench.db";
+  const char *backend_env = getenv("BENCH_DB_BACKEND");
+  if (nullptr != backend_env && 0 == strcmp(backend_env, "kv")) {
+    backend = &db_backend_kv;
+    bench_backend_name = "kv";
+    path = "bench.kv";
+  }
+  bench_pragmas = getenv("BENCH_DB_PRAGMAS");
+
+  double theta = 0.99;
+  const char *theta_env = getenv("BENCH_DB_ZIPF_THETA");
+  if (nullptr != theta_env) {
+    theta = strtod(theta_env, nullptr);
+  }
+  if (!(theta >= 0 && theta < 1)) {
+    fprintf(stderr, "invalid zipf theta: %s\n", theta_env);
+    return EINVAL;
+  }
+
+  Arena arena = arena_make_from_virtual_mem(1024 * 1024 * KiB);
+
+  // Start from scratch each time.
+  (void)unlink("bench.db");
+  (void)unlink("bench.db-wal");
+  (void)unlink("bench.db-shm");
+  (void)unlink("bench.kv");
+
+  bench_db_setup(backend, path, &arena);
+  const char *checkpointer = getenv("BENCH_DB_CHECKPOINTER");
+  if (&db_backend_sqlite == backend && nullptr != checkpointer &&
+      0 == strcmp(checkpointer, "1") &&
+      DB_ERR_NONE != db_checkpointer_start(path, &arena)) {
+    return EINVAL;
+  }
+
+  Id128 *poll_ids = arena_new(&arena, Id128, polls_count);
+  const BenchZipf zipf = bench_zipf_make(polls_count, theta);
+
+  {
+    BenchOpResult *result = arena_new(&arena, BenchOpResult, 1);
+    const u64 start_ns = clock_monotonic_ns();
+    for (u64 i = 0; i < polls_count; i++) {
+      poll_ids[i] = id128_random();
+      bench_op_run(BENCH_OP_CREATE_POLL, poll_ids[i], result, arena);
+    }
+    bench_print("load", BENCH_OP_CREATE_POLL, 1, result,
+                clock_monotonic_ns() - start_ns);
+  }
+
+  if (votes_count > 0) {
+    BenchOpResult *result = arena_new(&arena, BenchOpResult, 1);
+    const u64 start_ns = clock_monotonic_ns();
+    for (u64 i = 0; i < votes_count; i++) {
+      bench_op_run(BENCH_OP_CAST_VOTE, poll_ids[bench_zipf_next(&zipf)],
+                   result, arena);
+    }
+    bench_print("load", BENCH_OP_CAST_VOTE, 1, result,
+                clock_monotonic_ns() - start_ns);
+  }
+
+  if (ops > 0) {
+    BenchWorkerResult *results =
+        mmap(nullptr, workers * sizeof(BenchWorkerResult),
+             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    ASSERT(MAP_FAILED != results);
+
+    for (u64 i = 0; i < workers; i++) {
+      const pid_t pid = fork();
+      ASSERT(-1 != pid);
+      if (0 == pid) {
+        bench_worker_run(backend, path, poll_ids, &zipf, ops, write_percent,
+                         &results[i], &arena);
+        exit(0);
+      }
+    }
+    for (u64 i = 0; i < workers; i++) {
+      int status = 0;
+      ASSERT(-1 != wait(&status));
+      ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+    }
+
+    u64 start_ns = UINT64_MAX;
+    u64 end_ns = 0;
+    for (u64 i = 0; i < workers; i++) {
+      const BenchWorkerResult *result = &results[i];
+      start_ns = result->start_ns < start_ns ? result->start_ns : start_ns;
+      end_ns = result->end_ns > end_ns ? result->end_ns : end_ns;
+    }
+
+    for (u64 op = 0; op < BENCH_OP_MAX; op++) {
+      BenchOpResult *merged = arena_new(&arena, BenchOpResult, 1);
+      for (u64 i = 0; i < workers; i++) {
+        bench_hist_merge(&merged->latency, &results[i].ops[op].latency);
+        merged->errors += results[i].ops[op].errors;
+        merged->busy += results[i].ops[op].busy;
+      }
+      if (merged->latency.total > 0) {
+        bench_print("run", (BenchOp)op, workers, merged, end_ns - start_ns);
+      }
+    }
+  }
+
+  // The WAL left over, to evaluate the checkpointing.
+  printf("backend=%s phase=end db_bytes=%" PRIu64 " wal_bytes=%" PRIu64 "\n",
+         bench_backend_name, bench_file_size(path),
+         bench_file_size("bench.db-wal"));
+}
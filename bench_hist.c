@@ -0,0 +1,102 @@
+#ifndef CHTTP_BENCH_HIST_C
+#define CHTTP_BENCH_HIST_C
+
+#include "submodules/cstd/lib.c"
+
+// Latencies in a log-linear histogram, like HdrHistogram: each power of two is
+// split in 64 buckets, so that values are kept with a precision of ~1.5%, from
+// 1 ns to years, in fixed memory.
+#define BENCH_HIST_SUB_BITS 6
+#define BENCH_HIST_LEN (64 << BENCH_HIST_SUB_BITS)
+
+typedef struct {
+  u64 counts[BENCH_HIST_LEN];
+  u64 total;
+  u64 max;
+} BenchHist;
+
+[[nodiscard]] static u64 bench_hist_index(u64 value) {
+  if (value < (1 << BENCH_HIST_SUB_BITS)) {
+    return value;
+  }
+
+  const u64 exponent = 63 - (u64)__builtin_clzll(value);
+  const u64 shift = exponent - BENCH_HIST_SUB_BITS;
+  const u64 sub = (value >> shift) & ((1 << BENCH_HIST_SUB_BITS) - 1);
+  return ((shift + 1) << BENCH_HIST_SUB_BITS) + sub;
+}
+
+// Highest value of a bucket.
+[[nodiscard]] static u64 bench_hist_value(u64 idx) {
+  ASSERT(idx < BENCH_HIST_LEN);
+  if (idx < (1 << BENCH_HIST_SUB_BITS)) {
+    return idx;
+  }
+
+  const u64 shift = (idx >> BENCH_HIST_SUB_BITS) - 1;
+  const u64 sub = idx & ((1 << BENCH_HIST_SUB_BITS) - 1);
+  return (((1ULL << BENCH_HIST_SUB_BITS) + sub + 1) << shift) - 1;
+}
+
+static void bench_hist_record_n(BenchHist *hist, u64 value, u64 count) {
+  hist->counts[bench_hist_index(value)] += count;
+  hist->total += count;
+  hist->max = value > hist->max ? value : hist->max;
+}
+
+static void bench_hist_merge(BenchHist *dst, const BenchHist *src) {
+  for (u64 i = 0; i < BENCH_HIST_LEN; i++) {
+    dst->counts[i] += src->counts[i];
+  }
+  dst->total += src->total;
+  dst->max = src->max > dst->max ? src->max : dst->max;
+}
+
+// A closed-loop client waiting on a slow response does not send the requests
+// it would have sent meanwhile, which hides them from the latencies. They are
+// added back, as if sent every `interval_ns` and waiting on the slow response
+// too (HdrHistogram's `copyCorrectedForCoordinatedOmission`).
+static void bench_hist_correct(const BenchHist *in, u64 interval_ns,
+                               BenchHist *out) {
+  *out = *in;
+  if (0 == interval_ns) {
+    return;
+  }
+
+  for (u64 i = 0; i < BENCH_HIST_LEN; i++) {
+    const u64 count = in->counts[i];
+    if (0 == count) {
+      continue;
+    }
+    const u64 value = bench_hist_value(i);
+    if (value <= interval_ns) {
+      continue;
+    }
+    for (u64 missed = value - interval_ns; missed >= interval_ns;
+         missed -= interval_ns) {
+      bench_hist_record_n(out, missed, count);
+    }
+  }
+}
+
+// E.g. 990'000 for the p99.
+[[nodiscard]] static u64 bench_hist_percentile(const BenchHist *hist,
+                                               u64 per_million) {
+  ASSERT(per_million <= 1'000'000);
+  if (0 == hist->total) {
+    return 0;
+  }
+
+  const u64 rank = (hist->total * per_million + 999'999) / 1'000'000;
+  u64 seen = 0;
+  for (u64 i = 0; i < BENCH_HIST_LEN; i++) {
+    seen += hist->counts[i];
+    if (seen >= rank && seen > 0) {
+      const u64 value = bench_hist_value(i);
+      return value < hist->max ? value : hist->max;
+    }
+  }
+  return hist->max;
+}
+
+#endif
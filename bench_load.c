@@ -0,0 +1,339 @@
+#include "bench_hist.c"
+#include "http.c"
+#include <inttypes.h>
+#include <stdio.h>
+#include <sys/wait.h>
+
+// Load generator for the server running on localhost (see `bench.sh load`):
+// worker processes send the requests of a scenario, and the throughput and the
+// latency percentiles are printed in logfmt.
+// Usage: `./bench_load.bin [scenario] [workers] [requests_per_worker] [rate]
+// [max_p99_ns]`.
+//
+// With a `rate` (requests per second, for all workers), the load is open-loop:
+// each worker sends on a fixed schedule, and a latency is measured from when
+// the request was scheduled, not sent. A stalled server then shows up in the
+// latencies instead of only slowing the client down ("coordinated omission").
+// Without, the load is closed-loop: a worker sends the next request once the
+// previous one completes. The latencies are then also corrected the way
+// HdrHistogram does, with the mean latency as the expected interval.
+//
+// With `max_p99_ns`, the exit code is 1 when the (corrected) p99 exceeds it,
+// to gate performance regressions.
+
+typedef enum {
+  BENCH_SCENARIO_HOME,
+  BENCH_SCENARIO_STATIC_FILE,
+  BENCH_SCENARIO_CREATE_POLL,
+  BENCH_SCENARIO_GET_POLL,
+  BENCH_SCENARIO_CAST_VOTE,
+  // A mix of the above, mostly reads.
+  BENCH_SCENARIO_MIXED,
+  BENCH_SCENARIO_MAX, // Pseudo-value.
+} BenchScenario;
+
+static const char *bench_scenario_to_s[BENCH_SCENARIO_MAX] = {
+    [BENCH_SCENARIO_HOME] = "home",
+    [BENCH_SCENARIO_STATIC_FILE] = "static_file",
+    [BENCH_SCENARIO_CREATE_POLL] = "create_poll",
+    [BENCH_SCENARIO_GET_POLL] = "get_poll",
+    [BENCH_SCENARIO_CAST_VOTE] = "cast_vote",
+    [BENCH_SCENARIO_MIXED] = "mixed",
+};
+
+// Out of 100.
+static const u32 bench_mixed_weights[BENCH_SCENARIO_MIXED] = {
+    [BENCH_SCENARIO_HOME] = 10,
+    [BENCH_SCENARIO_STATIC_FILE] = 10,
+    [BENCH_SCENARIO_CREATE_POLL] = 5,
+    [BENCH_SCENARIO_GET_POLL] = 60,
+    [BENCH_SCENARIO_CAST_VOTE] = 15,
+};
+
+// Polls created upfront, for the scenarios reading or voting.
+#define BENCH_POLLS_LEN 64
+
+// Written by each worker process in shared memory, read by the parent once
+// the workers exited.
+typedef struct {
+  BenchHist latency;
+  u64 errors;
+  u64 start_ns, end_ns;
+} BenchWorkerResult;
+
+typedef struct {
+  u16 port;
+  // Base62, as in the urls.
+  String poll_ids[BENCH_POLLS_LEN];
+  u64 poll_ids_len;
+} BenchTarget;
+
+[[nodiscard]] static BenchScenario bench_scenario_pick(BenchScenario scenario) {
+  if (BENCH_SCENARIO_MIXED != scenario) {
+    return scenario;
+  }
+
+  u32 n = arc4random_uniform(100);
+  for (u64 i = 0; i < BENCH_SCENARIO_MIXED; i++) {
+    if (n < bench_mixed_weights[i]) {
+      return (BenchScenario)i;
+    }
+    n -= bench_mixed_weights[i];
+  }
+  ASSERT(0);
+  return BENCH_SCENARIO_HOME; // Unreachable.
+}
+
+static void bench_request_push_form(HttpRequest *req, String body,
+                                    Arena *arena) {
+  DynU8 content_length = {0};
+  dynu8_append_u64_to_string(&content_length, body.len, arena);
+
+  req->body = body;
+  http_push_header(&req->headers, S("Content-Type"),
+                   S("application/x-www-form-urlencoded"), arena);
+  http_push_header(&req->headers, S("Content-Length"),
+                   dyn_slice(String, content_length), arena);
+}
+
+[[nodiscard]] static HttpRequest bench_request_make(BenchScenario scenario,
+                                                    const BenchTarget *target,
+                                                    Arena *arena) {
+  HttpRequest req = {.method = HM_GET};
+  String poll_id = target->poll_ids_len > 0
+                       ? target->poll_ids[arc4random_uniform(
+                             (u32)target->poll_ids_len)]
+                       : (String){0};
+
+  switch (scenario) {
+  case BENCH_SCENARIO_HOME:
+    break;
+  case BENCH_SCENARIO_STATIC_FILE:
+    *dyn_push(&req.path_components, arena) = S("main.css");
+    break;
+  case BENCH_SCENARIO_CREATE_POLL:
+    req.method = HM_POST;
+    *dyn_push(&req.path_components, arena) = S("poll");
+    bench_request_push_form(
+        &req, S("name=Where+do+we+go+on+vacation%3F&option=Lisbon&option=Lyon"
+                "&option=Tokyo"),
+        arena);
+    break;
+  case BENCH_SCENARIO_GET_POLL:
+    *dyn_push(&req.path_components, arena) = S("poll");
+    *dyn_push(&req.path_components, arena) = poll_id;
+    break;
+  case BENCH_SCENARIO_CAST_VOTE: {
+    req.method = HM_POST;
+    *dyn_push(&req.path_components, arena) = S("poll");
+    *dyn_push(&req.path_components, arena) = poll_id;
+    *dyn_push(&req.path_components, arena) = S("vote");
+    bench_request_push_form(&req, S("option=Lyon"), arena);
+
+    // A new voter each time.
+    DynU8 cookie = {0};
+    dyn_append_slice(&cookie, S("__Secure-user_id="), arena);
+    dyn_append_slice(&cookie, make_unique_id_u128_string(arena), arena);
+    http_push_header(&req.headers, S("Cookie"), dyn_slice(String, cookie),
+                     arena);
+  } break;
+  case BENCH_SCENARIO_MIXED:
+  case BENCH_SCENARIO_MAX:
+  default:
+    ASSERT(0);
+  }
+
+  return req;
+}
+
+[[nodiscard]] static u16 bench_expected_status(BenchScenario scenario) {
+  return BENCH_SCENARIO_CREATE_POLL == scenario ? 301 : 200;
+}
+
+[[nodiscard]] static HttpResponse bench_send(BenchScenario scenario,
+                                             const BenchTarget *target,
+                                             Arena *arena) {
+  HttpRequest req = bench_request_make(scenario, target, arena);
+
+  DnsResolveIpv4AddressSocketResult res_resolve =
+      net_dns_resolve_ipv4_tcp(S("127.0.0.1"), target->port, *arena);
+  if (res_resolve.err) {
+    return (HttpResponse){.err = res_resolve.err};
+  }
+  return http_client_request(res_resolve.res, req, arena);
+}
+
+// Create the polls that the other scenarios use.
+static void bench_setup(BenchTarget *target, Arena *arena) {
+  for (u64 i = 0; i < BENCH_POLLS_LEN; i++) {
+    HttpResponse res = bench_send(BENCH_SCENARIO_CREATE_POLL, target, arena);
+    if (res.err || 301 != res.status) {
+      fprintf(stderr, "failed to create poll: err=%d status=%u\n", res.err,
+              res.status);
+      exit(EINVAL);
+    }
+
+    for (u64 j = 0; j < res.headers.len; j++) {
+      KeyValue h = dyn_at(res.headers, j);
+      if (string_ieq_ascii(h.key, S("Location"), arena) &&
+          string_starts_with(h.value, S("/poll/"))) {
+        target->poll_ids[target->poll_ids_len++] =
+            slice_range(h.value, S("/poll/").len, 0);
+        break;
+      }
+    }
+  }
+  ASSERT(BENCH_POLLS_LEN == target->poll_ids_len);
+}
+
+static void bench_sleep_until(u64 deadline_ns) {
+  const struct timespec deadline = {
+      .tv_sec = (time_t)(deadline_ns / 1'000'000'000),
+      .tv_nsec = (long)(deadline_ns % 1'000'000'000),
+  };
+  while (EINTR == clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline,
+                                  nullptr)) {
+  }
+}
+
+// `interval_ns` is 0 for a closed loop.
+static void bench_worker_run(BenchScenario scenario, const BenchTarget *target,
+                             u64 requests, u64 interval_ns,
+                             BenchWorkerResult *result, Arena *arena) {
+  result->start_ns = clock_monotonic_ns();
+
+  for (u64 i = 0; i < requests; i++) {
+    Arena tmp_arena = *arena;
+
+    u64 start_ns = clock_monotonic_ns();
+    if (interval_ns > 0) {
+      const u64 scheduled_ns = result->start_ns + i * interval_ns;
+      bench_sleep_until(scheduled_ns);
+      // When late, the time waited counts.
+      start_ns = scheduled_ns;
+    }
+
+    const BenchScenario picked = bench_scenario_pick(scenario);
+    HttpResponse res = bench_send(picked, target, &tmp_arena);
+    bench_hist_record_n(&result->latency, clock_monotonic_ns() - start_ns, 1);
+    if (res.err || bench_expected_status(picked) != res.status) {
+      result->errors += 1;
+    }
+  }
+
+  result->end_ns = clock_monotonic_ns();
+}
+
+// `hist` may hold more values than `requests`, once corrected.
+static void bench_print(BenchScenario scenario, u64 interval_ns,
+                        const char *latency_kind, u64 workers, u64 requests,
+                        u64 errors, u64 duration_ns, const BenchHist *hist) {
+  ASSERT(duration_ns > 0);
+
+  printf("scenario=%s mode=%s latency=%s workers=%" PRIu64
+         " requests=%" PRIu64 " errors=%" PRIu64 " req_per_s=%" PRIu64
+         " p50_ns=%" PRIu64 " p90_ns=%" PRIu64 " p99_ns=%" PRIu64
+         " p999_ns=%" PRIu64 " p9999_ns=%" PRIu64 " max_ns=%" PRIu64 "\n",
+         AT(bench_scenario_to_s, BENCH_SCENARIO_MAX, scenario),
+         interval_ns > 0 ? "open" : "closed", latency_kind, workers, requests,
+         errors, requests * 1'000'000'000 / duration_ns,
+         bench_hist_percentile(hist, 500'000),
+         bench_hist_percentile(hist, 900'000),
+         bench_hist_percentile(hist, 990'000),
+         bench_hist_percentile(hist, 999'000),
+         bench_hist_percentile(hist, 999'900), hist->max);
+}
+
+int main(int argc, char *argv[]) {
+  BenchScenario scenario = BENCH_SCENARIO_MIXED;
+  u64 workers = 8;
+  u64 requests = 1'000;
+  u64 rate = 0;
+  u64 max_p99_ns = 0;
+  if (argc >= 2) {
+    scenario = BENCH_SCENARIO_MAX;
+    for (u64 i = 0; i < BENCH_SCENARIO_MAX; i++) {
+      if (0 == strcmp(argv[1], bench_scenario_to_s[i])) {
+        scenario = (BenchScenario)i;
+      }
+    }
+    if (BENCH_SCENARIO_MAX == scenario) {
+      fprintf(stderr, "unknown scenario: %s\n", argv[1]);
+      return EINVAL;
+    }
+  }
+  if (argc >= 3) {
+    workers = strtoull(argv[2], nullptr, 10);
+  }
+  if (argc >= 4) {
+    requests = strtoull(argv[3], nullptr, 10);
+  }
+  if (argc >= 5) {
+    rate = strtoull(argv[4], nullptr, 10);
+  }
+  if (argc >= 6) {
+    max_p99_ns = strtoull(argv[5], nullptr, 10);
+  }
+  if (0 == workers || 0 == requests) {
+    fprintf(stderr, "workers and requests must be positive\n");
+    return EINVAL;
+  }
+
+  Arena arena = arena_make_from_virtual_mem(64 * 1024 * KiB);
+
+  BenchTarget target = {.port = HTTP_SERVER_DEFAULT_PORT};
+  bench_setup(&target, &arena);
+
+  BenchWorkerResult *results =
+      mmap(nullptr, workers * sizeof(BenchWorkerResult),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  ASSERT(MAP_FAILED != results);
+
+  const u64 interval_ns = rate > 0 ? workers * 1'000'000'000 / rate : 0;
+  for (u64 i = 0; i < workers; i++) {
+    const pid_t pid = fork();
+    ASSERT(-1 != pid);
+    if (0 == pid) {
+      bench_worker_run(scenario, &target, requests, interval_ns, &results[i],
+                       &arena);
+      exit(0);
+    }
+  }
+  for (u64 i = 0; i < workers; i++) {
+    int status = 0;
+    ASSERT(-1 != wait(&status));
+    ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+  }
+
+  BenchHist *latency = arena_new(&arena, BenchHist, 1);
+  u64 errors = 0;
+  u64 start_ns = UINT64_MAX;
+  u64 end_ns = 0;
+  u64 busy_ns = 0;
+  for (u64 i = 0; i < workers; i++) {
+    bench_hist_merge(latency, &results[i].latency);
+    errors += results[i].errors;
+    start_ns = results[i].start_ns < start_ns ? results[i].start_ns : start_ns;
+    end_ns = results[i].end_ns > end_ns ? results[i].end_ns : end_ns;
+    busy_ns += results[i].end_ns - results[i].start_ns;
+  }
+
+  const u64 total = latency->total;
+  bench_print(scenario, interval_ns, "raw", workers, total, errors,
+              end_ns - start_ns, latency);
+
+  BenchHist *reported = latency;
+  if (0 == interval_ns) {
+    BenchHist *corrected = arena_new(&arena, BenchHist, 1);
+    bench_hist_correct(latency, busy_ns / total, corrected);
+    bench_print(scenario, interval_ns, "corrected", workers, total, errors,
+                end_ns - start_ns, corrected);
+    reported = corrected;
+  }
+
+  if (max_p99_ns > 0 && bench_hist_percentile(reported, 990'000) > max_p99_ns) {
+    fprintf(stderr, "p99 above the maximum: %" PRIu64 " > %" PRIu64 "\n",
+            bench_hist_percentile(reported, 990'000), max_p99_ns);
+    return 1;
+  }
+}
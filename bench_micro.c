@@ -0,0 +1,315 @@
+#include "http.c"
+#include <inttypes.h>
+#include <stdio.h>
+
+// Microbenchmarks of the request path: parsing, form decoding, cookies, JSON,
+// HTML rendering and response serialization.
+// Usage: `./bench_micro.bin [filter]`, to only run the benchmarks whose name
+// contains `filter`.
+// Results are printed in logfmt, one line per benchmark, with the time and the
+// arena memory per operation, and `commit=...` when `BENCH_COMMIT` is set, to
+// be tracked over commits.
+
+// Each benchmark runs for at least that long.
+static const u64 BENCH_MICRO_MIN_NS = 200'000'000;
+
+typedef void (*BenchMicroFn)(void *ctx, Arena *arena);
+
+// Defeat dead code elimination.
+static volatile u64 bench_micro_sink = 0;
+
+static void bench_micro_run(const char *filter, const char *name,
+                            BenchMicroFn fn, void *ctx, Arena *arena) {
+  if (nullptr != filter && nullptr == strstr(name, filter)) {
+    return;
+  }
+
+  // Warm up.
+  {
+    Arena tmp_arena = *arena;
+    fn(ctx, &tmp_arena);
+  }
+
+  u64 iterations = 0;
+  u64 bytes = 0;
+  const u64 start_ns = clock_monotonic_ns();
+  u64 duration_ns = 0;
+  do {
+    for (u64 i = 0; i < 64; i++) {
+      Arena tmp_arena = *arena;
+      fn(ctx, &tmp_arena);
+      bytes += (u64)tmp_arena.start - (u64)arena->start;
+    }
+    iterations += 64;
+    duration_ns = clock_monotonic_ns() - start_ns;
+  } while (duration_ns < BENCH_MICRO_MIN_NS);
+
+  const char *commit = getenv("BENCH_COMMIT");
+  printf("name=%s iterations=%" PRIu64 " ns_per_op=%" PRIu64
+         " bytes_per_op=%" PRIu64 "%s%s\n",
+         name, iterations, duration_ns / iterations, bytes / iterations,
+         nullptr != commit ? " commit=" : "",
+         nullptr != commit ? commit : "");
+}
+
+// --- Request parsing.
+
+// The request goes through a pipe, so that it is read the way the server reads
+// it from a socket, with a `BufferedReader`.
+typedef struct {
+  String request;
+  int fds[2];
+} BenchRequestRead;
+
+static void bench_request_read(void *ctx, Arena *arena) {
+  BenchRequestRead *bench = ctx;
+  ASSERT((i64)bench->request.len ==
+         write(bench->fds[1], bench->request.data, bench->request.len));
+
+  BufferedReader reader = buffered_reader_make(bench->fds[0], arena);
+  const HttpRequest req = request_read(&reader, arena);
+  ASSERT(0 == req.err);
+  bench_micro_sink += req.headers.len;
+}
+
+static void bench_form_data_parse(void *ctx, Arena *arena) {
+  const String *form = ctx;
+  FormDataParseResult res = form_data_parse(*form, arena);
+  ASSERT(0 == res.err);
+  bench_micro_sink += res.form.len;
+}
+
+static void bench_cookie_extract(void *ctx, Arena *arena) {
+  const HttpRequest *req = ctx;
+  String user_id =
+      http_req_extract_cookie_with_name(*req, S("__Secure-user_id"), arena);
+  ASSERT(!slice_is_empty(user_id));
+  bench_micro_sink += user_id.len;
+}
+
+// --- JSON.
+
+static void bench_json_encode(void *ctx, Arena *arena) {
+  const StringSlice *options = ctx;
+  String encoded = json_encode_string_slice(*options, arena);
+  bench_micro_sink += encoded.len;
+}
+
+static void bench_json_decode(void *ctx, Arena *arena) {
+  const String *encoded = ctx;
+  JsonParseStringStrResult decoded = json_decode_string_slice(*encoded, arena);
+  ASSERT(!decoded.err);
+  bench_micro_sink += decoded.string_slice.len;
+}
+
+// --- HTML.
+
+static void bench_html_push_attr(HtmlElement *e, String key, String value,
+                                 Arena *arena) {
+  *dyn_push(&e->attributes, arena) = (KeyValue){.key = key, .value = value};
+}
+
+// The same structure as the home page: a form to create a poll.
+static void bench_html_home(void *ctx, Arena *arena) {
+  (void)ctx;
+
+  HtmlDocument document = html_make(S("Create a poll"), arena);
+
+  HtmlElement form = {.kind = HTML_FORM};
+  bench_html_push_attr(&form, S("action"), S("/poll"), arena);
+  bench_html_push_attr(&form, S("method"), S("post"), arena);
+
+  HtmlElement fieldset = {.kind = HTML_FIELDSET};
+  *dyn_push(&fieldset.children, arena) =
+      (HtmlElement){.kind = HTML_LEGEND, .text = S("New poll")};
+
+  HtmlElement label = {.kind = HTML_LABEL};
+  bench_html_push_attr(&label, S("for"), S("name"), arena);
+  *dyn_push(&label.children, arena) =
+      (HtmlElement){.kind = HTML_TEXT, .text = S("Subject")};
+  *dyn_push(&fieldset.children, arena) = label;
+
+  HtmlElement input = {.kind = HTML_INPUT};
+  bench_html_push_attr(&input, S("id"), S("name"), arena);
+  bench_html_push_attr(&input, S("name"), S("name"), arena);
+  bench_html_push_attr(&input, S("placeholder"),
+                       S("Where do we go on vacation?"), arena);
+  *dyn_push(&fieldset.children, arena) = input;
+  *dyn_push(&form.children, arena) = fieldset;
+
+  HtmlElement add = {.kind = HTML_BUTTON, .text = S("+")};
+  bench_html_push_attr(&add, S("type"), S("button"), arena);
+  bench_html_push_attr(&add, S("id"), S("add-poll-option"), arena);
+  *dyn_push(&form.children, arena) = add;
+
+  HtmlElement submit = {.kind = HTML_BUTTON, .text = S("Create")};
+  bench_html_push_attr(&submit, S("type"), S("submit"), arena);
+  *dyn_push(&form.children, arena) = submit;
+
+  *dyn_push(&document.body.children, arena) = form;
+
+  DynU8 sb = {0};
+  html_document_to_string(document, &sb, arena);
+  bench_micro_sink += sb.len;
+}
+
+// The same structure as a poll page: its name and its options.
+static void bench_html_poll(void *ctx, Arena *arena) {
+  const StringSlice *options = ctx;
+
+  HtmlDocument document = html_make(S("Poll"), arena);
+
+  HtmlElement div = {.kind = HTML_DIV};
+  HtmlElement span = {.kind = HTML_SPAN};
+  *dyn_push(&span.children, arena) = (HtmlElement){
+      .kind = HTML_TEXT,
+      .text = S("The poll \"Where do we go on <vacation>?\" is open."),
+  };
+  *dyn_push(&div.children, arena) = span;
+
+  HtmlElement ol = {.kind = HTML_OL};
+  bench_html_push_attr(&ol, S("id"), S("poll-options-list"), arena);
+  for (u64 i = 0; i < options->len; i++) {
+    HtmlElement li = {.kind = HTML_LI};
+    *dyn_push(&li.children, arena) =
+        (HtmlElement){.kind = HTML_TEXT, .text = slice_at(*options, i)};
+    *dyn_push(&ol.children, arena) = li;
+  }
+  *dyn_push(&div.children, arena) = ol;
+  *dyn_push(&document.body.children, arena) = div;
+
+  DynU8 sb = {0};
+  html_document_to_string(document, &sb, arena);
+  bench_micro_sink += sb.len;
+}
+
+// --- Responses.
+
+static void bench_response_serialize(void *ctx, Arena *arena) {
+  const HttpResponse *res = ctx;
+  String s = response_serialize(*res, arena);
+  bench_micro_sink += s.len;
+}
+
+// Into `/dev/null`, to only measure the serialization and the syscall.
+typedef struct {
+  HttpResponse res;
+  int fd;
+} BenchResponseWrite;
+
+static void bench_response_write(void *ctx, Arena *arena) {
+  BenchResponseWrite *bench = ctx;
+  HttpExchange exchange = {0};
+  Writer writer = {.fd = bench->fd};
+  ASSERT(0 == response_write(&writer, bench->res, &exchange, arena));
+}
+
+int main(int argc, char *argv[]) {
+  const char *filter = argc >= 2 ? argv[1] : nullptr;
+
+  Arena arena = arena_make_from_virtual_mem(64 * 1024 * KiB);
+
+  {
+    BenchRequestRead bench = {
+        .request = S("GET /poll/7n42DGM5Tflk9n8mt7Fhc7 HTTP/1.1\r\n"
+                     "Host: localhost:12345\r\n"
+                     "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:128.0) "
+                     "Gecko/20100101 Firefox/128.0\r\n"
+                     "Accept: text/html,application/xhtml+xml\r\n"
+                     "Accept-Language: en-US,en;q=0.5\r\n"
+                     "Accept-Encoding: gzip, deflate, br\r\n"
+                     "Cookie: __Secure-user_id=0b43c1f0e6d4a6f1c0a5b4e3\r\n"
+                     "\r\n"),
+    };
+    ASSERT(0 == pipe(bench.fds));
+    bench_micro_run(filter, "request_read_get", bench_request_read, &bench,
+                    &arena);
+
+    bench.request =
+        S("POST /poll HTTP/1.1\r\n"
+          "Host: localhost:12345\r\n"
+          "Content-Type: application/x-www-form-urlencoded\r\n"
+          "Content-Length: 73\r\n"
+          "\r\n"
+          "name=Where+do+we+go+on+vacation%3F&option=Lisbon&option=Lyon&"
+          "option=Tokyo");
+    bench_micro_run(filter, "request_read_post", bench_request_read, &bench,
+                    &arena);
+    (void)close(bench.fds[0]);
+    (void)close(bench.fds[1]);
+  }
+
+  {
+    String form = S("name=Where+do+we+go+on+vacation%3F&option=Lisbon&option="
+                    "Lyon&option=Tokyo");
+    bench_micro_run(filter, "form_data_parse_small", bench_form_data_parse,
+                    &form, &arena);
+
+    DynU8 large = {0};
+    dyn_append_slice(&large, S("name=Which+one%3F"), &arena);
+    for (u64 i = 0; i < 200; i++) {
+      dyn_append_slice(&large, S("&option=Caf%C3%A9+num%C3%A9ro+"), &arena);
+      dynu8_append_u64_to_string(&large, i, &arena);
+    }
+    form = dyn_slice(String, large);
+    bench_micro_run(filter, "form_data_parse_large", bench_form_data_parse,
+                    &form, &arena);
+  }
+
+  {
+    HttpRequest req = {0};
+    http_push_header(&req.headers, S("Host"), S("localhost:12345"), &arena);
+    http_push_header(&req.headers, S("Accept"), S("text/html"), &arena);
+    http_push_header(&req.headers, S("Cookie"),
+                     S("theme=dark; lang=en; "
+                       "__Secure-user_id=0b43c1f0e6d4a6f1c0a5b4e3"),
+                     &arena);
+    bench_micro_run(filter, "cookie_extract", bench_cookie_extract, &req,
+                    &arena);
+  }
+
+  DynString dyn_options = {0};
+  for (u64 i = 0; i < 10; i++) {
+    DynU8 option = {0};
+    dyn_append_slice(&option, S("Option \"number\" "), &arena);
+    dynu8_append_u64_to_string(&option, i, &arena);
+    *dyn_push(&dyn_options, &arena) = dyn_slice(String, option);
+  }
+  StringSlice options = dyn_slice(StringSlice, dyn_options);
+
+  {
+    bench_micro_run(filter, "json_encode_string_slice", bench_json_encode,
+                    &options, &arena);
+    String encoded = json_encode_string_slice(options, &arena);
+    bench_micro_run(filter, "json_decode_string_slice", bench_json_decode,
+                    &encoded, &arena);
+  }
+
+  bench_micro_run(filter, "html_document_to_string_home", bench_html_home,
+                  nullptr, &arena);
+  bench_micro_run(filter, "html_document_to_string_poll", bench_html_poll,
+                  &options, &arena);
+
+  {
+    u8 *body = arena_new(&arena, u8, 4 * KiB);
+    memset(body, 'x', 4 * KiB);
+    HttpResponse res = {
+        .status = 200,
+        .body = (String){.data = body, .len = 4 * KiB},
+    };
+    http_push_header(&res.headers, S("Content-Type"), S("text/html"), &arena);
+    http_push_header(&res.headers, S("Set-Cookie"),
+                     S("__Secure-user_id=0b43c1f0e6d4a6f1c0a5b4e3; Secure; "
+                       "HttpOnly; SameSite=Strict"),
+                     &arena);
+    http_push_header(&res.headers, S("Connection"), S("close"), &arena);
+    bench_micro_run(filter, "response_serialize", bench_response_serialize,
+                    &res, &arena);
+
+    BenchResponseWrite bench = {.res = res, .fd = open("/dev/null", O_WRONLY)};
+    ASSERT(-1 != bench.fd);
+    bench_micro_run(filter, "response_write", bench_response_write, &bench,
+                    &arena);
+    (void)close(bench.fd);
+  }
+}
@@ -4,33 +4,116 @@ set -f # disable globbing.
 
 CFLAGS="${CFLAGS}"
 EXTRA_FLAGS=""
+# Log lines below this level are compiled out. Overridable, e.g.
+# `LOG_LEVEL_MIN=LOG_LEVEL_ERROR ./build.sh release`.
+LOG_LEVEL_MIN="${LOG_LEVEL_MIN}"
 CC="${CC:-clang}"
+LLVM_PROFDATA="${LLVM_PROFDATA:-llvm-profdata}"
 WARNINGS="$(tr -s '\n' ' ' < compile_flags.txt)"
-SQLITE_OPTIONS="$(tr -s '\n' ' ' < sqlite_options.txt)"
+# E.g. `SQLITE_OPTIONS_FILE=sqlite_options_server.txt`. Lines starting with
+# `#` are comments.
+SQLITE_OPTIONS_FILE="${SQLITE_OPTIONS_FILE:-sqlite_options.txt}"
+SQLITE_OPTIONS="$(grep -v '^#' "$SQLITE_OPTIONS_FILE" | tr -s '\n' ' ')"
+# From `install.sh`, unless SQLite is compiled here for LTO.
+SQLITE_OBJECT="sqlite3.o"
+# Only for the server and SQLite.
+PROFILE_FLAGS=""
+LINK_FLAGS="-Wl,--gc-sections"
 
 error() {
 	printf "ERROR: %s\n" "$1"
 	exit 1
 }
 
+# Run the instrumented server under the load generator (see `bench.sh load`),
+# from an empty database, and merge the profiles into `main.profdata`.
+pgo_train() {
+  PGO_DIR="$(mktemp -d)"
+  build release-pgo-generate
+
+  # shellcheck disable=SC2086
+  "$CC" $WARNINGS -g3 -O3 -march=native bench_load.c -o bench_load.bin $CFLAGS
+  cp main.bin main.css main.js "$PGO_DIR"
+  # Each worker process writes its profile when exiting; `%m` merges them as
+  # they come.
+  (cd "$PGO_DIR" && LOG_SAMPLE_RATE=0 \
+    LLVM_PROFILE_FILE="$PGO_DIR/main-%m.profraw" exec ./main.bin > /dev/null) &
+  SERVER_PID=$!
+  trap 'kill $SERVER_PID; rm -rf "$PGO_DIR"' EXIT
+  sleep 1
+  ./bench_load.bin mixed 8 2000 > /dev/null
+  # The profiles come from the worker processes, which exit normally after
+  # each request. The server itself is killed and does not write one.
+  kill "$SERVER_PID"
+  wait "$SERVER_PID" || true
+  trap - EXIT
+
+  set +f
+  if ! ls "$PGO_DIR"/*.profraw > /dev/null 2>&1; then
+    rm -rf "$PGO_DIR"
+    error "No profile written by the training run!"
+  fi
+  "$LLVM_PROFDATA" merge -output=main.profdata "$PGO_DIR"/*.profraw
+  set -f
+  rm -rf "$PGO_DIR"
+}
+
 build() {
 case $1 in 
   debug)
     EXTRA_FLAGS="-O0"
+    LOG_LEVEL_MIN="${LOG_LEVEL_MIN:-LOG_LEVEL_DEBUG}"
     ;;
   sanitizer)
     EXTRA_FLAGS="-fsanitize=undefined -fsanitize-trap=all"
+    LOG_LEVEL_MIN="${LOG_LEVEL_MIN:-LOG_LEVEL_DEBUG}"
     ;;
   release)
     EXTRA_FLAGS="-O3 -march=native"
+    LOG_LEVEL_MIN="${LOG_LEVEL_MIN:-LOG_LEVEL_INFO}"
+    ;;
+  # Link time optimization across our code and SQLite.
+  release-lto)
+    EXTRA_FLAGS="-O3 -march=native -flto=thin"
+    LOG_LEVEL_MIN="${LOG_LEVEL_MIN:-LOG_LEVEL_INFO}"
+    SQLITE_OBJECT="sqlite3_lto.o"
+    LINK_FLAGS="$LINK_FLAGS -fuse-ld=lld"
+    ;;
+  # Step of `release-pgo`.
+  release-pgo-generate)
+    EXTRA_FLAGS="-O3 -march=native -flto=thin"
+    LOG_LEVEL_MIN="${LOG_LEVEL_MIN:-LOG_LEVEL_INFO}"
+    SQLITE_OBJECT="sqlite3_lto.o"
+    PROFILE_FLAGS="-fprofile-generate"
+    LINK_FLAGS="$LINK_FLAGS -fuse-ld=lld"
+    ;;
+  # LTO, plus profile guided optimization from a run of the load generator.
+  release-pgo)
+    pgo_train
+    EXTRA_FLAGS="-O3 -march=native -flto=thin"
+    # Same as the training build, for the profile to match.
+    LOG_LEVEL_MIN="${LOG_LEVEL_MIN:-LOG_LEVEL_INFO}"
+    SQLITE_OBJECT="sqlite3_lto.o"
+    PROFILE_FLAGS="-fprofile-use=main.profdata"
+    LINK_FLAGS="-Wl,--gc-sections -fuse-ld=lld"
     ;;
 	*)
 		error "Build mode \"$1\" unsupported!"
 		;;
 esac
+EXTRA_FLAGS="$EXTRA_FLAGS -DLOG_LEVEL_MIN=$LOG_LEVEL_MIN"
+
+if [ "$SQLITE_OBJECT" != "sqlite3.o" ]; then
+  # shellcheck disable=SC2086
+  "$CC" sqlite3.c -c -o "$SQLITE_OBJECT" -g $EXTRA_FLAGS $PROFILE_FLAGS $CFLAGS $SQLITE_OPTIONS
+fi
+
+# shellcheck disable=SC2086
+"$CC" $WARNINGS -g3 main.c "$SQLITE_OBJECT" -o main.bin $EXTRA_FLAGS $PROFILE_FLAGS $CFLAGS $SQLITE_OPTIONS $LINK_FLAGS
 
+# Reads the logs written with `LOG_FORMAT=binary`.
 # shellcheck disable=SC2086
-"$CC" $WARNINGS -g3 main.c sqlite3.o -o main.bin $EXTRA_FLAGS $CFLAGS $SQLITE_OPTIONS -Wl,--gc-sections
+"$CC" $WARNINGS -g3 log_decode.c -o log_decode.bin $EXTRA_FLAGS $CFLAGS $LINK_FLAGS
 }
 
 if [ $# -eq 0 ]; then
@@ -0,0 +1,234 @@
+#ifndef CHTTP_CACHE_C
+#define CHTTP_CACHE_C
+
+#include "http.c"
+#include <sched.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+
+// Fixed-size, direct-mapped cache keyed by `Id128`, in memory shared by all
+// the worker processes. It must be created before forking them.
+//
+// Each slot is protected by a sequence number (seqlock): it is odd while a
+// writer modifies the slot. Readers take no lock: they copy the value out and
+// check that the sequence number did not change meanwhile, otherwise it is a
+// miss.
+// A miss returns a ticket (the sequence number observed). Filling the slot
+// after the miss only succeeds if the slot has not been modified since, so
+// that a value read from the database before an invalidation is never stored
+// after it.
+
+typedef struct {
+  _Atomic u64 seq;
+  Id128 key;
+  // 0 means empty.
+  u64 value_len;
+  u8 value[];
+} ShmCacheSlot;
+
+typedef struct {
+  _Atomic u64 hits;
+  _Atomic u64 misses;
+  _Atomic u64 fills;
+  _Atomic u64 invalidations;
+  // Slots taken out of use after a writer died holding them.
+  _Atomic u64 lost;
+} ShmCacheStats;
+
+typedef struct {
+  // `nullptr` when the cache is disabled: every lookup is then a miss.
+  u8 *slots;
+  ShmCacheStats *stats;
+  // Power of two.
+  u64 slots_len;
+  u64 slot_size;
+  u64 value_cap;
+} ShmCache;
+
+typedef struct {
+  // Copied in the arena, only valid if `hit`.
+  String value;
+  bool hit;
+  u64 ticket;
+} ShmCacheGetResult;
+
+[[maybe_unused]] [[nodiscard]] static Error
+shm_cache_init(ShmCache *cache, u64 slots_len, u64 value_cap) {
+  ASSERT(nullptr == cache->slots);
+  ASSERT(slots_len > 0);
+  ASSERT(0 == (slots_len & (slots_len - 1)));
+  ASSERT(value_cap > 0);
+
+  // Avoid false sharing between slots.
+  const u64 cache_line = 64;
+  const u64 slot_size = (sizeof(ShmCacheSlot) + value_cap + cache_line - 1) /
+                        cache_line * cache_line;
+  const u64 stats_size = cache_line;
+  static_assert(sizeof(ShmCacheStats) <= 64);
+
+  // Lookups hit random slots: huge pages avoid a TLB miss for most of them.
+  u8 *mem = mmap_shared_huge(stats_size + slots_len * slot_size);
+  if (MAP_FAILED == mem) {
+    return (Error)errno;
+  }
+
+  cache->stats = (ShmCacheStats *)(void *)mem;
+  cache->slots = mem + stats_size;
+  cache->slots_len = slots_len;
+  cache->slot_size = slot_size;
+  cache->value_cap = value_cap;
+
+  return 0;
+}
+
+[[nodiscard]] static ShmCacheSlot *shm_cache_slot(ShmCache *cache, Id128 key) {
+  u64 idx = id128_hash_index(key, cache->slots_len);
+  return (ShmCacheSlot *)(void *)(cache->slots + idx * cache->slot_size);
+}
+
+[[maybe_unused]] [[nodiscard]] static ShmCacheGetResult
+shm_cache_get(ShmCache *cache, Id128 key, Arena *arena) {
+  ShmCacheGetResult res = {0};
+  if (nullptr == cache->slots) {
+    return res;
+  }
+
+  ShmCacheSlot *slot = shm_cache_slot(cache, key);
+  res.ticket = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+  // Read once: a writer may change it meanwhile.
+  const u64 len = slot->value_len;
+  if ((res.ticket & 1) || !id128_eq(slot->key, key) || 0 == len ||
+      len > cache->value_cap) {
+    goto miss;
+  }
+
+  u8 *copy = arena_new(arena, u8, len);
+  memcpy(copy, slot->value, len);
+
+  atomic_thread_fence(memory_order_acquire);
+  if (res.ticket != atomic_load_explicit(&slot->seq, memory_order_relaxed)) {
+    // Concurrent write: the copy may be torn.
+    goto miss;
+  }
+
+  res.value = (String){.data = copy, .len = len};
+  res.hit = true;
+  atomic_fetch_add_explicit(&cache->stats->hits, 1, memory_order_relaxed);
+  return res;
+
+miss:
+  atomic_fetch_add_explicit(&cache->stats->misses, 1, memory_order_relaxed);
+  return res;
+}
+
+// Best effort: dropped if the value is too big, or if the slot was modified
+// since the miss that produced `ticket`.
+// The value is the concatenation of the parts, to avoid building it in memory
+// first.
+[[maybe_unused]] static void shm_cache_put_parts(ShmCache *cache, Id128 key,
+                                                 u64 ticket,
+                                                 StringSlice value_parts) {
+  if (nullptr == cache->slots || (ticket & 1)) {
+    return;
+  }
+
+  u64 value_len = 0;
+  for (u64 i = 0; i < value_parts.len; i++) {
+    value_len += slice_at(value_parts, i).len;
+  }
+  if (0 == value_len || value_len > cache->value_cap) {
+    return;
+  }
+
+  ShmCacheSlot *slot = shm_cache_slot(cache, key);
+  u64 expected = ticket;
+  if (!atomic_compare_exchange_strong_explicit(&slot->seq, &expected,
+                                               ticket + 1, memory_order_acquire,
+                                               memory_order_relaxed)) {
+    return;
+  }
+  atomic_thread_fence(memory_order_release);
+
+  slot->key = key;
+  slot->value_len = value_len;
+  u64 offset = 0;
+  for (u64 i = 0; i < value_parts.len; i++) {
+    String part = slice_at(value_parts, i);
+    if (slice_is_empty(part)) {
+      continue;
+    }
+    memcpy(slot->value + offset, part.data, part.len);
+    offset += part.len;
+  }
+
+  // Fails if an invalidation gave up waiting and took the slot out of use.
+  u64 locked = ticket + 1;
+  if (!atomic_compare_exchange_strong_explicit(&slot->seq, &locked, ticket + 2,
+                                               memory_order_release,
+                                               memory_order_relaxed)) {
+    return;
+  }
+  atomic_fetch_add_explicit(&cache->stats->fills, 1, memory_order_relaxed);
+}
+
+[[maybe_unused]] static void shm_cache_put(ShmCache *cache, Id128 key,
+                                           u64 ticket, String value) {
+  shm_cache_put_parts(cache, key, ticket,
+                      (StringSlice){.data = &value, .len = 1});
+}
+
+// A writer holds a slot for a `memcpy`. If it is still held after that many
+// tries, the writer is presumed dead, e.g. a worker crashed in the middle.
+static const u64 SHM_CACHE_INVALIDATE_TRIES = 100'000;
+// Odd, so that the slot always misses and every fill is rejected.
+static const u64 SHM_CACHE_SLOT_LOST = UINT64_MAX;
+
+// Must be called after the change is committed to the database.
+[[maybe_unused]] static void shm_cache_invalidate(ShmCache *cache, Id128 key) {
+  if (nullptr == cache->slots) {
+    return;
+  }
+
+  ShmCacheSlot *slot = shm_cache_slot(cache, key);
+  u64 seq = 0;
+  // Wait for a concurrent writer, which may be storing a stale value, to
+  // finish.
+  for (u64 i = 0;; i++) {
+    seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    if (SHM_CACHE_SLOT_LOST == seq) {
+      return;
+    }
+    if (0 == (seq & 1) &&
+        atomic_compare_exchange_weak_explicit(&slot->seq, &seq, seq + 1,
+                                              memory_order_acquire,
+                                              memory_order_relaxed)) {
+      break;
+    }
+
+    // Give up on the slot rather than hang. If the writer is only slow, it
+    // notices when publishing and the stale value is never visible.
+    if (i >= SHM_CACHE_INVALIDATE_TRIES && (seq & 1) &&
+        atomic_compare_exchange_strong_explicit(
+            &slot->seq, &seq, SHM_CACHE_SLOT_LOST, memory_order_relaxed,
+            memory_order_relaxed)) {
+      atomic_fetch_add_explicit(&cache->stats->lost, 1, memory_order_relaxed);
+      return;
+    }
+    sched_yield();
+  }
+  atomic_thread_fence(memory_order_release);
+
+  // Even if the slot holds another key: bumping the sequence number is enough
+  // to reject a fill based on a value read before this point.
+  if (id128_eq(slot->key, key)) {
+    slot->value_len = 0;
+  }
+
+  atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+  atomic_fetch_add_explicit(&cache->stats->invalidations, 1,
+                            memory_order_relaxed);
+}
+
+#endif
@@ -0,0 +1,1710 @@
+#ifndef CHTTP_DB_C
+#define CHTTP_DB_C
+
+#include "./sqlite3.h"
+#include "cache.c"
+#include "http.c"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <time.h>
+
+typedef enum {
+  DB_ERR_NONE,
+  DB_ERR_NOT_FOUND,
+  DB_ERR_INVALID_USE,
+  DB_ERR_INVALID_DATA,
+} DatabaseError;
+
+typedef enum : u8 {
+  POLL_STATE_OPEN,
+  POLL_STATE_CLOSED,
+  POLL_STATE_MAX, // Pseudo-value.
+} PollState;
+
+typedef struct {
+  i64 db_id;
+  Id128 id;
+  PollState state;
+  String name;
+  StringSlice options;
+  String created_at;
+  String created_by;
+} Poll;
+
+typedef struct {
+  DatabaseError err;
+  Poll poll;
+} DbGetPollResult;
+
+// A storage backend. All the data access goes through one.
+typedef struct {
+  String name;
+  DatabaseError (*setup)(const char *path, Arena *arena);
+  DatabaseError (*create_poll)(String req_id, Poll poll, Arena *arena);
+  DbGetPollResult (*get_poll)(String req_id, Id128 poll_id, Arena *arena);
+  DatabaseError (*cast_vote)(String req_id, Id128 poll_id, String user_id,
+                             StringSlice vote_options, Arena *arena);
+} DbBackend;
+
+// Check that the options sent match the options for the poll.
+[[nodiscard]] static bool db_vote_options_valid(StringSlice vote_options,
+                                                StringSlice poll_options) {
+  if (vote_options.len != poll_options.len) {
+    return false;
+  }
+
+  for (u64 i_vote = 0; i_vote < vote_options.len; i_vote++) {
+    String vote_option = slice_at(vote_options, i_vote);
+
+    bool found = false;
+    for (u64 i_poll = 0; i_poll < poll_options.len; i_poll++) {
+      String poll_option = slice_at(poll_options, i_poll);
+
+      if (string_eq(vote_option, poll_option)) {
+        found = true;
+        break;
+      }
+    }
+
+    if (!found) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+// Binary representation of a poll, used by the key-value backend and the poll
+// cache: the fields `[state, name, created_at, created_by, options]` encoded
+// with `binary_encode_string_slice`, the options being themselves encoded the
+// same way. `db_id` is not part of it.
+[[nodiscard]] static String db_poll_encode(Poll poll, Arena *arena) {
+  ASSERT(!slice_is_empty(poll.created_at));
+
+  u8 state = (u8)poll.state;
+  String fields[] = {
+      (String){.data = &state, .len = 1},
+      poll.name,
+      poll.created_at,
+      poll.created_by,
+      binary_encode_string_slice(poll.options, arena),
+  };
+  return binary_encode_string_slice(
+      (StringSlice){.data = fields, .len = static_array_len(fields)}, arena);
+}
+
+// Zero-copy: the poll points inside `encoded`.
+[[nodiscard]] static DbGetPollResult db_poll_decode(String req_id, Id128 id,
+                                                    String encoded,
+                                                    Arena *arena) {
+  DbGetPollResult res = {0};
+
+  BinaryDecodeStringSliceResult fields =
+      binary_decode_string_slice(encoded, arena);
+  if (fields.err || 5 != fields.string_slice.len) {
+    log_at(LOG_LEVEL_ERROR, "invalid encoded poll", arena, L("req.id", req_id),
+           L("len", encoded.len), L("error", fields.err));
+    res.err = DB_ERR_INVALID_DATA;
+    return res;
+  }
+
+  String state = slice_at(fields.string_slice, 0);
+  if (1 != state.len || state.data[0] >= POLL_STATE_MAX) {
+    log_at(LOG_LEVEL_ERROR, "invalid poll state", arena, L("req.id", req_id));
+    res.err = DB_ERR_INVALID_DATA;
+    return res;
+  }
+
+  BinaryDecodeStringSliceResult options =
+      binary_decode_string_slice(slice_at(fields.string_slice, 4), arena);
+  if (options.err) {
+    log_at(LOG_LEVEL_ERROR, "invalid poll options", arena, L("req.id", req_id),
+           L("error", options.err));
+    res.err = DB_ERR_INVALID_DATA;
+    return res;
+  }
+
+  res.poll.id = id;
+  res.poll.state = (PollState)state.data[0];
+  res.poll.name = slice_at(fields.string_slice, 1);
+  res.poll.created_at = slice_at(fields.string_slice, 2);
+  res.poll.created_by = slice_at(fields.string_slice, 3);
+  res.poll.options = options.string_slice;
+
+  return res;
+}
+
+// --- SQLite backend.
+
+static sqlite3 *db = nullptr;
+static sqlite3_stmt *db_insert_poll_stmt = nullptr;
+static sqlite3_stmt *db_select_poll_stmt = nullptr;
+static sqlite3_stmt *db_insert_vote_stmt = nullptr;
+
+// Operations of this process which gave up waiting on a lock (`SQLITE_BUSY`,
+// once `busy_timeout` elapsed). Read by the benchmarks.
+static u64 db_sqlite_busy_count = 0;
+
+// Set once the checkpointer process runs: connections then leave the
+// checkpoints to it.
+static bool db_sqlite_checkpointer_running = false;
+
+static void db_sqlite_count_busy(int db_err) {
+  // Extended result codes e.g. `SQLITE_BUSY_SNAPSHOT` included.
+  if (SQLITE_BUSY == (db_err & 0xff)) {
+    db_sqlite_busy_count += 1;
+  }
+}
+
+static void db_sqlite_rollback(String req_id, Arena *arena) {
+  int db_err = 0;
+  if (SQLITE_OK !=
+      (db_err = sqlite3_exec(db, "ROLLBACK", nullptr, nullptr, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to rollback transaction", arena,
+           L("req.id", req_id), L("error", db_err));
+  }
+}
+
+[[nodiscard]] static DatabaseError db_sqlite_create_poll(String req_id,
+                                                         Poll poll,
+                                                         Arena *arena) {
+  ASSERT(!slice_is_empty(poll.created_by));
+
+  int db_err = 0;
+  if (SQLITE_OK != (db_err = sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr,
+                                          nullptr, nullptr))) {
+    db_sqlite_count_busy(db_err);
+    log_at(LOG_LEVEL_ERROR, "failed to begin transaction", arena,
+           L("req.id", req_id), L("error", db_err));
+    return DB_ERR_INVALID_USE;
+  }
+
+  // Statements are reused across calls in long-lived processes (e.g.
+  // benchmarks).
+  (void)sqlite3_reset(db_insert_poll_stmt);
+
+  u8 poll_id_bytes[16] = {0};
+  id128_to_bytes(poll.id, poll_id_bytes);
+  if (SQLITE_OK != (db_err = sqlite3_bind_blob(
+                        db_insert_poll_stmt, 1, poll_id_bytes,
+                        sizeof(poll_id_bytes), SQLITE_TRANSIENT))) {
+    log_at(LOG_LEVEL_ERROR, "failed to bind parameter 1", arena,
+           L("req.id", req_id), L("error", db_err));
+    goto rollback;
+  }
+
+  if (SQLITE_OK != (db_err = sqlite3_bind_text(db_insert_poll_stmt, 2,
+                                               (const char *)poll.name.data,
+                                               (int)poll.name.len, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to bind parameter 2", arena,
+           L("req.id", req_id), L("error", db_err));
+    goto rollback;
+  }
+
+  String poll_options_encoded =
+      binary_encode_string_slice(poll.options, arena);
+
+  if (SQLITE_OK !=
+      (db_err = sqlite3_bind_blob(db_insert_poll_stmt, 3,
+                                  poll_options_encoded.data,
+                                  (int)poll_options_encoded.len, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to bind parameter 3", arena,
+           L("req.id", req_id), L("error", db_err));
+    goto rollback;
+  }
+
+  if (SQLITE_OK !=
+      (db_err = sqlite3_bind_text(db_insert_poll_stmt, 4,
+                                  (const char *)poll.created_by.data,
+                                  (int)poll.created_by.len, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to bind parameter 4", arena,
+           L("req.id", req_id), L("error", db_err));
+    goto rollback;
+  }
+
+  if (SQLITE_DONE != (db_err = sqlite3_step(db_insert_poll_stmt))) {
+    db_sqlite_count_busy(db_err);
+    log_at(LOG_LEVEL_ERROR,
+           "failed to execute the prepared statement to insert a poll", arena,
+           L("req.id", req_id), L("error", db_err));
+    goto rollback;
+  }
+
+  if (SQLITE_OK !=
+      (db_err = sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr))) {
+    db_sqlite_count_busy(db_err);
+    log_at(LOG_LEVEL_ERROR, "failed to commit creating a poll", arena,
+           L("req.id", req_id), L("error", db_err));
+    goto rollback;
+  }
+
+  return DB_ERR_NONE;
+
+rollback:
+  db_sqlite_rollback(req_id, arena);
+  return DB_ERR_INVALID_USE;
+}
+
+[[nodiscard]] static DbGetPollResult
+db_sqlite_get_poll(String req_id, Id128 poll_id, Arena *arena) {
+  DbGetPollResult res = {0};
+
+  // Invalidates the pointers handed out by the previous call.
+  (void)sqlite3_reset(db_select_poll_stmt);
+
+  u8 poll_id_bytes[16] = {0};
+  id128_to_bytes(poll_id, poll_id_bytes);
+
+  int err = 0;
+  if (SQLITE_OK != (err = sqlite3_bind_blob(db_select_poll_stmt, 1,
+                                            poll_id_bytes,
+                                            sizeof(poll_id_bytes),
+                                            SQLITE_TRANSIENT))) {
+    log_at(LOG_LEVEL_ERROR, "failed to bind parameter 1", arena,
+           L("req.id", req_id), L("error", res.err));
+    res.err = DB_ERR_INVALID_USE;
+    return res;
+  }
+
+  err = sqlite3_step(db_select_poll_stmt);
+  if (SQLITE_DONE == err) {
+    res.err = DB_ERR_NOT_FOUND;
+    return res;
+  }
+
+  if (SQLITE_ROW != err) {
+    db_sqlite_count_busy(err);
+    log_at(LOG_LEVEL_ERROR,
+           "failed to execute the prepared statement to get poll", arena,
+           L("req.id", req_id), L("error", err));
+    res.err = DB_ERR_INVALID_USE;
+    return res;
+  }
+
+  res.poll.db_id = sqlite3_column_int64(db_select_poll_stmt, 0);
+  ASSERT(0 != res.poll.db_id);
+  res.poll.id = poll_id;
+  res.poll.name.data = (u8 *)sqlite3_column_text(db_select_poll_stmt, 1);
+  res.poll.name.len = (u64)sqlite3_column_bytes(db_select_poll_stmt, 1);
+
+  int state = sqlite3_column_int(db_select_poll_stmt, 2);
+  if (state >= POLL_STATE_MAX) {
+    log_at(LOG_LEVEL_ERROR, "invalid poll state", arena, L("state", state),
+           L("req.id", req_id), L("error", err));
+    res.err = DB_ERR_INVALID_DATA;
+    return res;
+  }
+  res.poll.state = (PollState)state;
+
+  // The decoded options point inside the blob, which stays valid until the
+  // statement is stepped again, reset, or finalized.
+  String options_encoded = {0};
+  options_encoded.data = (u8 *)sqlite3_column_blob(db_select_poll_stmt, 3);
+  options_encoded.len = (u64)sqlite3_column_bytes(db_select_poll_stmt, 3);
+
+  BinaryDecodeStringSliceResult options_decoded =
+      binary_decode_string_slice(options_encoded, arena);
+  if (options_decoded.err) {
+    log_at(LOG_LEVEL_ERROR, "invalid poll options", arena, L("req.id", req_id),
+           L("options.len", options_encoded.len),
+           L("error", options_decoded.err));
+    res.err = DB_ERR_INVALID_DATA;
+    return res;
+  }
+
+  res.poll.options = options_decoded.string_slice;
+
+  res.poll.created_at.data = (u8 *)sqlite3_column_text(db_select_poll_stmt, 4);
+  res.poll.created_at.len = (u64)sqlite3_column_bytes(db_select_poll_stmt, 4);
+  ASSERT(!slice_is_empty(res.poll.created_at));
+
+  res.poll.created_by.data = (u8 *)sqlite3_column_text(db_select_poll_stmt, 5);
+  res.poll.created_by.len = (u64)sqlite3_column_bytes(db_select_poll_stmt, 5);
+  ASSERT(!slice_is_empty(res.poll.created_by));
+
+  return res;
+}
+
+[[nodiscard]] static DatabaseError
+db_sqlite_cast_vote(String req_id, Id128 poll_id, String user_id,
+                    StringSlice vote_options, Arena *arena) {
+
+  int err = 0;
+  if (SQLITE_OK !=
+      (err = sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr))) {
+    db_sqlite_count_busy(err);
+    log_at(LOG_LEVEL_ERROR, "failed to begin transaction", arena,
+           L("req.id", req_id), L("error", err));
+    return DB_ERR_INVALID_USE;
+  }
+
+  DatabaseError db_err = DB_ERR_INVALID_USE;
+
+  DbGetPollResult get_poll =
+      db_sqlite_get_poll(req_id, poll_id, arena);
+  if (get_poll.err) {
+    db_err = get_poll.err;
+    goto rollback;
+  }
+  ASSERT(0 != get_poll.poll.db_id);
+
+  if (!db_vote_options_valid(vote_options, get_poll.poll.options)) {
+    db_err = DB_ERR_INVALID_DATA;
+    goto rollback;
+  }
+
+  (void)sqlite3_reset(db_insert_vote_stmt);
+
+  if (SQLITE_OK !=
+      (err = sqlite3_bind_text(db_insert_vote_stmt, 1, (char *)user_id.data,
+                               (int)user_id.len, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to bind parameter 1", arena,
+           L("req.id", req_id), L("error", err));
+    goto rollback;
+  }
+
+  if (SQLITE_OK !=
+      (err = sqlite3_bind_int64(db_insert_vote_stmt, 2, get_poll.poll.db_id))) {
+    log_at(LOG_LEVEL_ERROR, "failed to bind parameter 2", arena,
+           L("req.id", req_id), L("error", err));
+    goto rollback;
+  }
+
+  String poll_options_encoded = json_encode_string_slice(vote_options, arena);
+  if (SQLITE_OK !=
+      (err = sqlite3_bind_text(db_insert_vote_stmt, 3,
+                               (const char *)poll_options_encoded.data,
+                               (int)poll_options_encoded.len, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to bind parameter 3", arena,
+           L("req.id", req_id), L("error", err));
+    goto rollback;
+  }
+
+  if (SQLITE_DONE != (err = sqlite3_step(db_insert_vote_stmt))) {
+    db_sqlite_count_busy(err);
+    log_at(LOG_LEVEL_ERROR,
+           "failed to execute the prepared statement to insert a vote", arena,
+           L("req.id", req_id), L("error", err));
+    goto rollback;
+  }
+
+  if (SQLITE_OK !=
+      (err = sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr))) {
+    db_sqlite_count_busy(err);
+    log_at(LOG_LEVEL_ERROR, "failed to commit creating a vote", arena,
+           L("req.id", req_id), L("error", err));
+    goto rollback;
+  }
+
+  return DB_ERR_NONE;
+
+rollback:
+  db_sqlite_rollback(req_id, arena);
+  return db_err;
+}
+
+// Version of the schema, in `PRAGMA user_version`. Each change of the schema
+// bumps it and adds a step to `db_sqlite_migrate`.
+// - 0: Not versioned yet. Polls have a hex text id (`human_readable_id`) and
+//   JSON options.
+// - 1: Polls have a 16 bytes id (`public_id`) and binary options.
+static const i64 DB_SQLITE_SCHEMA_VERSION = 1;
+
+// For queries returning one integer, e.g. pragmas.
+[[nodiscard]] static DatabaseError db_sqlite_query_i64(const char *sql,
+                                                       i64 *out,
+                                                       Arena *arena) {
+  sqlite3_stmt *stmt = nullptr;
+  int db_err = 0;
+  if (SQLITE_OK != (db_err = sqlite3_prepare_v2(db, sql, -1, &stmt, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to prepare query", arena,
+           L("error", db_err));
+    return DB_ERR_INVALID_USE;
+  }
+
+  DatabaseError err = DB_ERR_NONE;
+  if (SQLITE_ROW == (db_err = sqlite3_step(stmt))) {
+    *out = sqlite3_column_int64(stmt, 0);
+  } else {
+    log_at(LOG_LEVEL_ERROR, "failed to execute query", arena,
+           L("error", db_err));
+    err = DB_ERR_INVALID_USE;
+  }
+  (void)sqlite3_finalize(stmt);
+  return err;
+}
+
+[[nodiscard]] static DatabaseError db_sqlite_exec(const char *sql,
+                                                  Arena *arena) {
+  int db_err = 0;
+  if (SQLITE_OK !=
+      (db_err = sqlite3_exec(db, sql, nullptr, nullptr, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to execute statement", arena,
+           L("error", db_err));
+    return DB_ERR_INVALID_USE;
+  }
+  return DB_ERR_NONE;
+}
+
+static const char db_sqlite_create_polls_sql[] =
+    "create table if not exists polls (id "
+    "integer primary key, name text, "
+    "state int, options blob, public_id blob unique, "
+    "created_at text, created_by text) STRICT";
+
+static const char db_sqlite_create_votes_sql[] =
+    "create table if not exists votes (id "
+    "integer primary key, created_at text, user_id text unique, "
+    "poll_id text,"
+    "options text,"
+    "foreign key(poll_id) references polls(id)"
+    ") STRICT";
+
+// Inverse of the `html_sanitize` that version 0 applied to the form values
+// before storing them; they are now stored as is and escaped when rendered.
+// Its entities have no trailing semicolon. `&` itself was escaped, so an
+// entity in the stored text always comes from a sanitized character.
+[[nodiscard]] static String db_sqlite_v0_unsanitize(String s, Arena *arena) {
+  const struct {
+    String entity;
+    u8 c;
+  } entities[] = {
+      {S("&amp"), '&'}, {S("&lt"), '<'},    {S("&gt"), '>'},
+      {S("&quot"), '"'}, {S("&#x27"), '\''},
+  };
+
+  DynU8 res = {0};
+  for (u64 i = 0; i < s.len;) {
+    bool found = false;
+    for (u64 j = 0; '&' == s.data[i] && j < static_array_len(entities); j++) {
+      String entity = entities[j].entity;
+      if (i + entity.len <= s.len &&
+          0 == memcmp(s.data + i, entity.data, entity.len)) {
+        *dyn_push(&res, arena) = entities[j].c;
+        i += entity.len;
+        found = true;
+        break;
+      }
+    }
+    if (!found) {
+      *dyn_push(&res, arena) = s.data[i];
+      i += 1;
+    }
+  }
+  return dyn_slice(String, res);
+}
+
+[[nodiscard]] static StringSlice
+db_sqlite_v0_unsanitize_all(StringSlice values, Arena *arena) {
+  for (u64 i = 0; i < values.len; i++) {
+    values.data[i] = db_sqlite_v0_unsanitize(values.data[i], arena);
+  }
+  return values;
+}
+
+// Vote options are JSON text, in version 1 too.
+[[nodiscard]] static DatabaseError db_sqlite_migrate_votes_to_v1(Arena *arena) {
+  sqlite3_stmt *select_stmt = nullptr;
+  sqlite3_stmt *update_stmt = nullptr;
+  DatabaseError err = DB_ERR_NONE;
+  int db_err = 0;
+  if (SQLITE_OK != (db_err = sqlite3_prepare_v2(
+                        db, "select id, options from votes", -1, &select_stmt,
+                        nullptr)) ||
+      SQLITE_OK != (db_err = sqlite3_prepare_v2(
+                        db, "update votes set options = ? where id = ?", -1,
+                        &update_stmt, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "migration: failed to prepare statements", arena,
+           L("error", db_err));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+
+  while (SQLITE_ROW == (db_err = sqlite3_step(select_stmt))) {
+    Arena tmp_arena = *arena;
+
+    String options_json = {
+        .data = (u8 *)sqlite3_column_text(select_stmt, 1),
+        .len = (u64)sqlite3_column_bytes(select_stmt, 1),
+    };
+    JsonParseStringStrResult options =
+        json_decode_string_slice(options_json, &tmp_arena);
+    if (options.err) {
+      log_at(LOG_LEVEL_ERROR, "migration: invalid vote", &tmp_arena,
+             L("vote.id", (i64)sqlite3_column_int64(select_stmt, 0)),
+             L("vote.options", options_json));
+      err = DB_ERR_INVALID_DATA;
+      goto end;
+    }
+    String options_encoded = json_encode_string_slice(
+        db_sqlite_v0_unsanitize_all(options.string_slice, &tmp_arena),
+        &tmp_arena);
+
+    (void)sqlite3_reset(update_stmt);
+    (void)sqlite3_bind_text(update_stmt, 1, (const char *)options_encoded.data,
+                            (int)options_encoded.len, SQLITE_STATIC);
+    (void)sqlite3_bind_value(update_stmt, 2,
+                             sqlite3_column_value(select_stmt, 0));
+    if (SQLITE_DONE != (db_err = sqlite3_step(update_stmt))) {
+      log_at(LOG_LEVEL_ERROR, "migration: failed to update vote", &tmp_arena,
+             L("error", db_err));
+      err = DB_ERR_INVALID_USE;
+      goto end;
+    }
+  }
+  if (SQLITE_DONE != db_err) {
+    log_at(LOG_LEVEL_ERROR, "migration: failed to read votes", arena,
+           L("error", db_err));
+    err = DB_ERR_INVALID_USE;
+  }
+
+end:
+  (void)sqlite3_finalize(select_stmt);
+  (void)sqlite3_finalize(update_stmt);
+  return err;
+}
+
+// Rebuild the polls table with the new columns, see
+// https://sqlite.org/lang_altertable.html#otheralter. The integer ids, which
+// the votes reference, are kept.
+[[nodiscard]] static DatabaseError db_sqlite_migrate_to_v1(Arena *arena) {
+  DatabaseError err = db_sqlite_exec(
+      "create table polls_v1 (id "
+      "integer primary key, name text, "
+      "state int, options blob, public_id blob unique, "
+      "created_at text, created_by text) STRICT",
+      arena);
+  if (err) {
+    return err;
+  }
+
+  sqlite3_stmt *select_stmt = nullptr;
+  sqlite3_stmt *insert_stmt = nullptr;
+  int db_err = 0;
+  if (SQLITE_OK !=
+          (db_err = sqlite3_prepare_v2(
+               db,
+               "select id, name, state, options, lower(human_readable_id), "
+               "created_at, created_by from polls",
+               -1, &select_stmt, nullptr)) ||
+      SQLITE_OK != (db_err = sqlite3_prepare_v2(
+                        db,
+                        "insert into polls_v1 (id, name, state, options, "
+                        "public_id, created_at, created_by) values (?, ?, ?, "
+                        "?, ?, ?, ?)",
+                        -1, &insert_stmt, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "migration: failed to prepare statements", arena,
+           L("error", db_err));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+
+  while (SQLITE_ROW == (db_err = sqlite3_step(select_stmt))) {
+    Arena tmp_arena = *arena;
+
+    String hex_id = {
+        .data = (u8 *)sqlite3_column_text(select_stmt, 4),
+        .len = (u64)sqlite3_column_bytes(select_stmt, 4),
+    };
+    Id128ParseResult id = id128_parse_hex(hex_id);
+    String options_json = {
+        .data = (u8 *)sqlite3_column_text(select_stmt, 3),
+        .len = (u64)sqlite3_column_bytes(select_stmt, 3),
+    };
+    JsonParseStringStrResult options =
+        json_decode_string_slice(options_json, &tmp_arena);
+    if (!id.ok || options.err) {
+      log_at(LOG_LEVEL_ERROR, "migration: invalid poll", &tmp_arena,
+             L("poll.id", hex_id), L("poll.options", options_json));
+      err = DB_ERR_INVALID_DATA;
+      goto end;
+    }
+
+    u8 id_bytes[16] = {0};
+    id128_to_bytes(id.id, id_bytes);
+    String name = db_sqlite_v0_unsanitize(
+        (String){
+            .data = (u8 *)sqlite3_column_text(select_stmt, 1),
+            .len = (u64)sqlite3_column_bytes(select_stmt, 1),
+        },
+        &tmp_arena);
+    String options_encoded = binary_encode_string_slice(
+        db_sqlite_v0_unsanitize_all(options.string_slice, &tmp_arena),
+        &tmp_arena);
+
+    (void)sqlite3_reset(insert_stmt);
+    // Columns copied as is.
+    const int same_columns[] = {0, 2, 5, 6};
+    for (u64 i = 0; i < static_array_len(same_columns); i++) {
+      const int column = same_columns[i];
+      (void)sqlite3_bind_value(insert_stmt, column + 1,
+                               sqlite3_column_value(select_stmt, column));
+    }
+    (void)sqlite3_bind_text(insert_stmt, 2, (const char *)name.data,
+                            (int)name.len, SQLITE_STATIC);
+    (void)sqlite3_bind_blob(insert_stmt, 4, options_encoded.data,
+                            (int)options_encoded.len, SQLITE_STATIC);
+    (void)sqlite3_bind_blob(insert_stmt, 5, id_bytes, sizeof(id_bytes),
+                            SQLITE_STATIC);
+    if (SQLITE_DONE != (db_err = sqlite3_step(insert_stmt))) {
+      log_at(LOG_LEVEL_ERROR, "migration: failed to insert poll", &tmp_arena,
+             L("poll.id", hex_id), L("error", db_err));
+      err = DB_ERR_INVALID_USE;
+      goto end;
+    }
+  }
+  if (SQLITE_DONE != db_err) {
+    log_at(LOG_LEVEL_ERROR, "migration: failed to read polls", arena,
+           L("error", db_err));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+
+  if (DB_ERR_NONE != (err = db_sqlite_migrate_votes_to_v1(arena)) ||
+      DB_ERR_NONE != (err = db_sqlite_exec("drop table polls", arena))) {
+    goto end;
+  }
+  err = db_sqlite_exec("alter table polls_v1 rename to polls", arena);
+
+end:
+  (void)sqlite3_finalize(select_stmt);
+  (void)sqlite3_finalize(insert_stmt);
+  return err;
+}
+
+// Bring the schema to `DB_SQLITE_SCHEMA_VERSION`, in one transaction, or
+// refuse a database from a newer version of the server.
+[[nodiscard]] static DatabaseError db_sqlite_migrate(Arena *arena) {
+  i64 version = 0;
+  DatabaseError err =
+      db_sqlite_query_i64("PRAGMA user_version", &version, arena);
+  if (err) {
+    return err;
+  }
+  if (DB_SQLITE_SCHEMA_VERSION == version) {
+    return DB_ERR_NONE;
+  }
+  if (version > DB_SQLITE_SCHEMA_VERSION) {
+    log_at(LOG_LEVEL_ERROR, "database schema is newer than this server", arena,
+           L("version", version), L("expected", DB_SQLITE_SCHEMA_VERSION));
+    return DB_ERR_INVALID_USE;
+  }
+
+  // Version 0 is an empty database too.
+  i64 v0_columns = 0;
+  err = db_sqlite_query_i64("select count(*) from pragma_table_info('polls') "
+                            "where name = 'human_readable_id'",
+                            &v0_columns, arena);
+  if (err) {
+    return err;
+  }
+
+  // Dropping the old polls table must not touch the votes.
+  if (DB_ERR_NONE != (err = db_sqlite_exec("PRAGMA foreign_keys = false",
+                                            arena))) {
+    return err;
+  }
+  if (DB_ERR_NONE != (err = db_sqlite_exec("BEGIN IMMEDIATE", arena))) {
+    return err;
+  }
+
+  if (v0_columns > 0) {
+    log_at(LOG_LEVEL_INFO, "migrating database schema", arena,
+           L("from", version), L("to", DB_SQLITE_SCHEMA_VERSION));
+    err = db_sqlite_migrate_to_v1(arena);
+  }
+  if (DB_ERR_NONE == err) {
+    err = db_sqlite_exec(db_sqlite_create_polls_sql, arena);
+  }
+  if (DB_ERR_NONE == err) {
+    err = db_sqlite_exec(db_sqlite_create_votes_sql, arena);
+  }
+  if (DB_ERR_NONE == err) {
+    DynU8 sql = {0};
+    dyn_append_slice(&sql, S("PRAGMA user_version = "), arena);
+    dynu8_append_u64_to_string(&sql, (u64)DB_SQLITE_SCHEMA_VERSION, arena);
+    *dyn_push(&sql, arena) = 0;
+    err = db_sqlite_exec((const char *)sql.data, arena);
+  }
+
+  if (DB_ERR_NONE == err) {
+    err = db_sqlite_exec("COMMIT", arena);
+  } else {
+    (void)db_sqlite_exec("ROLLBACK", arena);
+  }
+  if (DB_ERR_NONE == err) {
+    err = db_sqlite_exec("PRAGMA foreign_keys = true", arena);
+  }
+  return err;
+}
+
+[[nodiscard]] static DatabaseError db_sqlite_setup(const char *path,
+                                                   Arena *arena) {
+  int db_err = 0;
+  if (SQLITE_OK != (db_err = sqlite3_initialize())) {
+    log_at(LOG_LEVEL_ERROR, "failed to initialize sqlite", arena,
+           L("error", db_err));
+    return DB_ERR_INVALID_USE;
+  }
+
+  if (SQLITE_OK != (db_err = sqlite3_open(path, &db))) {
+    log_at(LOG_LEVEL_ERROR, "failed to open db", arena, L("error", db_err));
+    return DB_ERR_INVALID_USE;
+  }
+
+  // See https://kerkour.com/sqlite-for-servers.
+  char *pragmas[] = {
+      "PRAGMA journal_mode = WAL",   "PRAGMA busy_timeout = 5000",
+      "PRAGMA synchronous = NORMAL", "PRAGMA foreign_keys = true",
+      "PRAGMA temp_store = memory",
+      // In KiB: 16 MiB per connection. Reads mostly go through the mapping
+      // below, so this mostly holds the pages being written.
+      "PRAGMA cache_size = -16384",
+      // Reads are served from the page cache of the OS, without copies.
+      "PRAGMA mmap_size = 268435456",
+  };
+  for (u64 i = 0; i < static_array_len(pragmas); i++) {
+    if (SQLITE_OK !=
+        (db_err = sqlite3_exec(db, AT(pragmas, static_array_len(pragmas), i),
+                               nullptr, nullptr, nullptr))) {
+      log_at(LOG_LEVEL_ERROR, "failed to execute pragmas", arena, L("i", i),
+             L("error", db_err));
+      return DB_ERR_INVALID_USE;
+    }
+  }
+  if (db_sqlite_checkpointer_running) {
+    (void)sqlite3_wal_autocheckpoint(db, 0);
+  }
+
+  if (DB_ERR_NONE != db_sqlite_migrate(arena)) {
+    return DB_ERR_INVALID_USE;
+  }
+
+  String db_insert_poll_sql = S("insert into polls (public_id, name, "
+                                "state, options, created_at, created_by) "
+                                "values (?, ?, 0, ?, datetime('now'), ?)");
+  if (SQLITE_OK !=
+      (db_err = sqlite3_prepare_v2(db, (const char *)db_insert_poll_sql.data,
+                                   (int)db_insert_poll_sql.len,
+                                   &db_insert_poll_stmt, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to prepare statement to insert poll", arena,
+           L("error", db_err));
+    return DB_ERR_INVALID_USE;
+  }
+
+  String db_select_poll_sql = S("select id, name, state, options, created_at, "
+                                "created_by from polls where "
+                                "public_id = ? limit 1");
+  if (SQLITE_OK !=
+      (db_err = sqlite3_prepare_v2(db, (const char *)db_select_poll_sql.data,
+                                   (int)db_select_poll_sql.len,
+                                   &db_select_poll_stmt, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to prepare statement to select poll", arena,
+           L("error", db_err));
+    return DB_ERR_INVALID_USE;
+  }
+
+  String db_insert_vote_sql = S("insert or replace into votes (created_at, "
+                                "user_id, poll_id, options) values "
+                                "(datetime('now'), ?, ?, ?)");
+  if (SQLITE_OK !=
+      (db_err = sqlite3_prepare_v2(db, (const char *)db_insert_vote_sql.data,
+                                   (int)db_insert_vote_sql.len,
+                                   &db_insert_vote_stmt, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "failed to prepare statement to insert vote", arena,
+           L("error", db_err));
+    return DB_ERR_INVALID_USE;
+  }
+
+  ASSERT(nullptr != db);
+  ASSERT(nullptr != db_insert_poll_stmt);
+  ASSERT(nullptr != db_select_poll_stmt);
+  ASSERT(nullptr != db_insert_vote_stmt);
+
+  return DB_ERR_NONE;
+}
+
+[[maybe_unused]] static const DbBackend db_backend_sqlite = {
+    .name = S("sqlite"),
+    .setup = db_sqlite_setup,
+    .create_poll = db_sqlite_create_poll,
+    .get_poll = db_sqlite_get_poll,
+    .cast_vote = db_sqlite_cast_vote,
+};
+
+// --- WAL checkpointer.
+//
+// With SQLite, the WAL grows with each write until a checkpoint copies its
+// pages back into the database, and a big WAL slows every reader down. By
+// default the connection committing past 1000 pages does the checkpoint, in
+// the middle of a request. Instead, a dedicated process checkpoints once the
+// WAL is big enough: first `PASSIVE`, which copies what it can without waiting
+// on anyone. Once it caught up, `TRUNCATE` resets the WAL file to empty, which
+// holds the writers for as long as it waits on the readers (bounded).
+
+typedef enum {
+  DB_CHECKPOINT_MODE_PASSIVE,
+  DB_CHECKPOINT_MODE_TRUNCATE,
+  DB_CHECKPOINT_MODE_MAX, // Pseudo-value.
+} DbCheckpointMode;
+
+static const String db_checkpoint_mode_to_s[DB_CHECKPOINT_MODE_MAX] = {
+    [DB_CHECKPOINT_MODE_PASSIVE] = S("passive"),
+    [DB_CHECKPOINT_MODE_TRUNCATE] = S("truncate"),
+};
+
+static const int db_checkpoint_mode_to_sqlite[DB_CHECKPOINT_MODE_MAX] = {
+    [DB_CHECKPOINT_MODE_PASSIVE] = SQLITE_CHECKPOINT_PASSIVE,
+    [DB_CHECKPOINT_MODE_TRUNCATE] = SQLITE_CHECKPOINT_TRUNCATE,
+};
+
+typedef struct {
+  // Checkpoints which could not complete due to concurrent connections.
+  _Atomic u64 busy;
+  _Atomic u64 errors;
+  Histogram duration;
+} DbCheckpointModeStats;
+
+// Written by the checkpointer process, in memory shared with the worker
+// processes.
+typedef struct {
+  _Atomic u64 wal_bytes;
+  // As of the last checkpoint.
+  _Atomic u64 wal_frames, wal_frames_checkpointed;
+  DbCheckpointModeStats modes[DB_CHECKPOINT_MODE_MAX];
+} DbCheckpointStats;
+
+// Disabled unless `db_checkpointer_start` is called.
+static DbCheckpointStats *db_checkpoint_stats = nullptr;
+
+static const u64 DB_CHECKPOINT_WAL_BYTES_MIN = 4 * 1024 * KiB;
+static const struct timespec DB_CHECKPOINT_INTERVAL = {.tv_nsec = 100'000'000};
+// How long `TRUNCATE` may hold the writers.
+static const int DB_CHECKPOINT_BUSY_TIMEOUT_MS = 10;
+
+// Returns whether the database now has all the pages of the WAL.
+[[nodiscard]] static bool db_checkpoint(sqlite3 *conn, DbCheckpointMode mode,
+                                        DbCheckpointStats *stats,
+                                        Arena *arena) {
+  DbCheckpointModeStats *mode_stats = &stats->modes[mode];
+
+  int frames = 0, frames_checkpointed = 0;
+  const u64 start_ns = clock_monotonic_ns();
+  const int db_err = sqlite3_wal_checkpoint_v2(
+      conn, nullptr, db_checkpoint_mode_to_sqlite[mode], &frames,
+      &frames_checkpointed);
+  histogram_record(&mode_stats->duration, HISTOGRAM_UNIT_NS,
+                   clock_monotonic_ns() - start_ns);
+
+  if (SQLITE_BUSY == (db_err & 0xff)) {
+    atomic_fetch_add_explicit(&mode_stats->busy, 1, memory_order_relaxed);
+    return false;
+  }
+  if (SQLITE_OK != db_err) {
+    atomic_fetch_add_explicit(&mode_stats->errors, 1, memory_order_relaxed);
+    log_at(LOG_LEVEL_ERROR, "failed to checkpoint", arena,
+           L("mode", db_checkpoint_mode_to_s[mode]), L("error", db_err));
+    return false;
+  }
+
+  // -1 when not in WAL mode.
+  if (frames >= 0 && frames_checkpointed >= 0) {
+    atomic_store_explicit(&stats->wal_frames, (u64)frames,
+                          memory_order_relaxed);
+    atomic_store_explicit(&stats->wal_frames_checkpointed,
+                          (u64)frames_checkpointed, memory_order_relaxed);
+  }
+  return frames == frames_checkpointed;
+}
+
+[[noreturn]] static void db_checkpointer_run(const char *path, pid_t parent,
+                                             DbCheckpointStats *stats,
+                                             Arena *arena) {
+  // The connection inherited from the parent must not be used. Its memory
+  // still counts towards the heap limit (`SQLITE_MAX_MEMORY`), which would
+  // leave little to this process otherwise.
+  const sqlite3_int64 heap_limit = sqlite3_hard_heap_limit64(-1);
+  if (heap_limit > 0) {
+    (void)sqlite3_hard_heap_limit64(heap_limit + sqlite3_memory_used());
+  }
+
+  sqlite3 *conn = nullptr;
+  int db_err = 0;
+  if (SQLITE_OK != (db_err = sqlite3_open(path, &conn))) {
+    log_at(LOG_LEVEL_ERROR, "checkpointer: failed to open db", arena,
+           L("error", db_err));
+    _exit(1);
+  }
+  // Also opens the WAL: checkpoints are otherwise no-ops until the first
+  // read.
+  if (SQLITE_OK != (db_err = sqlite3_exec(conn, "PRAGMA journal_mode = WAL",
+                                          nullptr, nullptr, nullptr))) {
+    log_at(LOG_LEVEL_ERROR, "checkpointer: failed to execute pragma", arena,
+           L("error", db_err));
+    _exit(1);
+  }
+  (void)sqlite3_busy_timeout(conn, DB_CHECKPOINT_BUSY_TIMEOUT_MS);
+  (void)sqlite3_wal_autocheckpoint(conn, 0);
+
+  DynU8 wal_path = {0};
+  dyn_append_slice(&wal_path, (String){.data = (u8 *)path, .len = strlen(path)},
+                   arena);
+  dyn_append_slice(&wal_path, S("-wal"), arena);
+  *dyn_push(&wal_path, arena) = 0;
+
+  for (;;) {
+    // The server stopped.
+    if (getppid() != parent) {
+      (void)sqlite3_close(conn);
+      _exit(0);
+    }
+
+    struct stat st = {0};
+    const u64 wal_bytes =
+        0 == stat((const char *)wal_path.data, &st) ? (u64)st.st_size : 0;
+    atomic_store_explicit(&stats->wal_bytes, wal_bytes, memory_order_relaxed);
+
+    if (wal_bytes >= DB_CHECKPOINT_WAL_BYTES_MIN) {
+      Arena tmp_arena = *arena;
+      if (db_checkpoint(conn, DB_CHECKPOINT_MODE_PASSIVE, stats, &tmp_arena)) {
+        (void)db_checkpoint(conn, DB_CHECKPOINT_MODE_TRUNCATE, stats,
+                            &tmp_arena);
+      }
+    }
+
+    (void)nanosleep(&DB_CHECKPOINT_INTERVAL, nullptr);
+  }
+}
+
+// Must be called after `db_setup` with SQLite, and before forking the worker
+// processes.
+[[maybe_unused]] [[nodiscard]] static DatabaseError
+db_checkpointer_start(const char *path, Arena *arena) {
+  ASSERT(nullptr != db);
+  ASSERT(nullptr == db_checkpoint_stats);
+
+  void *mem = mmap(nullptr, sizeof(DbCheckpointStats), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == mem) {
+    log_at(LOG_LEVEL_ERROR, "failed to create checkpoint stats", arena,
+           L("error", errno));
+    return DB_ERR_INVALID_USE;
+  }
+
+  const pid_t parent = getpid();
+  const pid_t pid = fork();
+  if (-1 == pid) {
+    log_at(LOG_LEVEL_ERROR, "failed to start the checkpointer", arena,
+           L("error", errno));
+    return DB_ERR_INVALID_USE;
+  }
+  if (0 == pid) {
+    db_checkpointer_run(path, parent, mem, arena);
+  }
+
+  // Inherited by the worker processes, and applied to later connections.
+  (void)sqlite3_wal_autocheckpoint(db, 0);
+  db_sqlite_checkpointer_running = true;
+  db_checkpoint_stats = mem;
+  return DB_ERR_NONE;
+}
+
+// Prometheus text format.
+static void db_checkpoint_stats_write_metrics(BufWriter *w) {
+  if (nullptr == db_checkpoint_stats) {
+    return;
+  }
+
+  const struct {
+    String name;
+    _Atomic u64 *value;
+  } gauges[] = {
+      {S("db_wal_bytes"), &db_checkpoint_stats->wal_bytes},
+      {S("db_wal_frames"), &db_checkpoint_stats->wal_frames},
+      {S("db_wal_frames_checkpointed"),
+       &db_checkpoint_stats->wal_frames_checkpointed},
+  };
+  for (u64 i = 0; i < static_array_len(gauges); i++) {
+    buf_writer_write(w, S("# TYPE "));
+    buf_writer_write(w, gauges[i].name);
+    buf_writer_write(w, S(" gauge\n"));
+    buf_writer_write(w, gauges[i].name);
+    buf_writer_write(w, S(" "));
+    buf_writer_u64(
+        w, atomic_load_explicit(gauges[i].value, memory_order_relaxed));
+    buf_writer_write(w, S("\n"));
+  }
+
+  buf_writer_write(w, S("# TYPE db_checkpoint_busy_total counter\n"));
+  for (u64 i = 0; i < DB_CHECKPOINT_MODE_MAX; i++) {
+    http_metrics_write_label(w, S("db_checkpoint_busy_total"), S("mode"),
+                             db_checkpoint_mode_to_s[i]);
+    buf_writer_write(w, S("} "));
+    buf_writer_u64(w,
+                   atomic_load_explicit(&db_checkpoint_stats->modes[i].busy,
+                                        memory_order_relaxed));
+    buf_writer_write(w, S("\n"));
+  }
+
+  buf_writer_write(w, S("# TYPE db_checkpoint_errors_total counter\n"));
+  for (u64 i = 0; i < DB_CHECKPOINT_MODE_MAX; i++) {
+    http_metrics_write_label(w, S("db_checkpoint_errors_total"), S("mode"),
+                             db_checkpoint_mode_to_s[i]);
+    buf_writer_write(w, S("} "));
+    buf_writer_u64(w,
+                   atomic_load_explicit(&db_checkpoint_stats->modes[i].errors,
+                                        memory_order_relaxed));
+    buf_writer_write(w, S("\n"));
+  }
+
+  buf_writer_write(w, S("# TYPE db_checkpoint_duration_seconds histogram\n"));
+  for (u64 i = 0; i < DB_CHECKPOINT_MODE_MAX; i++) {
+    histogram_write_metrics(w, S("db_checkpoint_duration_seconds"), S("mode"),
+                            db_checkpoint_mode_to_s[i],
+                            &db_checkpoint_stats->modes[i].duration,
+                            HISTOGRAM_UNIT_NS);
+  }
+}
+
+// --- Key-value backend.
+//
+// The file is an append-only log of checksummed records, after a small file
+// header. Polls are found with an open-addressing hash index keyed by the
+// 128 bits poll id, living in shared memory so that all worker processes see
+// the same index.
+// The index is not persisted: at startup, it is rebuilt by scanning the log.
+// The scan stops at the first record that is incomplete or has the wrong
+// checksum, e.g. a torn write due to a crash, and the file is truncated there.
+// Like SQLite with `synchronous = NORMAL` in WAL mode, writes are not
+// `fsync(2)`-ed: a power loss may lose the last writes but not corrupt the log.
+//
+// Writers are serialized with a mutex in the shared memory, since the worker
+// processes share the file descriptor opened before forking them, and
+// `flock(2)` locks belong to the open file description. The mutex is robust:
+// a writer dying with it does not block the others. Readers take no lock:
+// records are immutable once written and index slots are published
+// atomically.
+//
+// Votes are only appended, never looked up: a user voting again on a poll
+// adds a record, and the last vote of a `user_id` is the one that counts when
+// replaying the log. That matches `insert or replace` on `user_id` with
+// SQLite, without a second index.
+
+static const u64 KV_FILE_MAGIC = 0x3176'6b6c'6c6f'7076; // "vpollkv1".
+static const u64 KV_FILE_HEADER_LEN = 4 * KiB;
+// Virtual address space reserved for the file mapping; the file itself grows
+// in `KV_FILE_GROW_LEN` increments.
+static const u64 KV_MAP_LEN = (u64)1 << 30;
+static const u64 KV_FILE_GROW_LEN = 1024 * KiB;
+// Power of two.
+static const u64 KV_INDEX_SLOTS_LEN = (u64)1 << 20;
+static const u64 KV_RECORD_ALIGN = 8;
+
+typedef enum : u8 {
+  KV_RECORD_KIND_NONE,
+  KV_RECORD_KIND_POLL,
+  KV_RECORD_KIND_VOTE,
+  KV_RECORD_KIND_MAX, // Pseudo-value.
+} KvRecordKind;
+
+typedef struct {
+  // FNV-1a of the rest of the record, payload included.
+  u32 checksum;
+  u32 payload_len;
+  KvRecordKind kind;
+  u8 reserved[7];
+  u64 key_hi, key_lo;
+} KvRecordHeader;
+static_assert(32 == sizeof(KvRecordHeader));
+
+typedef struct {
+  // Offset of the record in the file. 0 means the slot is free.
+  // Written last, so that readers only see fully written slots.
+  _Atomic u64 offset;
+  u64 key_hi, key_lo;
+} KvIndexSlot;
+
+typedef struct {
+  // Held by writers.
+  pthread_mutex_t lock;
+  // Length of the valid data in the file, file header included.
+  _Atomic u64 file_len;
+  // Current size of the file, always a multiple of `KV_FILE_GROW_LEN`.
+  u64 file_cap;
+  u64 index_len;
+  u64 index_count;
+  KvIndexSlot index[];
+} KvShared;
+
+static int kv_fd = -1;
+static u8 *kv_map = nullptr;
+static KvShared *kv_shared = nullptr;
+
+[[nodiscard]] static u32 kv_checksum(u8 *data, u64 len) {
+  u32 hash = 2166136261;
+  for (u64 i = 0; i < len; i++) {
+    hash ^= data[i];
+    hash *= 16777619;
+  }
+  return hash;
+}
+
+[[nodiscard]] static u64 kv_record_len(u64 payload_len) {
+  u64 len = sizeof(KvRecordHeader) + payload_len;
+  return (len + KV_RECORD_ALIGN - 1) / KV_RECORD_ALIGN * KV_RECORD_ALIGN;
+}
+
+// The slot holding the key, or the free slot where the probe stopped, with
+// the offset seen then: a concurrent writer may fill a free slot with another
+// key afterwards, so the slot must not be read again.
+typedef struct {
+  KvIndexSlot *slot;
+  u64 offset;
+} KvIndexProbe;
+
+[[nodiscard]] static KvIndexProbe kv_index_probe(Id128 key) {
+  const u64 mask = kv_shared->index_len - 1;
+  const u64 start = id128_hash_index(key, kv_shared->index_len);
+
+  for (u64 i = 0; i < kv_shared->index_len; i++) {
+    KvIndexSlot *slot = &kv_shared->index[(start + i) & mask];
+    u64 offset = atomic_load_explicit(&slot->offset, memory_order_acquire);
+
+    if (0 == offset ||
+        id128_eq((Id128){.hi = slot->key_hi, .lo = slot->key_lo}, key)) {
+      return (KvIndexProbe){.slot = slot, .offset = offset};
+    }
+  }
+  return (KvIndexProbe){0};
+}
+
+// Must be called with the write lock held.
+[[nodiscard]] static bool kv_index_insert(Id128 key, u64 offset) {
+  ASSERT(0 != offset);
+
+  // Keep probe sequences short.
+  if (kv_shared->index_count * 4 >= kv_shared->index_len * 3) {
+    return false;
+  }
+
+  KvIndexProbe probe = kv_index_probe(key);
+  // Full, or duplicate.
+  if (nullptr == probe.slot || 0 != probe.offset) {
+    return false;
+  }
+
+  probe.slot->key_hi = key.hi;
+  probe.slot->key_lo = key.lo;
+  atomic_store_explicit(&probe.slot->offset, offset, memory_order_release);
+  kv_shared->index_count += 1;
+  return true;
+}
+
+// Returns 0 if not found.
+[[nodiscard]] static u64 kv_index_get(Id128 key) {
+  return kv_index_probe(key).offset;
+}
+
+// A writer died after inserting a record in the index and before publishing it
+// by moving `file_len`: the next record goes at the same offset, so the index
+// entry must go. Only the last insert can be in that state, so clearing its
+// slot does not break the probe sequence of another key.
+static void kv_index_drop_unpublished() {
+  const u64 file_len =
+      atomic_load_explicit(&kv_shared->file_len, memory_order_relaxed);
+  for (u64 i = 0; i < kv_shared->index_len; i++) {
+    KvIndexSlot *slot = &kv_shared->index[i];
+    if (atomic_load_explicit(&slot->offset, memory_order_relaxed) >=
+        file_len) {
+      atomic_store_explicit(&slot->offset, 0, memory_order_relaxed);
+      kv_shared->index_count -= 1;
+    }
+  }
+}
+
+[[nodiscard]] static DatabaseError kv_lock(String req_id, Arena *arena) {
+  int err = pthread_mutex_lock(&kv_shared->lock);
+  if (EOWNERDEAD == err) {
+    log_at(LOG_LEVEL_ERROR, "kv: previous writer died", arena,
+           L("req.id", req_id));
+    kv_index_drop_unpublished();
+    err = pthread_mutex_consistent(&kv_shared->lock);
+  }
+  if (0 != err) {
+    log_at(LOG_LEVEL_ERROR, "kv: failed to lock", arena, L("req.id", req_id),
+           L("error", err));
+    return DB_ERR_INVALID_USE;
+  }
+  return DB_ERR_NONE;
+}
+
+[[nodiscard]] static DatabaseError kv_append(String req_id, KvRecordKind kind,
+                                             Id128 key, String payload,
+                                             Arena *arena) {
+  ASSERT(KV_RECORD_KIND_NONE != kind);
+  ASSERT(payload.len <= UINT32_MAX);
+
+  DatabaseError err = kv_lock(req_id, arena);
+  if (err) {
+    return err;
+  }
+
+  const u64 offset =
+      atomic_load_explicit(&kv_shared->file_len, memory_order_relaxed);
+  const u64 record_len = kv_record_len(payload.len);
+
+  if (KV_RECORD_KIND_POLL == kind && 0 != kv_index_get(key)) {
+    log_at(LOG_LEVEL_ERROR, "kv: duplicate key", arena, L("req.id", req_id));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+
+  if (offset + record_len > KV_MAP_LEN) {
+    log_at(LOG_LEVEL_ERROR, "kv: file full", arena, L("req.id", req_id),
+           L("file_len", offset));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+
+  if (offset + record_len > kv_shared->file_cap) {
+    u64 file_cap = (offset + record_len + KV_FILE_GROW_LEN - 1) /
+                   KV_FILE_GROW_LEN * KV_FILE_GROW_LEN;
+    if (-1 == ftruncate(kv_fd, (off_t)file_cap)) {
+      log_at(LOG_LEVEL_ERROR, "kv: failed to grow file", arena,
+             L("req.id", req_id), L("error", errno), L("file_cap", file_cap));
+      err = DB_ERR_INVALID_USE;
+      goto end;
+    }
+    kv_shared->file_cap = file_cap;
+  }
+
+  KvRecordHeader *header = (KvRecordHeader *)(void *)(kv_map + offset);
+  *header = (KvRecordHeader){
+      .payload_len = (u32)payload.len,
+      .kind = kind,
+      .key_hi = key.hi,
+      .key_lo = key.lo,
+  };
+  memcpy(kv_map + offset + sizeof(KvRecordHeader), payload.data, payload.len);
+  header->checksum =
+      kv_checksum(kv_map + offset + sizeof(header->checksum),
+                  sizeof(KvRecordHeader) - sizeof(header->checksum) +
+                      payload.len);
+
+  if (KV_RECORD_KIND_POLL == kind && !kv_index_insert(key, offset)) {
+    log_at(LOG_LEVEL_ERROR, "kv: index full", arena, L("req.id", req_id),
+           L("index_len", kv_shared->index_len));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+
+  atomic_store_explicit(&kv_shared->file_len, offset + record_len,
+                        memory_order_release);
+
+end:
+  (void)pthread_mutex_unlock(&kv_shared->lock);
+  return err;
+}
+
+[[nodiscard]] static String kv_now_datetime(Arena *arena) {
+  // Same format as SQLite's `datetime('now')`.
+  const u64 len = sizeof("YYYY-MM-DD HH:MM:SS") - 1;
+
+  time_t now = time(nullptr);
+  struct tm tm = {0};
+  gmtime_r(&now, &tm);
+
+  char *data = arena_new(arena, char, len + 1);
+  u64 written = strftime(data, len + 1, "%Y-%m-%d %H:%M:%S", &tm);
+  ASSERT(len == written);
+
+  return (String){.data = (u8 *)data, .len = len};
+}
+
+[[nodiscard]] static DatabaseError db_kv_create_poll(String req_id, Poll poll,
+                                                     Arena *arena) {
+  ASSERT(!slice_is_empty(poll.created_by));
+
+  poll.created_at = kv_now_datetime(arena);
+  String payload = db_poll_encode(poll, arena);
+
+  return kv_append(req_id, KV_RECORD_KIND_POLL, poll.id, payload, arena);
+}
+
+[[nodiscard]] static DbGetPollResult
+db_kv_get_poll(String req_id, Id128 poll_id, Arena *arena) {
+  DbGetPollResult res = {0};
+
+  u64 offset = kv_index_get(poll_id);
+  if (0 == offset) {
+    res.err = DB_ERR_NOT_FOUND;
+    return res;
+  }
+
+  KvRecordHeader *header = (KvRecordHeader *)(void *)(kv_map + offset);
+  if (KV_RECORD_KIND_POLL != header->kind ||
+      !id128_eq((Id128){.hi = header->key_hi, .lo = header->key_lo},
+                poll_id)) {
+    log_at(LOG_LEVEL_ERROR, "kv: index points to the wrong record", arena,
+           L("req.id", req_id), L("offset", offset));
+    res.err = DB_ERR_INVALID_DATA;
+    return res;
+  }
+
+  // Zero-copy: the poll points inside the mapping.
+  String payload = {
+      .data = kv_map + offset + sizeof(KvRecordHeader),
+      .len = header->payload_len,
+  };
+  res = db_poll_decode(req_id, poll_id, payload, arena);
+  if (DB_ERR_NONE == res.err) {
+    res.poll.db_id = (i64)offset;
+  }
+
+  return res;
+}
+
+[[nodiscard]] static DatabaseError
+db_kv_cast_vote(String req_id, Id128 poll_id, String user_id,
+                StringSlice vote_options, Arena *arena) {
+  // Polls are immutable so there is no need to hold the write lock while
+  // checking the vote against the poll.
+  DbGetPollResult get_poll = db_kv_get_poll(req_id, poll_id, arena);
+  if (get_poll.err) {
+    return get_poll.err;
+  }
+
+  if (!db_vote_options_valid(vote_options, get_poll.poll.options)) {
+    return DB_ERR_INVALID_DATA;
+  }
+
+  String fields[] = {
+      kv_now_datetime(arena),
+      user_id,
+      binary_encode_string_slice(vote_options, arena),
+  };
+  String payload = binary_encode_string_slice(
+      (StringSlice){.data = fields, .len = static_array_len(fields)}, arena);
+
+  return kv_append(req_id, KV_RECORD_KIND_VOTE, poll_id, payload, arena);
+}
+
+// Rebuild the index from the log, and drop a torn tail if any.
+// Must be called at setup, before forking the workers.
+[[nodiscard]] static DatabaseError kv_recover(u64 file_size, Arena *arena) {
+  u64 offset = KV_FILE_HEADER_LEN;
+  u64 polls_count = 0, votes_count = 0;
+
+  while (offset + sizeof(KvRecordHeader) <= file_size) {
+    KvRecordHeader *header = (KvRecordHeader *)(void *)(kv_map + offset);
+    if (KV_RECORD_KIND_NONE == header->kind ||
+        header->kind >= KV_RECORD_KIND_MAX) {
+      break;
+    }
+
+    const u64 record_len = kv_record_len(header->payload_len);
+    if (offset + record_len > file_size) {
+      break;
+    }
+
+    u32 checksum =
+        kv_checksum(kv_map + offset + sizeof(header->checksum),
+                    sizeof(KvRecordHeader) - sizeof(header->checksum) +
+                        header->payload_len);
+    if (checksum != header->checksum) {
+      break;
+    }
+
+    if (KV_RECORD_KIND_POLL == header->kind) {
+      Id128 key = {.hi = header->key_hi, .lo = header->key_lo};
+      if (!kv_index_insert(key, offset)) {
+        log_at(LOG_LEVEL_ERROR, "kv: failed to rebuild index", arena,
+               L("offset", offset), L("index_len", kv_shared->index_len));
+        return DB_ERR_INVALID_DATA;
+      }
+      polls_count += 1;
+    } else {
+      votes_count += 1;
+    }
+
+    offset += record_len;
+  }
+
+  // Zero out the rest of the file so that stale bytes never look like records
+  // later on.
+  u64 file_cap = (offset + KV_FILE_GROW_LEN - 1) / KV_FILE_GROW_LEN *
+                 KV_FILE_GROW_LEN;
+  if (-1 == ftruncate(kv_fd, (off_t)offset) ||
+      -1 == ftruncate(kv_fd, (off_t)file_cap)) {
+    log_at(LOG_LEVEL_ERROR, "kv: failed to truncate file", arena,
+           L("error", errno), L("offset", offset));
+    return DB_ERR_INVALID_USE;
+  }
+
+  if (offset != file_size) {
+    log_at(LOG_LEVEL_INFO, "kv: dropped torn tail", arena, L("offset", offset),
+           L("file_size", file_size));
+  }
+  log_at(LOG_LEVEL_INFO, "kv: recovered", arena, L("polls", polls_count),
+         L("votes", votes_count), L("file_len", offset));
+
+  atomic_store_explicit(&kv_shared->file_len, offset, memory_order_relaxed);
+  kv_shared->file_cap = file_cap;
+
+  return DB_ERR_NONE;
+}
+
+[[nodiscard]] static DatabaseError db_kv_setup(const char *path,
+                                               Arena *arena) {
+  kv_fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (-1 == kv_fd) {
+    log_at(LOG_LEVEL_ERROR, "kv: failed to open file", arena,
+           L("error", errno));
+    return DB_ERR_INVALID_USE;
+  }
+
+  // Against another server starting on the same file meanwhile.
+  if (-1 == flock(kv_fd, LOCK_EX)) {
+    log_at(LOG_LEVEL_ERROR, "kv: failed to lock", arena, L("error", errno));
+    return DB_ERR_INVALID_USE;
+  }
+
+  DatabaseError err = DB_ERR_NONE;
+
+  struct stat st = {0};
+  if (-1 == fstat(kv_fd, &st)) {
+    log_at(LOG_LEVEL_ERROR, "kv: failed to stat file", arena,
+           L("error", errno));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+  ASSERT(st.st_size >= 0);
+  u64 file_size = (u64)st.st_size;
+
+  if (0 == file_size) { // New file.
+    if (-1 == ftruncate(kv_fd, (off_t)KV_FILE_HEADER_LEN) ||
+        (i64)sizeof(KV_FILE_MAGIC) != pwrite(kv_fd, &KV_FILE_MAGIC,
+                                             sizeof(KV_FILE_MAGIC), 0)) {
+      log_at(LOG_LEVEL_ERROR, "kv: failed to initialize file", arena,
+             L("error", errno));
+      err = DB_ERR_INVALID_USE;
+      goto end;
+    }
+    file_size = KV_FILE_HEADER_LEN;
+  }
+
+  kv_map = mmap(nullptr, KV_MAP_LEN, PROT_READ | PROT_WRITE, MAP_SHARED, kv_fd,
+                0);
+  if (MAP_FAILED == kv_map) {
+    log_at(LOG_LEVEL_ERROR, "kv: failed to map file", arena, L("error", errno));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+
+  if (file_size < KV_FILE_HEADER_LEN ||
+      0 != memcmp(kv_map, &KV_FILE_MAGIC, sizeof(KV_FILE_MAGIC))) {
+    log_at(LOG_LEVEL_ERROR, "kv: invalid file header", arena,
+           L("file_size", file_size));
+    err = DB_ERR_INVALID_DATA;
+    goto end;
+  }
+
+  // Shared with the worker processes which are forked afterwards.
+  kv_shared = mmap_shared_huge(sizeof(KvShared) +
+                               KV_INDEX_SLOTS_LEN * sizeof(KvIndexSlot));
+  if (MAP_FAILED == kv_shared) {
+    log_at(LOG_LEVEL_ERROR, "kv: failed to map index", arena,
+           L("error", errno));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+  kv_shared->index_len = KV_INDEX_SLOTS_LEN;
+
+  pthread_mutexattr_t attr = {0};
+  int mutex_err = 0;
+  if (0 != (mutex_err = pthread_mutexattr_init(&attr)) ||
+      0 != (mutex_err = pthread_mutexattr_setpshared(
+                &attr, PTHREAD_PROCESS_SHARED)) ||
+      0 != (mutex_err =
+                pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST)) ||
+      0 != (mutex_err = pthread_mutex_init(&kv_shared->lock, &attr))) {
+    log_at(LOG_LEVEL_ERROR, "kv: failed to create the lock", arena,
+           L("error", mutex_err));
+    err = DB_ERR_INVALID_USE;
+    goto end;
+  }
+
+  err = kv_recover(file_size, arena);
+
+end:
+  (void)flock(kv_fd, LOCK_UN);
+  return err;
+}
+
+[[maybe_unused]] static const DbBackend db_backend_kv = {
+    .name = S("kv"),
+    .setup = db_kv_setup,
+    .create_poll = db_kv_create_poll,
+    .get_poll = db_kv_get_poll,
+    .cast_vote = db_kv_cast_vote,
+};
+
+// --- Entrypoints.
+
+static const DbBackend *db_backend = &db_backend_sqlite;
+
+// Read-through cache of encoded polls shared by all worker processes, in front
+// of the backend. Disabled unless `db_poll_cache_setup` is called.
+// A poll is never modified once created, and the votes are not part of it, so
+// nothing invalidates the entries.
+static ShmCache db_poll_cache = {0};
+static const u64 DB_POLL_CACHE_SLOTS_LEN = 4096;
+static const u64 DB_POLL_CACHE_VALUE_CAP = 2 * KiB;
+
+typedef enum {
+  DB_OP_CREATE_POLL,
+  DB_OP_GET_POLL,
+  DB_OP_CAST_VOTE,
+  DB_OP_MAX, // Pseudo-value.
+} DbOp;
+
+static const String db_op_to_s[DB_OP_MAX] = {
+    [DB_OP_CREATE_POLL] = S("db_create_poll"),
+    [DB_OP_GET_POLL] = S("db_get_poll"),
+    [DB_OP_CAST_VOTE] = S("db_cast_vote"),
+};
+
+// Per operation, in memory shared by all worker processes. Cache hits count
+// as operations too.
+typedef struct {
+  _Atomic u64 errors;
+  Histogram duration;
+} DbOpStats;
+
+// Disabled unless `db_stats_setup` is called.
+static DbOpStats *db_op_stats = nullptr;
+
+// Time spent in database operations by this process so far, to attribute it
+// to the request being handled.
+static u64 db_time_ns = 0;
+
+static void db_op_stats_record(DbOp op, u64 start_ns, DatabaseError err) {
+  const u64 duration_ns = clock_monotonic_ns() - start_ns;
+  db_time_ns += duration_ns;
+  if (nullptr == db_op_stats) {
+    return;
+  }
+
+  DbOpStats *stats = &db_op_stats[op];
+  histogram_record(&stats->duration, HISTOGRAM_UNIT_NS, duration_ns);
+  // Not finding a poll is the client's problem.
+  if (DB_ERR_NONE != err && DB_ERR_NOT_FOUND != err) {
+    atomic_fetch_add_explicit(&stats->errors, 1, memory_order_relaxed);
+  }
+}
+
+// Must be called before forking the worker processes.
+[[maybe_unused]] [[nodiscard]] static DatabaseError
+db_stats_setup(Arena *arena) {
+  void *mem = mmap(nullptr, DB_OP_MAX * sizeof(DbOpStats),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == mem) {
+    log_at(LOG_LEVEL_ERROR, "failed to create db stats", arena,
+           L("error", errno));
+    return DB_ERR_INVALID_USE;
+  }
+  db_op_stats = mem;
+  return DB_ERR_NONE;
+}
+
+// Prometheus text format, one series per operation.
+[[maybe_unused]] static void db_stats_write_metrics(BufWriter *w) {
+  db_checkpoint_stats_write_metrics(w);
+
+  if (nullptr == db_op_stats) {
+    return;
+  }
+
+  buf_writer_write(w, S("# TYPE db_op_errors_total counter\n"));
+  for (u64 i = 0; i < DB_OP_MAX; i++) {
+    http_metrics_write_label(w, S("db_op_errors_total"), S("op"),
+                             db_op_to_s[i]);
+    buf_writer_write(w, S("} "));
+    buf_writer_u64(w, atomic_load_explicit(&db_op_stats[i].errors,
+                                           memory_order_relaxed));
+    buf_writer_write(w, S("\n"));
+  }
+
+  buf_writer_write(w, S("# TYPE db_op_duration_seconds histogram\n"));
+  for (u64 i = 0; i < DB_OP_MAX; i++) {
+    histogram_write_metrics(w, S("db_op_duration_seconds"), S("op"),
+                            db_op_to_s[i], &db_op_stats[i].duration,
+                            HISTOGRAM_UNIT_NS);
+  }
+}
+
+[[maybe_unused]] [[nodiscard]] static DatabaseError
+db_setup(const DbBackend *backend, const char *path, Arena *arena) {
+  db_backend = backend;
+  return db_backend->setup(path, arena);
+}
+
+// Must be called before forking the worker processes.
+[[maybe_unused]] [[nodiscard]] static DatabaseError
+db_poll_cache_setup(Arena *arena) {
+  Error err = shm_cache_init(&db_poll_cache, DB_POLL_CACHE_SLOTS_LEN,
+                             DB_POLL_CACHE_VALUE_CAP);
+  if (err) {
+    log_at(LOG_LEVEL_ERROR, "failed to create poll cache", arena,
+           L("error", err));
+    return DB_ERR_INVALID_USE;
+  }
+  return DB_ERR_NONE;
+}
+
+[[maybe_unused]] [[nodiscard]] static DatabaseError
+db_create_poll(String req_id, Poll poll, Arena *arena) {
+  const u64 start_ns = clock_monotonic_ns();
+  DatabaseError err = db_backend->create_poll(req_id, poll, arena);
+  db_op_stats_record(DB_OP_CREATE_POLL, start_ns, err);
+  return err;
+}
+
+// `db_id` is not cached: it is 0 when the poll comes from the cache.
+[[maybe_unused]] [[nodiscard]] static DbGetPollResult
+db_get_poll(String req_id, Id128 poll_id, Arena *arena) {
+  const u64 start_ns = clock_monotonic_ns();
+  ShmCacheGetResult cached = shm_cache_get(&db_poll_cache, poll_id, arena);
+  if (cached.hit) {
+    DbGetPollResult decoded =
+        db_poll_decode(req_id, poll_id, cached.value, arena);
+    if (DB_ERR_NONE == decoded.err) {
+      db_op_stats_record(DB_OP_GET_POLL, start_ns, decoded.err);
+      return decoded;
+    }
+  }
+
+  DbGetPollResult res = db_backend->get_poll(req_id, poll_id, arena);
+  if (DB_ERR_NONE == res.err) {
+    Arena tmp_arena = *arena;
+    shm_cache_put(&db_poll_cache, poll_id, cached.ticket,
+                  db_poll_encode(res.poll, &tmp_arena));
+  }
+  db_op_stats_record(DB_OP_GET_POLL, start_ns, res.err);
+  return res;
+}
+
+[[maybe_unused]] [[nodiscard]] static DatabaseError
+db_cast_vote(String req_id, Id128 poll_id, String user_id,
+             StringSlice vote_options, Arena *arena) {
+  const u64 start_ns = clock_monotonic_ns();
+  DatabaseError err =
+      db_backend->cast_vote(req_id, poll_id, user_id, vote_options, arena);
+  db_op_stats_record(DB_OP_CAST_VOTE, start_ns, err);
+  return err;
+}
+
+#endif
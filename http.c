@@ -1,56 +1,749 @@
 #ifndef CHTTP_HTTP_C
 #define CHTTP_HTTP_C
 
+#include "log.c"
 #include "submodules/cstd/lib.c"
 #include <arpa/inet.h>
 #include <asm-generic/errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
 #include <sys/signal.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Pre-faulted memory of a request: enough for most of them.
 static const u64 HTTP_SERVER_HANDLER_MEM_LEN = 12 * KiB;
+// Reserved memory of a request, only faulted in when used, so that the rare big
+// requests (e.g. a poll with many options) succeed. Routes lower the ceiling
+// with `http_arena_limit`.
+static const u64 HTTP_SERVER_HANDLER_MEM_MAX = 1024 * KiB;
+// Ceiling while reading the request, before it is routed.
+static const u64 HTTP_SERVER_REQUEST_READ_MEM_MAX = 128 * KiB;
+// Bounds of the pre-faulted memory picked by the autotuner, and how often, in
+// connections, it runs.
+static const u64 HTTP_SERVER_HANDLER_MEM_MIN = 4 * KiB;
+static const u64 HTTP_SERVER_ARENA_AUTOTUNE_PERIOD = 1024;
 [[maybe_unused]]
 static const u16 HTTP_SERVER_DEFAULT_PORT = 12345;
 static const int TCP_LISTEN_BACKLOG = 16384;
 
-[[nodiscard]] static Error response_write(Writer *writer, HttpResponse res,
-                                          Arena *arena) {
-  // Invalid to both want to serve a file and a body.
-  ASSERT(slice_is_empty(res.file_path) || slice_is_empty(res.body));
+[[maybe_unused]] [[nodiscard]] static u64 clock_monotonic_ns() {
+  struct timespec now = {0};
+  ASSERT(0 == clock_gettime(CLOCK_MONOTONIC, &now));
+  return (u64)now.tv_sec * 1'000'000'000 + (u64)now.tv_nsec;
+}
 
-  DynU8 sb = {0};
+static const u64 HUGE_PAGE_LEN = 2048 * KiB;
+
+// Shared anonymous memory, for the big tables created before forking the
+// workers (e.g. caches), backed by huge pages when possible, to reduce TLB
+// misses: explicit huge pages (`MAP_HUGETLB`) when some are reserved, otherwise
+// transparent huge pages (with `shmem_enabled` set to `advise` on Linux),
+// otherwise regular pages.
+// Pages are only backed by memory when touched.
+// Returns `MAP_FAILED` on failure, like `mmap(2)`.
+[[maybe_unused]] [[nodiscard]] static void *mmap_shared_huge(u64 len) {
+  ASSERT(len > 0);
+
+#ifdef MAP_HUGETLB
+  if (len >= HUGE_PAGE_LEN) {
+    void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (MAP_FAILED != mem) {
+      return mem;
+    }
+    // No huge pages reserved: fall back.
+  }
+#endif
+
+  void *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == mem) {
+    return mem;
+  }
+
+#ifdef MADV_HUGEPAGE
+  if (len >= HUGE_PAGE_LEN) {
+    // Best effort.
+    (void)madvise(mem, len, MADV_HUGEPAGE);
+  }
+#endif
+
+  return mem;
+}
+
+// Empty if the character does not need escaping.
+[[nodiscard]] static String html_escape_entity(u8 c) {
+  switch (c) {
+  case '&':
+    return S("&amp;");
+  case '<':
+    return S("&lt;");
+  case '>':
+    return S("&gt;");
+  case '"':
+    return S("&quot;");
+  case '\'':
+    return S("&#39;");
+  default:
+    return (String){0};
+  }
+}
+
+// Index of the first character to escape, or `s.len`.
+// Most values have nothing to escape, so this scans 32 (AVX2) or 16 (SSE2)
+// bytes at a time, and the clean runs are then copied in bulk.
+[[nodiscard]] static u64 html_escape_find(String s) {
+  u64 i = 0;
+
+#if defined(__AVX2__)
+  const __m256i amp = _mm256_set1_epi8('&');
+  const __m256i lt = _mm256_set1_epi8('<');
+  const __m256i gt = _mm256_set1_epi8('>');
+  const __m256i quot = _mm256_set1_epi8('"');
+  const __m256i apos = _mm256_set1_epi8('\'');
+
+  for (; i + 32 <= s.len; i += 32) {
+    const __m256i chunk =
+        _mm256_loadu_si256((const __m256i *)(const void *)(s.data + i));
+    const __m256i match = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(chunk, amp),
+                        _mm256_cmpeq_epi8(chunk, lt)),
+        _mm256_or_si256(
+            _mm256_or_si256(_mm256_cmpeq_epi8(chunk, gt),
+                            _mm256_cmpeq_epi8(chunk, quot)),
+            _mm256_cmpeq_epi8(chunk, apos)));
+    const u32 mask = (u32)_mm256_movemask_epi8(match);
+    if (0 != mask) {
+      return i + (u64)__builtin_ctz(mask);
+    }
+  }
+#elif defined(__SSE2__)
+  const __m128i amp = _mm_set1_epi8('&');
+  const __m128i lt = _mm_set1_epi8('<');
+  const __m128i gt = _mm_set1_epi8('>');
+  const __m128i quot = _mm_set1_epi8('"');
+  const __m128i apos = _mm_set1_epi8('\'');
+
+  for (; i + 16 <= s.len; i += 16) {
+    const __m128i chunk =
+        _mm_loadu_si128((const __m128i *)(const void *)(s.data + i));
+    const __m128i match = _mm_or_si128(
+        _mm_or_si128(_mm_cmpeq_epi8(chunk, amp), _mm_cmpeq_epi8(chunk, lt)),
+        _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(chunk, gt),
+                                  _mm_cmpeq_epi8(chunk, quot)),
+                     _mm_cmpeq_epi8(chunk, apos)));
+    const u32 mask = (u32)_mm_movemask_epi8(match);
+    if (0 != mask) {
+      return i + (u64)__builtin_ctz(mask);
+    }
+  }
+#endif
+
+  // Tail, or no SIMD.
+  for (; i < s.len; i++) {
+    if (!slice_is_empty(html_escape_entity(s.data[i]))) {
+      return i;
+    }
+  }
+  return s.len;
+}
+
+// Writes output into a fixed-size buffer, so that writing a page, a response
+// or the metrics uses a bounded amount of memory whatever their size. HTML
+// goes through `html_text_write` to be escaped.
+// When the buffer is full, it is flushed to `fd`. Without a file descriptor
+// (`fd == -1`), the output must fit in the buffer, otherwise the writer fails
+// with `ENOBUFS`. After an error, everything written is ignored.
+// Without a buffer, the writer only measures the output, to allocate it
+// exactly once afterwards ("measure, then write").
+typedef struct {
+  u8 *data;
+  u64 len, cap;
+  int fd;
+  Error err;
+} BufWriter;
+
+[[maybe_unused]] [[nodiscard]] static BufWriter
+buf_writer_make(int fd, u64 cap, Arena *arena) {
+  ASSERT(cap > 0);
+  return (BufWriter){
+      .data = arena_new(arena, u8, cap),
+      .cap = cap,
+      .fd = fd,
+  };
+}
+
+[[maybe_unused]] [[nodiscard]] static BufWriter buf_writer_make_measure() {
+  return (BufWriter){.fd = -1};
+}
+
+[[maybe_unused]] [[nodiscard]] static Error buf_writer_flush(BufWriter *w) {
+  if (w->err || -1 == w->fd || 0 == w->len) {
+    return w->err;
+  }
+
+  Writer writer = {.fd = w->fd};
+  w->err =
+      writer_write_all_sync(&writer, (String){.data = w->data, .len = w->len});
+  w->len = 0;
+  return w->err;
+}
+
+[[maybe_unused]] static void buf_writer_write(BufWriter *w, String s) {
+  if (w->err || slice_is_empty(s)) {
+    return;
+  }
+
+  if (nullptr == w->data) { // Measuring.
+    w->len += s.len;
+    return;
+  }
+
+  if (w->len + s.len > w->cap) {
+    if (-1 == w->fd) {
+      w->err = ENOBUFS;
+      return;
+    }
+    if (buf_writer_flush(w)) {
+      return;
+    }
+    // Too big to be buffered at all: write it directly.
+    if (s.len > w->cap) {
+      Writer writer = {.fd = w->fd};
+      w->err = writer_write_all_sync(&writer, s);
+      return;
+    }
+  }
+
+  memcpy(w->data + w->len, s.data, s.len);
+  w->len += s.len;
+}
+
+[[maybe_unused]] static void buf_writer_u64(BufWriter *w, u64 n) {
+  u8 digits[20] = {0};
+  u64 len = 0;
+  do {
+    digits[sizeof(digits) - 1 - len] = (u8)('0' + n % 10);
+    len += 1;
+    n /= 10;
+  } while (n);
+  buf_writer_write(
+      w, (String){.data = digits + sizeof(digits) - len, .len = len});
+}
+
+// Write a dynamic value in a template, escaped.
+[[maybe_unused]] static void html_text_write(BufWriter *w, String s) {
+  while (!slice_is_empty(s)) {
+    const u64 idx = html_escape_find(s);
+    buf_writer_write(w, (String){.data = s.data, .len = idx});
+    if (idx == s.len) {
+      return;
+    }
+
+    buf_writer_write(w, html_escape_entity(s.data[idx]));
+    s = (String){.data = s.data + idx + 1, .len = s.len - idx - 1};
+  }
+}
+
+// What was written, for a writer without a file descriptor.
+[[maybe_unused]] [[nodiscard]] static String buf_writer_string(BufWriter w) {
+  ASSERT(-1 == w.fd);
+  ASSERT(nullptr != w.data);
+  return (String){.data = w.data, .len = w.len};
+}
+
+// Append what was written to `sb`, without copying if `sb` is empty.
+[[maybe_unused]] static void buf_writer_append_to(BufWriter w, DynU8 *sb,
+                                                  Arena *arena) {
+  String s = buf_writer_string(w);
+  if (0 == sb->len) {
+    *sb = (DynU8){.data = s.data, .len = s.len, .cap = s.len};
+  } else {
+    dyn_append_slice(sb, s, arena);
+  }
+}
+
+// Histogram buckets: `<= min << i`, with `min` depending on the unit, and the
+// last one for the rest.
+#define HISTOGRAM_BUCKETS_LEN 18
+
+typedef enum {
+  // Buckets from 1 KiB up to 64 MiB.
+  HISTOGRAM_UNIT_BYTES,
+  // Buckets from 32 µs up to ~2 s. Exposed in seconds.
+  HISTOGRAM_UNIT_NS,
+  HISTOGRAM_UNIT_MAX, // Pseudo-value.
+} HistogramUnit;
+
+static const u64 histogram_unit_min[HISTOGRAM_UNIT_MAX] = {
+    [HISTOGRAM_UNIT_BYTES] = 1 * KiB,
+    [HISTOGRAM_UNIT_NS] = 32'000,
+};
+
+// Fixed buckets, so that the worker processes can update it lock-free, in
+// shared memory. The unit is the one of the users, it is not stored.
+typedef struct {
+  _Atomic u64 count;
+  _Atomic u64 sum;
+  _Atomic u64 buckets[HISTOGRAM_BUCKETS_LEN];
+} Histogram;
+
+// Upper bound of a bucket, `UINT64_MAX` for the last one.
+[[nodiscard]] static u64 histogram_bucket_bound(HistogramUnit unit, u64 idx) {
+  ASSERT(unit < HISTOGRAM_UNIT_MAX);
+  ASSERT(idx < HISTOGRAM_BUCKETS_LEN);
+  return idx + 1 == HISTOGRAM_BUCKETS_LEN ? UINT64_MAX
+                                          : histogram_unit_min[unit] << idx;
+}
+
+[[maybe_unused]] static void histogram_record(Histogram *h, HistogramUnit unit,
+                                              u64 value) {
+  atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+  atomic_fetch_add_explicit(&h->sum, value, memory_order_relaxed);
+
+  u64 bucket = 0;
+  while (value > histogram_bucket_bound(unit, bucket)) {
+    bucket += 1;
+  }
+  atomic_fetch_add_explicit(&h->buckets[bucket], 1, memory_order_relaxed);
+}
+
+// Upper bound of the bucket holding the quantile, e.g. 990 for the p99.
+// 0 when empty.
+[[maybe_unused]] [[nodiscard]] static u64
+histogram_quantile(Histogram *h, HistogramUnit unit, u64 per_mille) {
+  ASSERT(per_mille <= 1000);
+
+  u64 counts[HISTOGRAM_BUCKETS_LEN] = {0};
+  u64 total = 0;
+  for (u64 i = 0; i < HISTOGRAM_BUCKETS_LEN; i++) {
+    counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+    total += counts[i];
+  }
+  if (0 == total) {
+    return 0;
+  }
+
+  // Rank of the quantile, rounded up.
+  const u64 rank = (total * per_mille + 999) / 1000;
+  u64 seen = 0;
+  for (u64 i = 0; i < HISTOGRAM_BUCKETS_LEN; i++) {
+    seen += counts[i];
+    if (seen >= rank && seen > 0) {
+      return histogram_bucket_bound(unit, i);
+    }
+  }
+  return UINT64_MAX; // Unreachable.
+}
+
+// Start of a sample, `name{key="value"`, for the caller to complete.
+static void http_metrics_write_label(BufWriter *w, String name, String key,
+                                     String value) {
+  buf_writer_write(w, name);
+  buf_writer_write(w, S("{"));
+  buf_writer_write(w, key);
+  buf_writer_write(w, S("=\""));
+  buf_writer_write(w, value);
+  buf_writer_write(w, S("\""));
+}
+
+// Prometheus wants seconds, e.g. `0.000032`.
+static void http_metrics_write_seconds(BufWriter *w, u64 ns) {
+  buf_writer_u64(w, ns / 1'000'000'000);
+
+  u64 frac = ns % 1'000'000'000;
+  if (0 == frac) {
+    return;
+  }
+  u8 digits[9] = {0};
+  for (u64 i = sizeof(digits); i > 0; i--) {
+    digits[i - 1] = (u8)('0' + frac % 10);
+    frac /= 10;
+  }
+  u64 len = sizeof(digits);
+  while ('0' == digits[len - 1]) {
+    len -= 1;
+  }
+  buf_writer_write(w, S("."));
+  buf_writer_write(w, (String){.data = digits, .len = len});
+}
+
+static void http_metrics_write_value(BufWriter *w, HistogramUnit unit,
+                                     u64 value) {
+  if (HISTOGRAM_UNIT_NS == unit) {
+    http_metrics_write_seconds(w, value);
+  } else {
+    buf_writer_u64(w, value);
+  }
+}
+
+// One series of a histogram, e.g. `name_bucket{route="home",le="..."}`. The
+// `# TYPE` line is left to the caller, to group the series of a metric.
+[[maybe_unused]] static void
+histogram_write_metrics(BufWriter *w, String name, String key, String value,
+                        Histogram *h, HistogramUnit unit) {
+  u64 cumulative = 0;
+  for (u64 i = 0; i < HISTOGRAM_BUCKETS_LEN; i++) {
+    cumulative += atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+
+    buf_writer_write(w, name);
+    http_metrics_write_label(w, S("_bucket"), key, value);
+    buf_writer_write(w, S(",le=\""));
+    if (i + 1 == HISTOGRAM_BUCKETS_LEN) {
+      buf_writer_write(w, S("+Inf"));
+    } else {
+      http_metrics_write_value(w, unit, histogram_bucket_bound(unit, i));
+    }
+    buf_writer_write(w, S("\"} "));
+    buf_writer_u64(w, cumulative);
+    buf_writer_write(w, S("\n"));
+  }
+
+  buf_writer_write(w, name);
+  http_metrics_write_label(w, S("_sum"), key, value);
+  buf_writer_write(w, S("} "));
+  http_metrics_write_value(
+      w, unit, atomic_load_explicit(&h->sum, memory_order_relaxed));
+  buf_writer_write(w, S("\n"));
+
+  buf_writer_write(w, name);
+  http_metrics_write_label(w, S("_count"), key, value);
+  buf_writer_write(w, S("} "));
+  buf_writer_u64(w, atomic_load_explicit(&h->count, memory_order_relaxed));
+  buf_writer_write(w, S("\n"));
+}
+
+// Memory use of the requests, per route, in memory shared by all the worker
+// processes.
+typedef struct {
+  // Requests that used more than the pre-faulted memory.
+  _Atomic u64 overflows;
+  _Atomic u64 max_use;
+  // In `HISTOGRAM_UNIT_BYTES`.
+  Histogram use;
+} HttpArenaStats;
+
+// Memory use of all the requests, created by `http_server_run`.
+static HttpArenaStats *http_server_arena_stats = nullptr;
+// Pre-faulted memory of the request arenas, which the autotuner adjusts.
+static u64 http_server_arena_prefault_len = HTTP_SERVER_HANDLER_MEM_LEN;
+// When set, the pre-faulted memory follows the p99 of the observed memory
+// use, instead of `HTTP_SERVER_HANDLER_MEM_LEN`.
+[[maybe_unused]] static bool http_server_arena_autotune = false;
+
+// Returns `nullptr` on failure.
+[[maybe_unused]] [[nodiscard]] static HttpArenaStats *
+http_arena_stats_make_shared(u64 len) {
+  ASSERT(len > 0);
+
+  void *mem = mmap(nullptr, len * sizeof(HttpArenaStats),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  return MAP_FAILED == mem ? nullptr : mem;
+}
+
+
+static void http_arena_stats_record(HttpArenaStats *stats, u64 use,
+                                    u64 prefault_len) {
+  if (use > prefault_len) {
+    atomic_fetch_add_explicit(&stats->overflows, 1, memory_order_relaxed);
+  }
+  histogram_record(&stats->use, HISTOGRAM_UNIT_BYTES, use);
+
+  u64 max_use = atomic_load_explicit(&stats->max_use, memory_order_relaxed);
+  while (use > max_use &&
+         !atomic_compare_exchange_weak_explicit(&stats->max_use, &max_use, use,
+                                                memory_order_relaxed,
+                                                memory_order_relaxed)) {
+  }
+}
+
+// Prometheus text format, one series per route. The samples of a metric are
+// grouped, as the format requires.
+[[maybe_unused]] static void
+http_arena_stats_write_metrics(BufWriter *w, const String *routes,
+                               HttpArenaStats *const *stats, u64 len) {
+  buf_writer_write(w, S("# TYPE http_arena_use_bytes histogram\n"));
+  for (u64 r = 0; r < len; r++) {
+    histogram_write_metrics(w, S("http_arena_use_bytes"), S("route"),
+                            routes[r], &stats[r]->use, HISTOGRAM_UNIT_BYTES);
+  }
+
+  buf_writer_write(w, S("# TYPE http_arena_overflows_total counter\n"));
+  for (u64 r = 0; r < len; r++) {
+    http_metrics_write_label(w, S("http_arena_overflows_total"), S("route"),
+                             routes[r]);
+    buf_writer_write(w, S("} "));
+    buf_writer_u64(
+        w, atomic_load_explicit(&stats[r]->overflows, memory_order_relaxed));
+    buf_writer_write(w, S("\n"));
+  }
+
+  buf_writer_write(w, S("# TYPE http_arena_max_use_bytes gauge\n"));
+  for (u64 r = 0; r < len; r++) {
+    http_metrics_write_label(w, S("http_arena_max_use_bytes"), S("route"),
+                             routes[r]);
+    buf_writer_write(w, S("} "));
+    buf_writer_u64(
+        w, atomic_load_explicit(&stats[r]->max_use, memory_order_relaxed));
+    buf_writer_write(w, S("\n"));
+  }
+}
+
+// Responses by status class, `1xx` to `5xx`.
+#define HTTP_STATUS_CLASSES_LEN 5
+
+// Requests served, per route, in memory shared by all the worker processes.
+typedef struct {
+  _Atomic u64 responses[HTTP_STATUS_CLASSES_LEN];
+  // From the start of the read to the end of the write.
+  Histogram duration;
+} HttpRequestStats;
+
+// All the requests, created by `http_server_run`.
+static HttpRequestStats *http_server_request_stats = nullptr;
+
+// Returns `nullptr` on failure.
+[[maybe_unused]] [[nodiscard]] static HttpRequestStats *
+http_request_stats_make_shared(u64 len) {
+  ASSERT(len > 0);
+
+  void *mem = mmap(nullptr, len * sizeof(HttpRequestStats),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  return MAP_FAILED == mem ? nullptr : mem;
+}
+
+static void http_request_stats_record(HttpRequestStats *stats, u16 status,
+                                      u64 duration_ns) {
+  // A status out of range is a bug of the server.
+  u64 idx = status / 100 - 1;
+  if (status < 100 || idx >= HTTP_STATUS_CLASSES_LEN) {
+    idx = HTTP_STATUS_CLASSES_LEN - 1;
+  }
+  atomic_fetch_add_explicit(&stats->responses[idx], 1, memory_order_relaxed);
+  histogram_record(&stats->duration, HISTOGRAM_UNIT_NS, duration_ns);
+}
+
+// Prometheus text format, one series per route.
+[[maybe_unused]] static void
+http_request_stats_write_metrics(BufWriter *w, const String *routes,
+                                 HttpRequestStats *const *stats, u64 len) {
+  static const String classes[HTTP_STATUS_CLASSES_LEN] = {
+      S("1xx"), S("2xx"), S("3xx"), S("4xx"), S("5xx"),
+  };
+
+  buf_writer_write(w, S("# TYPE http_requests_total counter\n"));
+  for (u64 r = 0; r < len; r++) {
+    for (u64 i = 0; i < HTTP_STATUS_CLASSES_LEN; i++) {
+      http_metrics_write_label(w, S("http_requests_total"), S("route"),
+                               routes[r]);
+      buf_writer_write(w, S(",code=\""));
+      buf_writer_write(w, classes[i]);
+      buf_writer_write(w, S("\"} "));
+      buf_writer_u64(w, atomic_load_explicit(&stats[r]->responses[i],
+                                             memory_order_relaxed));
+      buf_writer_write(w, S("\n"));
+    }
+  }
+
+  buf_writer_write(w, S("# TYPE http_request_duration_seconds histogram\n"));
+  for (u64 r = 0; r < len; r++) {
+    histogram_write_metrics(w, S("http_request_duration_seconds"),
+                            S("route"), routes[r], &stats[r]->duration,
+                            HISTOGRAM_UNIT_NS);
+  }
+}
+
+// Phases of a request, to tell where a slow one spent its time.
+// Reading the headers and the body is one phase: `request_read` does both.
+typedef enum {
+  // From `accept(2)` to the start of the read: fork and setup.
+  HTTP_PHASE_ACCEPT,
+  HTTP_PHASE_READ,
+  // In the handler, waiting on the database.
+  HTTP_PHASE_DB,
+  // The rest of the handler, mostly building the response. Streamed bodies
+  // are rendered while writing instead.
+  HTTP_PHASE_RENDER,
+  HTTP_PHASE_WRITE,
+  HTTP_PHASE_MAX, // Pseudo-value.
+} HttpPhase;
+
+static const String http_phase_to_s[HTTP_PHASE_MAX] = {
+    [HTTP_PHASE_ACCEPT] = S("accept"), [HTTP_PHASE_READ] = S("read"),
+    [HTTP_PHASE_DB] = S("db"),         [HTTP_PHASE_RENDER] = S("render"),
+    [HTTP_PHASE_WRITE] = S("write"),
+};
+
+// Durations of the phases of all the requests, indexed by `HttpPhase`,
+// created by `http_server_run`.
+static Histogram *http_server_phase_stats = nullptr;
+
+[[maybe_unused]] static void
+http_phase_stats_write_metrics(BufWriter *w, Histogram *phases) {
+  buf_writer_write(
+      w, S("# TYPE http_request_phase_duration_seconds histogram\n"));
+  for (u64 i = 0; i < HTTP_PHASE_MAX; i++) {
+    histogram_write_metrics(w, S("http_request_phase_duration_seconds"),
+                            S("phase"), http_phase_to_s[i], &phases[i],
+                            HISTOGRAM_UNIT_NS);
+  }
+}
+
+// Allow at most `len` more bytes to be allocated for the rest of the request,
+// e.g. the memory budget of the route.
+[[maybe_unused]] static void http_arena_limit(Arena *arena, u64 len) {
+  ASSERT(arena->end >= arena->start);
+  if ((u64)arena->end - (u64)arena->start > len) {
+    arena->end = arena->start + len;
+  }
+}
 
-  dyn_append_slice(&sb, S("HTTP/1.1 "), arena);
-  dynu8_append_u64_to_string(&sb, res.status, arena);
-  dyn_append_slice(&sb, S("\r\n"), arena);
+typedef Error (*HttpBodyWriteFn)(int fd, void *ctx, Arena *arena);
+
+// Per-request data exchanged between the server and the request handler, for
+// what does not fit in `HttpResponse`.
+typedef struct {
+  // When non-empty, the response body, sent with `writev(2)` without
+  // concatenating the segments first (e.g. cached fragments).
+  // `HttpResponse.body` must then be empty.
+  StringSlice body_segments;
+  // When non-empty, the complete response, serialized ahead of time, which is
+  // sent as is (see `HttpStaticResponse`). The `HttpResponse` is then only
+  // used for logging.
+  String raw_response;
+  // When set, called once the headers are sent, to write the body straight to
+  // the socket (e.g. with an `BufWriter`) instead of building it in memory
+  // first. The body is delimited by the closing of the connection.
+  HttpBodyWriteFn body_write;
+  void *body_write_ctx;
+  // Set by the handler to account the memory use of the request to its
+  // route, otherwise it goes to the server-wide stats.
+  HttpArenaStats *arena_stats;
+  // Same, for the response status and the duration.
+  HttpRequestStats *request_stats;
+  // Set by the handler: the part of its duration spent in the database.
+  u64 db_ns;
+} HttpExchange;
+
+[[nodiscard]] static Error http_writev_all(int fd, struct iovec *iov,
+                                           u64 iov_len) {
+  while (iov_len > 0) {
+    const int count = iov_len > (u64)IOV_MAX ? IOV_MAX : (int)iov_len;
+    ssize_t n = writev(fd, iov, count);
+    if (-1 == n) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return (Error)errno;
+    }
+
+    // Skip what was fully written and resume partial writes.
+    u64 written = (u64)n;
+    while (iov_len > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov += 1;
+      iov_len -= 1;
+    }
+    if (iov_len > 0) {
+      iov->iov_base = (u8 *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+static void response_write_head(BufWriter *w, HttpResponse res) {
+  buf_writer_write(w, S("HTTP/1.1 "));
+  buf_writer_u64(w, res.status);
+  buf_writer_write(w, S("\r\n"));
 
   for (u64 i = 0; i < res.headers.len; i++) {
     KeyValue header = dyn_at(res.headers, i);
-    dyn_append_slice(&sb, header.key, arena);
-    dyn_append_slice(&sb, S(": "), arena);
-    dyn_append_slice(&sb, header.value, arena);
-    dyn_append_slice(&sb, S("\r\n"), arena);
+    buf_writer_write(w, header.key);
+    buf_writer_write(w, S(": "));
+    buf_writer_write(w, header.value);
+    buf_writer_write(w, S("\r\n"));
   }
 
-  dyn_append_slice(&sb, S("\r\n"), arena);
-  if (!slice_is_empty(res.body)) {
-    dyn_append_slice(&sb, res.body, arena);
-  }
+  buf_writer_write(w, S("\r\n"));
+  buf_writer_write(w, res.body);
+}
+
+// Status line, headers and body, but not the file to send, if any.
+// Measured first, to be allocated exactly once.
+[[nodiscard]] static String response_serialize(HttpResponse res,
+                                               Arena *arena) {
+  BufWriter measure = buf_writer_make_measure();
+  response_write_head(&measure, res);
+  ASSERT(measure.len > 0);
+
+  BufWriter w = buf_writer_make(-1, measure.len, arena);
+  response_write_head(&w, res);
+  ASSERT(0 == w.err);
+  ASSERT(measure.len == w.len);
+
+  return buf_writer_string(w);
+}
+
+[[nodiscard]] static Error response_write(Writer *writer, HttpResponse res,
+                                          HttpExchange *exchange,
+                                          Arena *arena) {
+  // Invalid to both want to serve a file and a body.
+  ASSERT(slice_is_empty(res.file_path) || slice_is_empty(res.body));
+  ASSERT(slice_is_empty(res.body) || slice_is_empty(exchange->body_segments));
 
-  const String s = dyn_slice(String, sb);
+  if (!slice_is_empty(exchange->raw_response)) {
+    return writer_write_all_sync(writer, exchange->raw_response);
+  }
 
-  Error err = writer_write_all_sync(writer, s);
+  const String s = response_serialize(res, arena);
+
+  Error err = 0;
+  if (slice_is_empty(exchange->body_segments)) {
+    err = writer_write_all_sync(writer, s);
+  } else {
+    const u64 iov_len = 1 + exchange->body_segments.len;
+    struct iovec *iov = arena_new(arena, struct iovec, iov_len);
+    iov[0] = (struct iovec){.iov_base = s.data, .iov_len = s.len};
+    for (u64 i = 0; i < exchange->body_segments.len; i++) {
+      String segment = slice_at(exchange->body_segments, i);
+      iov[1 + i] = (struct iovec){.iov_base = segment.data,
+                                  .iov_len = segment.len};
+    }
+    err = http_writev_all(writer->fd, iov, iov_len);
+  }
   if (0 != err) {
     return err;
   }
 
+  if (nullptr != exchange->body_write) {
+    ASSERT(slice_is_empty(res.body));
+    ASSERT(slice_is_empty(exchange->body_segments));
+
+    err = exchange->body_write(writer->fd, exchange->body_write_ctx, arena);
+    if (0 != err) {
+      return err;
+    }
+  }
+
   if (!slice_is_empty(res.file_path)) {
     char *file_path_c = string_to_cstr(res.file_path, arena);
     int file_fd = open(file_path_c, O_RDONLY);
@@ -80,75 +773,263 @@ http_response_register_file_for_sending(HttpResponse *res, String path) {
   res->file_path = path;
 }
 
-typedef HttpResponse (*HttpRequestHandleFn)(HttpRequest req, void *ctx,
-                                            Arena *arena);
+// A response that never changes (e.g. a page without dynamic content),
+// serialized once at startup with its `Content-Length` and `ETag`, and then
+// sent as is, like a static asset.
+typedef struct {
+  String etag;
+  // 200, with the body.
+  String ok;
+  // 304, for a request with a matching `If-None-Match`.
+  String not_modified;
+} HttpStaticResponse;
+
+[[nodiscard]] static String http_etag_make(String body, Arena *arena) {
+  // FNV-1a.
+  u64 hash = 0xcbf2'9ce4'8422'2325;
+  for (u64 i = 0; i < body.len; i++) {
+    hash ^= body.data[i];
+    hash *= 0x0100'0000'01b3;
+  }
+
+  static const u8 hex[] = "0123456789abcdef";
+  const u64 len = 2 + 16;
+  u8 *data = arena_new(arena, u8, len);
+  data[0] = '"';
+  for (u64 i = 0; i < 16; i++) {
+    data[1 + i] = hex[(hash >> (60 - 4 * i)) & 0xf];
+  }
+  data[len - 1] = '"';
+
+  return (String){.data = data, .len = len};
+}
+
+[[maybe_unused]] [[nodiscard]] static HttpStaticResponse
+http_static_response_make(String content_type, String body, Arena *arena) {
+  HttpStaticResponse res = {.etag = http_etag_make(body, arena)};
+
+  DynU8 content_length = {0};
+  dynu8_append_u64_to_string(&content_length, body.len, arena);
+
+  {
+    HttpResponse ok = {.status = 200, .body = body};
+    http_push_header(&ok.headers, S("Content-Type"), content_type, arena);
+    http_push_header(&ok.headers, S("Content-Length"),
+                     dyn_slice(String, content_length), arena);
+    http_push_header(&ok.headers, S("ETag"), res.etag, arena);
+    http_push_header(&ok.headers, S("Connection"), S("close"), arena);
+
+    res.ok = response_serialize(ok, arena);
+  }
+  {
+    HttpResponse not_modified = {.status = 304};
+    http_push_header(&not_modified.headers, S("ETag"), res.etag, arena);
+    http_push_header(&not_modified.headers, S("Connection"), S("close"),
+                     arena);
+
+    res.not_modified = response_serialize(not_modified, arena);
+  }
 
-static void handle_client(int socket, HttpRequestHandleFn handle, void *ctx) {
-  Arena arena = arena_make_from_virtual_mem(HTTP_SERVER_HANDLER_MEM_LEN);
-  BufferedReader reader = buffered_reader_make(socket, &arena);
-  const HttpRequest req = request_read(&reader, &arena);
+  return res;
+}
+
+// Pick the variant to send and return the status, for logging.
+[[maybe_unused]] [[nodiscard]] static u16
+http_static_response_serve(HttpStaticResponse static_res, HttpRequest req,
+                           HttpExchange *exchange, Arena *arena) {
+  ASSERT(!slice_is_empty(static_res.ok));
+
+  for (u64 i = 0; i < req.headers.len; i++) {
+    KeyValue h = slice_at(req.headers, i);
+    if (!string_ieq_ascii(h.key, S("If-None-Match"), arena)) {
+      continue;
+    }
+
+    // A list of etags, or `*`.
+    if (string_eq(h.value, S("*")) ||
+        -1 != string_indexof_string(h.value, static_res.etag)) {
+      exchange->raw_response = static_res.not_modified;
+      return 304;
+    }
+  }
+
+  exchange->raw_response = static_res.ok;
+  return 200;
+}
+
+// The arena of a request, mapped by the child process serving it: memory
+// faulted in by the listening process before forking would only be copied
+// again on the first write.
+// The first `prefault_len` bytes are faulted in at once, and the rest of the
+// reservation, up to `len`, on demand: a request outgrowing the common case
+// gets more memory instead of failing.
+[[maybe_unused]] [[nodiscard]] static Error
+http_request_arena_make(Arena *out, u64 len, u64 prefault_len) {
+  ASSERT(prefault_len <= len);
+
+  u8 *mem = mmap(nullptr, len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == mem) {
+    return (Error)errno;
+  }
 
-  log(LOG_LEVEL_INFO, "http request start", &arena, L("req.path", req.path_raw),
-      L("req.body.len", req.body.len), L("err", req.err),
-      L("req.headers.len", req.headers.len), L("req.id", req.id),
-      L("req.method", http_method_to_s(req.method)));
+#ifdef MADV_POPULATE_WRITE
+  // One system call instead of a page fault per page. Best effort: older
+  // kernels fault on demand.
+  (void)madvise(mem, prefault_len, MADV_POPULATE_WRITE);
+#endif
+
+  *out = (Arena){.start = mem, .end = mem + len};
+  return 0;
+}
+
+typedef HttpResponse (*HttpRequestHandleFn)(HttpRequest req,
+                                            HttpExchange *exchange, void *ctx,
+                                            Arena *arena);
+
+// `accepted_ns` is when the connection was accepted, on the monotonic clock.
+// `log_sampled` gates the per-request lines; errors are always logged.
+static void handle_client(int socket, Arena *arena, HttpRequestHandleFn handle,
+                          void *ctx, u64 accepted_ns, bool log_sampled) {
+  ASSERT(arena->end >= arena->start);
+  const u64 start_ns = clock_monotonic_ns();
+  u8 *const arena_base = arena->start;
+  u8 *const arena_reserve_end = arena->end;
+
+  // Routes set their own ceiling once the request is read.
+  http_arena_limit(arena, HTTP_SERVER_REQUEST_READ_MEM_MAX);
+  BufferedReader reader = buffered_reader_make(socket, arena);
+  const HttpRequest req = request_read(&reader, arena);
+  arena->end = arena_reserve_end;
+  const u64 read_ns = clock_monotonic_ns();
+
+  if (log_sampled) {
+    log_at(LOG_LEVEL_INFO, "http request start", arena,
+           L("req.path", req.path_raw), L("req.body.len", req.body.len),
+           L("err", req.err), L("req.headers.len", req.headers.len),
+           L("req.id", req.id), L("req.method", http_method_to_s(req.method)));
+  }
   if (req.err) {
-    log(LOG_LEVEL_ERROR, "http request read", &arena, L("err", req.err),
-        L("req.id", req.id));
+    log_at(LOG_LEVEL_ERROR, "http request read", arena, L("err", req.err),
+           L("req.id", req.id));
+    http_arena_stats_record(http_server_arena_stats,
+                            (u64)arena->start - (u64)arena_base,
+                            http_server_arena_prefault_len);
     return;
   }
 
-  HttpResponse res = handle(req, ctx, &arena);
-  http_push_header(&res.headers, S("Connection"), S("close"), &arena);
+  HttpExchange exchange = {0};
+  HttpResponse res = handle(req, &exchange, ctx, arena);
+  http_push_header(&res.headers, S("Connection"), S("close"), arena);
+  const u64 handled_ns = clock_monotonic_ns();
 
   Writer writer = {.fd = socket};
-  Error err = response_write(&writer, res, &arena);
+  Error err = response_write(&writer, res, &exchange, arena);
   if (err) {
-    log(LOG_LEVEL_ERROR, "http request write", &arena, L("err", err),
-        L("req.id", req.id));
+    log_at(LOG_LEVEL_ERROR, "http request write", arena, L("err", err),
+           L("req.id", req.id));
+  }
+  const u64 written_ns = clock_monotonic_ns();
+
+  ASSERT(arena->end >= arena->start);
+
+  const u64 handler_ns = handled_ns - read_ns;
+  const u64 db_ns = exchange.db_ns < handler_ns ? exchange.db_ns : handler_ns;
+  const u64 phases[HTTP_PHASE_MAX] = {
+      [HTTP_PHASE_ACCEPT] = start_ns - accepted_ns,
+      [HTTP_PHASE_READ] = read_ns - start_ns,
+      [HTTP_PHASE_DB] = db_ns,
+      [HTTP_PHASE_RENDER] = handler_ns - db_ns,
+      [HTTP_PHASE_WRITE] = written_ns - handled_ns,
+  };
+  if (nullptr != http_server_phase_stats) {
+    for (u64 i = 0; i < HTTP_PHASE_MAX; i++) {
+      histogram_record(&http_server_phase_stats[i], HISTOGRAM_UNIT_NS,
+                       phases[i]);
+    }
   }
 
-  ASSERT(arena.end >= arena.start);
+  const u64 duration_ns = written_ns - start_ns;
+  http_request_stats_record(http_server_request_stats, res.status,
+                            duration_ns);
+  if (nullptr != exchange.request_stats) {
+    http_request_stats_record(exchange.request_stats, res.status, duration_ns);
+  }
 
-  const u64 mem_use =
-      HTTP_SERVER_HANDLER_MEM_LEN - ((u64)arena.end - (u64)arena.start);
-  log(LOG_LEVEL_INFO, "http request end", &arena, L("arena_use", mem_use),
-      L("req.path", req.path_raw), L("req.headers.len", req.headers.len),
-      L("res.headers.len", res.headers.len), L("status", res.status),
-      L("req.method", http_method_to_s(req.method)),
-      L("res.file_path", res.file_path), L("res.body.len", res.body.len),
-      L("req.id", req.id));
+  const u64 mem_use = (u64)arena->start - (u64)arena_base;
+  http_arena_stats_record(http_server_arena_stats, mem_use,
+                          http_server_arena_prefault_len);
+  if (nullptr != exchange.arena_stats) {
+    http_arena_stats_record(exchange.arena_stats, mem_use,
+                            http_server_arena_prefault_len);
+  }
+  if (log_sampled) {
+    log_at(LOG_LEVEL_INFO, "http request end", arena, L("arena_use", mem_use),
+           L("req.path", req.path_raw), L("req.headers.len", req.headers.len),
+           L("res.headers.len", res.headers.len), L("status", res.status),
+           L("req.method", http_method_to_s(req.method)),
+           L("res.file_path", res.file_path), L("res.body.len", res.body.len),
+           L("res.body_segments.len", exchange.body_segments.len),
+           L("duration_ns", duration_ns),
+           L("phase.accept_ns", phases[HTTP_PHASE_ACCEPT]),
+           L("phase.read_ns", phases[HTTP_PHASE_READ]),
+           L("phase.db_ns", phases[HTTP_PHASE_DB]),
+           L("phase.render_ns", phases[HTTP_PHASE_RENDER]),
+           L("phase.write_ns", phases[HTTP_PHASE_WRITE]), L("req.id", req.id));
+  }
 
   close(socket);
 }
 
+// Pre-fault the p99 of the memory use observed so far, so that most requests
+// never fault, without keeping more memory resident than they need.
+static void http_server_arena_autotune_run(Arena *arena) {
+  u64 prefault_len = histogram_quantile(&http_server_arena_stats->use,
+                                       HISTOGRAM_UNIT_BYTES, 990);
+  if (prefault_len < HTTP_SERVER_HANDLER_MEM_MIN) {
+    prefault_len = HTTP_SERVER_HANDLER_MEM_MIN;
+  }
+  if (prefault_len > HTTP_SERVER_HANDLER_MEM_MAX) {
+    prefault_len = HTTP_SERVER_HANDLER_MEM_MAX;
+  }
+  if (prefault_len == http_server_arena_prefault_len) {
+    return;
+  }
+
+  log_at(LOG_LEVEL_INFO, "arena autotune", arena,
+         L("prefault_len.old", http_server_arena_prefault_len),
+         L("prefault_len.new", prefault_len));
+  // Picked up by the child processes forked from now on.
+  http_server_arena_prefault_len = prefault_len;
+}
+
 [[maybe_unused]] [[nodiscard]]
 static Error http_server_run(u16 port, HttpRequestHandleFn request_handler,
                              void *ctx, Arena *arena) {
 
   struct sigaction sa = {.sa_flags = SA_NOCLDWAIT};
   if (-1 == sigaction(SIGCHLD, &sa, nullptr)) {
-    log(LOG_LEVEL_ERROR, "sigaction(2)", arena, L("err", errno));
+    log_at(LOG_LEVEL_ERROR, "sigaction(2)", arena, L("err", errno));
     return (Error)errno;
   }
 
   const int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
   if (-1 == sock_fd) {
-    log(LOG_LEVEL_ERROR, "socket(2)", arena, L("err", errno));
+    log_at(LOG_LEVEL_ERROR, "socket(2)", arena, L("err", errno));
     return (Error)errno;
   }
 
   int val = 1;
   if (-1 == setsockopt(sock_fd, SOL_SOCKET, SO_REUSEADDR, &val, sizeof(val))) {
-    log(LOG_LEVEL_ERROR, "setsockopt(2)", arena, L("err", errno),
-        L("option", S("SO_REUSEADDR")));
+    log_at(LOG_LEVEL_ERROR, "setsockopt(2)", arena, L("err", errno),
+           L("option", S("SO_REUSEADDR")));
     return (Error)errno;
   }
 
 #ifdef __FreeBSD__
   if (-1 == setsockopt(sock_fd, SOL_SOCKET, SO_REUSEPORT, &val, sizeof(val))) {
-    log(LOG_LEVEL_ERROR, "setsockopt(2)", arena, L("err", errno),
-        L("option", S("SO_REUSEPORT")));
+    log_at(LOG_LEVEL_ERROR, "setsockopt(2)", arena, L("err", errno),
+           L("option", S("SO_REUSEPORT")));
     return (Error)errno;
   }
 #endif
@@ -159,24 +1040,53 @@ static Error http_server_run(u16 port, HttpRequestHandleFn request_handler,
   };
 
   if (-1 == bind(sock_fd, (const struct sockaddr *)&addr, sizeof(addr))) {
-    log(LOG_LEVEL_ERROR, "bind(2)", arena, L("err", errno));
+    log_at(LOG_LEVEL_ERROR, "bind(2)", arena, L("err", errno));
     return (Error)errno;
   }
 
   if (-1 == listen(sock_fd, TCP_LISTEN_BACKLOG)) {
-    log(LOG_LEVEL_ERROR, "listen(2)", arena, L("err", errno));
+    log_at(LOG_LEVEL_ERROR, "listen(2)", arena, L("err", errno));
     return (Error)errno;
   }
 
-  log(LOG_LEVEL_INFO, "http server listening", arena, L("port", port),
-      L("backlog", TCP_LISTEN_BACKLOG));
+  http_server_arena_stats = http_arena_stats_make_shared(1);
+  if (nullptr == http_server_arena_stats) {
+    log_at(LOG_LEVEL_ERROR, "failed to create the arena stats", arena,
+           L("err", errno));
+    return (Error)errno;
+  }
+
+  http_server_phase_stats =
+      mmap(nullptr, HTTP_PHASE_MAX * sizeof(Histogram),
+           PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == http_server_phase_stats) {
+    log_at(LOG_LEVEL_ERROR, "failed to create the phase stats", arena,
+           L("err", errno));
+    return (Error)errno;
+  }
+
+  http_server_request_stats = http_request_stats_make_shared(1);
+  if (nullptr == http_server_request_stats) {
+    log_at(LOG_LEVEL_ERROR, "failed to create the request stats", arena,
+           L("err", errno));
+    return (Error)errno;
+  }
+
+  log_at(LOG_LEVEL_INFO, "http server listening", arena, L("port", port),
+         L("backlog", TCP_LISTEN_BACKLOG));
+
+  for (u64 connections = 1;; connections++) {
+    if (http_server_arena_autotune &&
+        0 == connections % HTTP_SERVER_ARENA_AUTOTUNE_PERIOD) {
+      http_server_arena_autotune_run(arena);
+    }
 
-  while (true) {
     // TODO: setrlimit(2) to cap the number of child processes.
     const int conn_fd = accept(sock_fd, nullptr, 0);
+    const u64 accepted_ns = clock_monotonic_ns();
     if (conn_fd == -1) {
-      log(LOG_LEVEL_ERROR, "accept(2)", arena, L("err", errno),
-          L("arena.available", (u64)arena->end - (u64)arena->start));
+      log_at(LOG_LEVEL_ERROR, "accept(2)", arena, L("err", errno),
+             L("arena.available", (u64)arena->end - (u64)arena->start));
       if (EINTR == errno) {
         continue;
       }
@@ -185,10 +1095,20 @@ static Error http_server_run(u16 port, HttpRequestHandleFn request_handler,
 
     pid_t pid = fork();
     if (pid == -1) { // Error.
-      log(LOG_LEVEL_ERROR, "fork(2)", arena, L("err", errno));
+      log_at(LOG_LEVEL_ERROR, "fork(2)", arena, L("err", errno));
       close(conn_fd);
     } else if (pid == 0) { // Child.
-      handle_client(conn_fd, request_handler, ctx);
+      Arena request_arena = {0};
+      Error err =
+          http_request_arena_make(&request_arena, HTTP_SERVER_HANDLER_MEM_MAX,
+                                  http_server_arena_prefault_len);
+      if (err) {
+        log_at(LOG_LEVEL_ERROR, "failed to create the request arena", arena,
+               L("err", err));
+        exit(1);
+      }
+      handle_client(conn_fd, &request_arena, request_handler, ctx, accepted_ns,
+                    log_sampled(connections));
       exit(0);
     } else { // Parent.
       close(conn_fd);
@@ -212,8 +1132,9 @@ http_client_request(Ipv4AddressSocket sock, HttpRequest req, Arena *arena) {
   }
 
   String http_request_serialized = http_request_serialize(req, arena);
-  log(LOG_LEVEL_DEBUG, "http request", arena, L("ip", sock.address.ip),
-      L("port", sock.address.port), L("serialized", http_request_serialized));
+  log_at(LOG_LEVEL_DEBUG, "http request", arena, L("ip", sock.address.ip),
+         L("port", sock.address.port),
+         L("serialized", http_request_serialized));
 
   // TODO: should not be an assert but a returned error.
   ASSERT(send(sock.socket, http_request_serialized.data,
@@ -265,18 +1186,18 @@ http_client_request(Ipv4AddressSocket sock, HttpRequest req, Arena *arena) {
 
   res.err = reader_read_headers(&reader, &res.headers, arena);
   if (res.err) {
-    log(LOG_LEVEL_ERROR, "http request failed to read headers", arena,
-        L("req.method", req.method), L("req.path_raw", req.path_raw),
-        L("err", res.err));
+    log_at(LOG_LEVEL_ERROR, "http request failed to read headers", arena,
+           L("req.method", req.method), L("req.path_raw", req.path_raw),
+           L("err", res.err));
     goto end;
   }
 
   // Read body.
   IoResult body = buffered_reader_read_until_end(&reader, arena);
   if (body.err) {
-    log(LOG_LEVEL_ERROR, "http request failed to read body", arena,
-        L("req.method", req.method), L("req.path_raw", req.path_raw),
-        L("err", body.err));
+    log_at(LOG_LEVEL_ERROR, "http request failed to read body", arena,
+           L("req.method", req.method), L("req.path_raw", req.path_raw),
+           L("err", body.err));
     res.err = body.err;
     goto end;
   }
@@ -318,40 +1239,62 @@ typedef struct {
 [[nodiscard]] static FormDataKVElementParseResult
 form_data_kv_parse_element(String in, u8 ch_terminator, Arena *arena) {
   FormDataKVElementParseResult res = {0};
-  DynU8 data = {0};
 
-  u64 i = 0;
-  for (; i < in.len; i++) {
-    u8 c = in.data[i];
+  // First pass: validate, find the end, and measure the decoded length.
+  u64 end = 0;
+  u64 decoded_len = 0;
+  bool escaped = false;
+  for (; end < in.len; end++) {
+    u8 c = in.data[end];
+
+    if (ch_terminator == c) {
+      break;
+    }
 
     if ('+' == c) {
-      *dyn_push(&data, arena) = ' ';
+      escaped = true;
     } else if ('%' == c) {
-      if ((in.len - i) < 2) {
+      if ((in.len - end) < 3) {
         res.err = HS_ERR_INVALID_FORM_DATA;
         return res;
       }
-      u8 c1 = in.data[i + 1];
-      u8 c2 = in.data[i + 2];
-
-      if (!(ch_is_hex_digit(c1) && ch_is_hex_digit(c2))) {
+      if (!(ch_is_hex_digit(in.data[end + 1]) &&
+            ch_is_hex_digit(in.data[end + 2]))) {
         res.err = HS_ERR_INVALID_FORM_DATA;
         return res;
       }
+      escaped = true;
+      end += 2; // Consume 2 characters.
+    }
+    decoded_len += 1;
+  }
+  // Consume the terminator, if any.
+  res.remaining = slice_range(in, end < in.len ? end + 1 : end, 0);
 
-      u8 utf8_character = ch_from_hex(c1) * 16 + ch_from_hex(c2);
-      *dyn_push(&data, arena) = utf8_character;
-      i += 2; // Consume 2 characters.
-    } else if (ch_terminator == c) {
-      i += 1; // Consume.
-      break;
-    } else {
-      *dyn_push(&data, arena) = c;
+  // Common case: nothing to decode, point inside the input.
+  if (!escaped) {
+    // Not `slice_range`, which treats an end of 0 as the end of the input.
+    res.data = (String){.data = in.data, .len = end};
+    return res;
+  }
+
+  // Second pass: decode into an allocation of the exact size.
+  u8 *data = arena_new(arena, u8, decoded_len);
+  u64 len = 0;
+  for (u64 i = 0; i < end; i++) {
+    u8 c = in.data[i];
+
+    if ('+' == c) {
+      c = ' ';
+    } else if ('%' == c) {
+      c = ch_from_hex(in.data[i + 1]) * 16 + ch_from_hex(in.data[i + 2]);
+      i += 2;
     }
+    data[len++] = c;
   }
+  ASSERT(decoded_len == len);
 
-  res.data = dyn_slice(String, data);
-  res.remaining = slice_range(in, i, 0);
+  res.data = (String){.data = data, .len = len};
   return res;
 }
 
@@ -407,6 +1350,319 @@ form_data_parse(String in, Arena *arena) {
   return res;
 }
 
+// Compact binary encoding of a list of strings:
+// `varint(count) (varint(len) bytes)*`, with LEB128 varints.
+// Decoding does not copy the strings: they point inside the encoded input.
+
+static void dynu8_append_varint(DynU8 *sb, u64 n, Arena *arena) {
+  do {
+    u8 byte = n & 0x7f;
+    n >>= 7;
+    if (n) {
+      byte |= 0x80;
+    }
+    *dyn_push(sb, arena) = byte;
+  } while (n);
+}
+
+typedef struct {
+  u64 n;
+  Error err;
+  String remaining;
+} VarintParseResult;
+
+[[nodiscard]] static VarintParseResult varint_parse(String in) {
+  VarintParseResult res = {0};
+
+  for (u64 i = 0; i < in.len; i++) {
+    u8 byte = in.data[i];
+    // A u64 fits in at most 10 bytes of 7 bits each.
+    if (i >= 10 || (9 == i && byte > 1)) {
+      res.err = EINVAL;
+      return res;
+    }
+
+    res.n |= (u64)(byte & 0x7f) << (7 * i);
+    if (0 == (byte & 0x80)) {
+      res.remaining = slice_range(in, i + 1, 0);
+      return res;
+    }
+  }
+
+  // Truncated.
+  res.err = EINVAL;
+  return res;
+}
+
+[[maybe_unused]] [[nodiscard]] static String
+binary_encode_string_slice(StringSlice strings, Arena *arena) {
+  DynU8 sb = {0};
+
+  dynu8_append_varint(&sb, strings.len, arena);
+  for (u64 i = 0; i < strings.len; i++) {
+    String s = slice_at(strings, i);
+    dynu8_append_varint(&sb, s.len, arena);
+    dyn_append_slice(&sb, s, arena);
+  }
+
+  return dyn_slice(String, sb);
+}
+
+// Same encoding as `binary_encode_string_slice`, without copying the strings:
+// returns the parts to concatenate, which borrow the strings.
+[[maybe_unused]] [[nodiscard]] static StringSlice
+binary_encode_string_slice_parts(StringSlice strings, Arena *arena) {
+  DynString parts = {0};
+
+  DynU8 header = {0};
+  dynu8_append_varint(&header, strings.len, arena);
+  for (u64 i = 0; i < strings.len; i++) {
+    String s = slice_at(strings, i);
+    dynu8_append_varint(&header, s.len, arena);
+    *dyn_push(&parts, arena) = dyn_slice(String, header);
+    *dyn_push(&parts, arena) = s;
+    header = (DynU8){0};
+  }
+  if (0 == strings.len) {
+    *dyn_push(&parts, arena) = dyn_slice(String, header);
+  }
+
+  return dyn_slice(StringSlice, parts);
+}
+
+typedef struct {
+  StringSlice string_slice;
+  Error err;
+} BinaryDecodeStringSliceResult;
+
+// Only allocates the array of strings, once.
+[[maybe_unused]] [[nodiscard]] static BinaryDecodeStringSliceResult
+binary_decode_string_slice(String in, Arena *arena) {
+  BinaryDecodeStringSliceResult res = {0};
+
+  VarintParseResult count = varint_parse(in);
+  if (count.err) {
+    res.err = count.err;
+    return res;
+  }
+  // Each string takes at least one byte for its length.
+  if (count.n > count.remaining.len) {
+    res.err = EINVAL;
+    return res;
+  }
+
+  if (0 == count.n) {
+    return res;
+  }
+
+  String *strings = arena_new(arena, String, count.n);
+  String remaining = count.remaining;
+
+  for (u64 i = 0; i < count.n; i++) {
+    VarintParseResult len = varint_parse(remaining);
+    if (len.err) {
+      res.err = len.err;
+      return res;
+    }
+    if (len.n > len.remaining.len) {
+      res.err = EINVAL;
+      return res;
+    }
+
+    strings[i] = (String){.data = len.remaining.data, .len = len.n};
+    remaining = slice_range(len.remaining, len.n, 0);
+  }
+
+  // Trailing garbage.
+  if (!slice_is_empty(remaining)) {
+    res.err = EINVAL;
+    return res;
+  }
+
+  res.string_slice = (StringSlice){.data = strings, .len = count.n};
+  return res;
+}
+
+// 128 bits random, unguessable, identifier.
+// Internally compared and stored as integers, and only encoded as text at the
+// HTTP boundary: in base62 (22 characters), the canonical form in urls, or in
+// lowercase hex (32 characters), as in the links made before base62.
+// The encoding is fixed-width and big-endian so that the text order matches
+// the integer order.
+typedef struct {
+  u64 hi, lo;
+} Id128;
+
+typedef struct {
+  Id128 id;
+  bool ok;
+} Id128ParseResult;
+
+static const u64 ID128_HEX_LEN = 32;
+static const u64 ID128_BASE62_LEN = 22;
+static const u8 id128_base62_alphabet[] =
+    "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz";
+
+[[maybe_unused]] [[nodiscard]] static Id128 id128_random() {
+  Id128 res = {0};
+  arc4random_buf(&res, sizeof(res));
+  return res;
+}
+
+[[maybe_unused]] [[nodiscard]] static bool id128_eq(Id128 a, Id128 b) {
+  return a.hi == b.hi && a.lo == b.lo;
+}
+
+// For hash tables.
+[[maybe_unused]] [[nodiscard]] static u64 id128_hash(Id128 id) {
+  // Ids are random but mix anyway in case they stop being so. The
+  // multiplication only carries towards the high bits, see
+  // `id128_hash_index`.
+  return (id.hi ^ id.lo) * 0x9E37'79B9'7F4A'7C15;
+}
+
+// Index in a table of `slots_len` slots, a power of two: the high bits of the
+// hash, the low bits only depend on the low bits of the id.
+[[maybe_unused]] [[nodiscard]] static u64 id128_hash_index(Id128 id,
+                                                           u64 slots_len) {
+  ASSERT(slots_len > 0);
+  ASSERT(0 == (slots_len & (slots_len - 1)));
+  if (1 == slots_len) {
+    return 0;
+  }
+  return id128_hash(id) >> (64 - (u64)__builtin_ctzll(slots_len));
+}
+
+// Big-endian.
+[[maybe_unused]] static void id128_to_bytes(Id128 id, u8 out[16]) {
+  for (u64 i = 0; i < 8; i++) {
+    out[i] = (u8)(id.hi >> (56 - 8 * i));
+    out[8 + i] = (u8)(id.lo >> (56 - 8 * i));
+  }
+}
+
+[[maybe_unused]] [[nodiscard]] static Id128 id128_from_bytes(const u8 in[16]) {
+  Id128 res = {0};
+  for (u64 i = 0; i < 8; i++) {
+    res.hi = (res.hi << 8) | (u64)in[i];
+    res.lo = (res.lo << 8) | (u64)in[8 + i];
+  }
+  return res;
+}
+
+// Returns 0xff for an invalid character. Lowercase only, so that an id has
+// only one hex form.
+[[nodiscard]] static u8 id128_hex_value(u8 c) {
+  u8 digit = (u8)(c - '0');
+  u8 letter = (u8)(c - 'a');
+  if (digit < 10) {
+    return digit;
+  }
+  if (letter < 6) {
+    return (u8)(letter + 10);
+  }
+  return 0xff;
+}
+
+[[maybe_unused]] [[nodiscard]] static Id128ParseResult
+id128_parse_hex(String s) {
+  Id128ParseResult res = {0};
+  if (ID128_HEX_LEN != s.len) {
+    return res;
+  }
+
+  // Accumulate errors instead of bailing out early, to keep the loop simple
+  // for the compiler to unroll and vectorize.
+  u8 invalid = 0;
+  for (u64 i = 0; i < 16; i++) {
+    u8 hi = id128_hex_value(s.data[i]);
+    u8 lo = id128_hex_value(s.data[16 + i]);
+    invalid |= hi | lo;
+    res.id.hi = (res.id.hi << 4) | (u64)(hi & 0xf);
+    res.id.lo = (res.id.lo << 4) | (u64)(lo & 0xf);
+  }
+
+  res.ok = 0 == (invalid & 0xf0);
+  return res;
+}
+
+[[maybe_unused]] [[nodiscard]] static String id128_to_hex(Id128 id,
+                                                          Arena *arena) {
+  static const u8 hex_alphabet[] = "0123456789abcdef";
+
+  u8 *data = arena_new(arena, u8, ID128_HEX_LEN);
+  for (u64 i = 0; i < 16; i++) {
+    data[i] = hex_alphabet[(id.hi >> (60 - 4 * i)) & 0xf];
+    data[16 + i] = hex_alphabet[(id.lo >> (60 - 4 * i)) & 0xf];
+  }
+  return (String){.data = data, .len = ID128_HEX_LEN};
+}
+
+[[maybe_unused]] [[nodiscard]] static Id128ParseResult
+id128_parse_base62(String s) {
+  Id128ParseResult res = {0};
+  if (ID128_BASE62_LEN != s.len) {
+    return res;
+  }
+
+  // Big-endian 32 bits limbs, to multiply without 128 bits arithmetic.
+  u64 limbs[4] = {0};
+  for (u64 i = 0; i < s.len; i++) {
+    u8 c = s.data[i];
+    u64 digit = 0;
+    if ('0' <= c && c <= '9') {
+      digit = (u64)(c - '0');
+    } else if ('A' <= c && c <= 'Z') {
+      digit = (u64)(c - 'A' + 10);
+    } else if ('a' <= c && c <= 'z') {
+      digit = (u64)(c - 'a' + 36);
+    } else {
+      return res;
+    }
+
+    u64 carry = digit;
+    for (u64 j = 4; j > 0; j--) {
+      u64 cur = limbs[j - 1] * 62 + carry;
+      limbs[j - 1] = cur & UINT32_MAX;
+      carry = cur >> 32;
+    }
+    if (0 != carry) { // Overflow.
+      return res;
+    }
+  }
+
+  res.id.hi = (limbs[0] << 32) | limbs[1];
+  res.id.lo = (limbs[2] << 32) | limbs[3];
+  res.ok = true;
+  return res;
+}
+
+[[maybe_unused]] [[nodiscard]] static String id128_to_base62(Id128 id,
+                                                             Arena *arena) {
+  u64 limbs[4] = {id.hi >> 32, id.hi & UINT32_MAX, id.lo >> 32,
+                  id.lo & UINT32_MAX};
+
+  u8 *data = arena_new(arena, u8, ID128_BASE62_LEN);
+  for (u64 i = ID128_BASE62_LEN; i > 0; i--) {
+    u64 rem = 0;
+    for (u64 j = 0; j < 4; j++) {
+      u64 cur = (rem << 32) | limbs[j];
+      limbs[j] = cur / 62;
+      rem = cur % 62;
+    }
+    data[i - 1] = id128_base62_alphabet[rem];
+  }
+  return (String){.data = data, .len = ID128_BASE62_LEN};
+}
+
+// Accept both encodings.
+[[maybe_unused]] [[nodiscard]] static Id128ParseResult id128_parse(String s) {
+  if (ID128_BASE62_LEN == s.len) {
+    return id128_parse_base62(s);
+  }
+  return id128_parse_hex(s);
+}
+
 typedef enum {
   HTML_NONE,
   HTML_TITLE,
@@ -480,45 +1736,39 @@ typedef struct {
   return res;
 }
 
-static void html_attributes_to_string(DynKeyValue attributes, DynU8 *sb,
-                                      Arena *arena) {
+static void html_attributes_write(DynKeyValue attributes, BufWriter *w) {
   for (u64 i = 0; i < attributes.len; i++) {
     KeyValue attr = dyn_at(attributes, i);
     ASSERT(-1 == string_indexof_string(attr.key, S("\"")));
 
-    *dyn_push(sb, arena) = ' ';
-    dyn_append_slice(sb, attr.key, arena);
-    *dyn_push(sb, arena) = '=';
-    *dyn_push(sb, arena) = '"';
-    // TODO: escape string.
-    dyn_append_slice(sb, attr.value, arena);
-    *dyn_push(sb, arena) = '"';
+    buf_writer_write(w, S(" "));
+    buf_writer_write(w, attr.key);
+    buf_writer_write(w, S("=\""));
+    html_text_write(w, attr.value);
+    buf_writer_write(w, S("\""));
   }
 }
 
-static void html_tags_to_string(DynHtmlElements elements, DynU8 *sb,
-                                Arena *arena);
-static void html_tag_to_string(HtmlElement e, DynU8 *sb, Arena *arena);
+static void html_tags_write(DynHtmlElements elements, BufWriter *w);
+static void html_tag_write(HtmlElement e, BufWriter *w);
 
-static void html_tags_to_string(DynHtmlElements elements, DynU8 *sb,
-                                Arena *arena) {
+static void html_tags_write(DynHtmlElements elements, BufWriter *w) {
   for (u64 i = 0; i < elements.len; i++) {
     HtmlElement e = dyn_at(elements, i);
-    html_tag_to_string(e, sb, arena);
+    html_tag_write(e, w);
   }
 }
 
-[[maybe_unused]]
-static void html_document_to_string(HtmlDocument doc, DynU8 *sb, Arena *arena) {
-  dyn_append_slice(sb, S("<!DOCTYPE html>"), arena);
+static void html_document_write(HtmlDocument doc, BufWriter *w) {
+  buf_writer_write(w, S("<!DOCTYPE html>"));
 
-  dyn_append_slice(sb, S("<html>"), arena);
-  html_tag_to_string(doc.head, sb, arena);
-  html_tag_to_string(doc.body, sb, arena);
-  dyn_append_slice(sb, S("</html>"), arena);
+  buf_writer_write(w, S("<html>"));
+  html_tag_write(doc.head, w);
+  html_tag_write(doc.body, w);
+  buf_writer_write(w, S("</html>"));
 }
 
-static void html_tag_to_string(HtmlElement e, DynU8 *sb, Arena *arena) {
+static void html_tag_write(HtmlElement e, BufWriter *w) {
   static const String tag_to_string[HTML_MAX] = {
       [HTML_NONE] = S("FIXME"),
       [HTML_TITLE] = S("title"),
@@ -543,10 +1793,10 @@ static void html_tag_to_string(HtmlElement e, DynU8 *sb, Arena *arena) {
 
   ASSERT(!(HTML_NONE == e.kind || HTML_MAX == e.kind));
 
-  *dyn_push(sb, arena) = '<';
-  dyn_append_slice(sb, tag_to_string[e.kind], arena);
-  html_attributes_to_string(e.attributes, sb, arena);
-  *dyn_push(sb, arena) = '>';
+  buf_writer_write(w, S("<"));
+  buf_writer_write(w, tag_to_string[e.kind]);
+  html_attributes_write(e.attributes, w);
+  buf_writer_write(w, S(">"));
 
   switch (e.kind) {
   // Cases of tag without any children and no closing tag.
@@ -576,22 +1826,25 @@ static void html_tag_to_string(HtmlElement e, DynU8 *sb, Arena *arena) {
   case HTML_SPAN:
     [[fallthrough]];
   case HTML_BODY:
-    html_tags_to_string(e.children, sb, arena);
+    html_tags_write(e.children, w);
     break;
 
   // Only cases where `.text` is valid.
-  case HTML_BUTTON:
-    [[fallthrough]];
+  // Code, not escaped.
   case HTML_SCRIPT:
     [[fallthrough]];
   case HTML_STYLE:
+    buf_writer_write(w, e.text);
+    break;
+
+  case HTML_BUTTON:
     [[fallthrough]];
   case HTML_LEGEND:
     [[fallthrough]];
   case HTML_TITLE:
     [[fallthrough]];
   case HTML_TEXT:
-    dyn_append_slice(sb, e.text, arena);
+    html_text_write(w, e.text);
     break;
 
   // Invalid cases.
@@ -603,11 +1856,54 @@ static void html_tag_to_string(HtmlElement e, DynU8 *sb, Arena *arena) {
     ASSERT(0);
   }
 
-  dyn_append_slice(sb, S("</"), arena);
-  dyn_append_slice(sb, tag_to_string[e.kind], arena);
-  *dyn_push(sb, arena) = '>';
+  buf_writer_write(w, S("</"));
+  buf_writer_write(w, tag_to_string[e.kind]);
+  buf_writer_write(w, S(">"));
+}
+
+// The tree is rendered twice: once to measure it, and once into an allocation
+// of the exact size, instead of growing a buffer as it goes.
+[[maybe_unused]]
+static void html_document_to_string(HtmlDocument doc, DynU8 *sb, Arena *arena) {
+  BufWriter measure = buf_writer_make_measure();
+  html_document_write(doc, &measure);
+  ASSERT(measure.len > 0);
+
+  BufWriter w = buf_writer_make(-1, measure.len, arena);
+  html_document_write(doc, &w);
+  ASSERT(0 == w.err);
+  buf_writer_append_to(w, sb, arena);
+}
+
+[[maybe_unused]]
+static void html_tag_to_string(HtmlElement e, DynU8 *sb, Arena *arena) {
+  BufWriter measure = buf_writer_make_measure();
+  html_tag_write(e, &measure);
+  ASSERT(measure.len > 0);
+
+  BufWriter w = buf_writer_make(-1, measure.len, arena);
+  html_tag_write(e, &w);
+  ASSERT(0 == w.err);
+  buf_writer_append_to(w, sb, arena);
 }
 
+// Compile-time HTML templates: the fixed markup is made of string literals
+// concatenated by the compiler, so that rendering a page only appends a few
+// constant chunks plus the dynamic values, with `html_text_write`.
+// The output is the same as with `html_document_to_string`.
+#define HTML_ATTR(key, value) " " key "=\"" value "\""
+#define HTML_OPEN(tag, attrs) "<" tag attrs ">"
+#define HTML_CLOSE(tag) "</" tag ">"
+#define HTML_ELEMENT(tag, attrs, content)                                      \
+  HTML_OPEN(tag, attrs) content HTML_CLOSE(tag)
+// Like `html_make` followed by the opening of the body.
+#define HTML_DOCUMENT_START(title, head)                                       \
+  "<!DOCTYPE html><html>" HTML_ELEMENT(                                        \
+      "head", "",                                                              \
+      HTML_OPEN("meta", HTML_ATTR("charset", "utf-8"))                         \
+          HTML_ELEMENT("title", "", title) head) "<body>"
+#define HTML_DOCUMENT_END "</body></html>"
+
 [[maybe_unused]] [[nodiscard]] static String
 http_req_extract_cookie_with_name(HttpRequest req, String cookie_name,
                                   Arena *arena) {
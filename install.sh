@@ -4,7 +4,10 @@ set -ex
 
 CC="${CC:-clang}"
 
-SQLITE_OPTIONS="$(tr -s '\n' ' ' < sqlite_options.txt)"
+# E.g. `SQLITE_OPTIONS_FILE=sqlite_options_server.txt`. Lines starting with
+# `#` are comments.
+SQLITE_OPTIONS_FILE="${SQLITE_OPTIONS_FILE:-sqlite_options.txt}"
+SQLITE_OPTIONS="$(grep -v '^#' "$SQLITE_OPTIONS_FILE" | tr -s '\n' ' ')"
 
 # shellcheck disable=SC2086
 "$CC" sqlite3.c -c -O3 -march=native -g $SQLITE_OPTIONS
@@ -0,0 +1,945 @@
+#ifndef CHTTP_LOG_C
+#define CHTTP_LOG_C
+
+#include "submodules/cstd/lib.c"
+#include <sched.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+// Structured logging in logfmt, with the same call syntax as the logger of the
+// standard library, which it replaces from here on:
+// `log_at(LOG_LEVEL_INFO, "message", arena, L("key", value), ...)`.
+// The standard library's `log` macro is undefined, so that `log(3)` from
+// `<math.h>` can be used afterwards.
+//
+// Once `log_ring_start` is called, a line is formatted straight into a slot of
+// a ring buffer in memory shared by all the worker processes, and a background
+// process writes the lines to stdout in batches, with `writev(2)`: requests do
+// not wait on the log output. When the ring is full, the line is dropped and
+// counted, or the caller waits, depending on the policy.
+// Before that, lines are written synchronously.
+
+// Lines longer than that are truncated.
+#define LOG_LINE_MAX 1008
+
+// Lines below this level are compiled out, along with the evaluation of their
+// fields. build.sh sets it per build mode, with `-DLOG_LEVEL_MIN=...`.
+#ifndef LOG_LEVEL_MIN
+#define LOG_LEVEL_MIN LOG_LEVEL_DEBUG
+#endif
+
+typedef enum {
+  LOGFMT_VALUE_KIND_U64,
+  LOGFMT_VALUE_KIND_I64,
+  LOGFMT_VALUE_KIND_STRING,
+} LogfmtValueKind;
+
+typedef struct {
+  LogfmtValueKind kind;
+  union {
+    u64 n;
+    i64 i;
+    String s;
+  };
+} LogfmtValue;
+
+typedef struct {
+  String key;
+  LogfmtValue value;
+} LogfmtField;
+
+[[maybe_unused]] [[nodiscard]] static LogfmtValue logfmt_value_u64(u64 n) {
+  return (LogfmtValue){.kind = LOGFMT_VALUE_KIND_U64, .n = n};
+}
+
+[[maybe_unused]] [[nodiscard]] static LogfmtValue logfmt_value_i64(i64 i) {
+  return (LogfmtValue){.kind = LOGFMT_VALUE_KIND_I64, .i = i};
+}
+
+[[maybe_unused]] [[nodiscard]] static LogfmtValue
+logfmt_value_string(String s) {
+  return (LogfmtValue){.kind = LOGFMT_VALUE_KIND_STRING, .s = s};
+}
+
+[[maybe_unused]] [[nodiscard]] static LogfmtValue
+logfmt_value_cstr(const char *s) {
+  return logfmt_value_string(
+      (String){.data = (u8 *)(void *)(uintptr_t)s, .len = strlen(s)});
+}
+
+#define logfmt_value(v)                                                        \
+  _Generic((v),                                                                \
+      String: logfmt_value_string,                                             \
+      char *: logfmt_value_cstr,                                               \
+      const char *: logfmt_value_cstr,                                         \
+      bool: logfmt_value_u64,                                                  \
+      uint8_t: logfmt_value_u64,                                               \
+      uint16_t: logfmt_value_u64,                                              \
+      uint32_t: logfmt_value_u64,                                              \
+      uint64_t: logfmt_value_u64,                                              \
+      int8_t: logfmt_value_i64,                                                \
+      int16_t: logfmt_value_i64,                                               \
+      int32_t: logfmt_value_i64,                                               \
+      int64_t: logfmt_value_i64)(v)
+
+#ifdef L
+#undef L
+#endif
+#define L(k, v) ((LogfmtField){.key = S(k), .value = logfmt_value(v)})
+
+#ifdef log
+#undef log
+#endif
+#define log_at(level, msg, arena, ...)                                         \
+  do {                                                                         \
+    if ((level) >= LOG_LEVEL_MIN) {                                            \
+      (void)(arena);                                                           \
+      /* With a sentinel, to allow no fields at all. */                        \
+      const LogfmtField log_fields_[] = {                                      \
+          __VA_ARGS__ __VA_OPT__(, )(LogfmtField){0},                          \
+      };                                                                       \
+      log_write(level, S(msg), log_fields_,                                    \
+                static_array_len(log_fields_) - 1);                            \
+    }                                                                          \
+  } while (0)
+
+// High-volume events, e.g. one per request, are only logged for 1 in
+// `log_sample_rate` of them, and never with 0. The caller decides once per
+// unit of work, with `log_sampled`, so that its lines are kept or dropped
+// together.
+static u64 log_sample_rate = 1;
+
+[[maybe_unused]] [[nodiscard]] static bool log_sampled(u64 n) {
+  return 0 != log_sample_rate && 0 == n % log_sample_rate;
+}
+
+typedef struct {
+  u8 *data;
+  u64 len;
+} LogLine;
+
+static void log_line_append(LogLine *line, String s) {
+  const u64 n = LOG_LINE_MAX - line->len < s.len ? LOG_LINE_MAX - line->len
+                                                  : s.len;
+  if (n > 0) {
+    memcpy(line->data + line->len, s.data, n);
+    line->len += n;
+  }
+}
+
+static void log_line_append_u64(LogLine *line, u64 n) {
+  u8 digits[20] = {0};
+  u64 len = 0;
+  do {
+    digits[sizeof(digits) - 1 - len] = (u8)('0' + n % 10);
+    len += 1;
+    n /= 10;
+  } while (n);
+  log_line_append(
+      line, (String){.data = digits + sizeof(digits) - len, .len = len});
+}
+
+static void log_line_append_quoted(LogLine *line, String s) {
+  log_line_append(line, S("\""));
+  for (u64 i = 0; i < s.len; i++) {
+    const u8 c = s.data[i];
+    if ('"' == c) {
+      log_line_append(line, S("\\\""));
+    } else if ('\\' == c) {
+      log_line_append(line, S("\\\\"));
+    } else if ('\n' == c) {
+      log_line_append(line, S("\\n"));
+    } else {
+      log_line_append(line, (String){.data = &s.data[i], .len = 1});
+    }
+  }
+  log_line_append(line, S("\""));
+}
+
+[[nodiscard]] static String log_level_to_string(int level) {
+  if (LOG_LEVEL_DEBUG == level) {
+    return S("debug");
+  }
+  if (LOG_LEVEL_INFO == level) {
+    return S("info");
+  }
+  if (LOG_LEVEL_ERROR == level) {
+    return S("error");
+  }
+  return S("unknown");
+}
+
+[[nodiscard]] static u64 log_now_ns() {
+  struct timespec now = {0};
+  (void)clock_gettime(CLOCK_REALTIME, &now);
+  return (u64)now.tv_sec * 1'000'000'000 + (u64)now.tv_nsec;
+}
+
+// Format one line, always ending with a newline, in at most `LOG_LINE_MAX`
+// bytes.
+[[nodiscard]] static u64 log_line_format(u8 *data, int level, u64 timestamp_ns,
+                                         u64 pid, String msg,
+                                         const LogfmtField *fields,
+                                         u64 fields_len) {
+  LogLine line = {.data = data};
+  log_line_append(&line, S("level="));
+  log_line_append(&line, log_level_to_string(level));
+  log_line_append(&line, S(" timestamp_ns="));
+  log_line_append_u64(&line, timestamp_ns);
+  log_line_append(&line, S(" pid="));
+  log_line_append_u64(&line, pid);
+  log_line_append(&line, S(" message="));
+  log_line_append_quoted(&line, msg);
+
+  for (u64 i = 0; i < fields_len; i++) {
+    const LogfmtField field = fields[i];
+    log_line_append(&line, S(" "));
+    log_line_append(&line, field.key);
+    log_line_append(&line, S("="));
+
+    switch (field.value.kind) {
+    case LOGFMT_VALUE_KIND_U64:
+      log_line_append_u64(&line, field.value.n);
+      break;
+    case LOGFMT_VALUE_KIND_I64:
+      if (field.value.i < 0) {
+        log_line_append(&line, S("-"));
+      }
+      log_line_append_u64(&line, field.value.i < 0 ? -(u64)field.value.i
+                                                   : (u64)field.value.i);
+      break;
+    case LOGFMT_VALUE_KIND_STRING:
+      log_line_append_quoted(&line, field.value.s);
+      break;
+    default:
+      ASSERT(0);
+    }
+  }
+
+  if (line.len == LOG_LINE_MAX) { // Truncated.
+    line.len -= 1;
+  }
+  data[line.len] = '\n';
+  return line.len + 1;
+}
+
+// Binary format: records of `u32 len, u8 kind, payload`, in native byte order.
+// Lines only hold the ids of the message and of the keys, which are the
+// addresses of the string literals: they are the same in all the processes,
+// which are forked from the same one. The flusher writes the string of an id
+// (a dictionary record) before the first line using it, and a start record
+// before anything else, after which the ids are not valid anymore.
+// Formatting is left to a decoder (see `log_decode.c`).
+typedef enum {
+  LOG_FORMAT_LOGFMT,
+  LOG_FORMAT_BINARY,
+} LogFormat;
+
+typedef enum {
+  // Payload: `u8 version`.
+  LOG_RECORD_KIND_START = 1,
+  // Payload: `u64 id`, then the string up to the end of the record.
+  LOG_RECORD_KIND_DICT = 2,
+  // Payload: `u8 level, u64 timestamp_ns, u64 pid, u64 message_id,
+  // u8 fields_len`, then for each field: `u64 key_id, u8 kind`, then the
+  // value: `u64`, `i64`, or `u32 len` and the string.
+  LOG_RECORD_KIND_LINE = 3,
+} LogRecordKind;
+
+static const u8 LOG_BINARY_VERSION = 1;
+#define LOG_RECORD_HEADER_LEN (sizeof(u32) + sizeof(u8))
+
+typedef struct {
+  u8 *data;
+  u64 len;
+  u64 cap;
+} LogRecord;
+
+[[nodiscard]] static bool log_record_fits(LogRecord *record, u64 len) {
+  return record->cap - record->len >= len;
+}
+
+static void log_record_put(LogRecord *record, const void *data, u64 len) {
+  ASSERT(log_record_fits(record, len));
+  if (len > 0) {
+    memcpy(record->data + record->len, data, len);
+    record->len += len;
+  }
+}
+
+static void log_record_put_u8(LogRecord *record, u8 n) {
+  log_record_put(record, &n, sizeof(n));
+}
+
+static void log_record_put_u64(LogRecord *record, u64 n) {
+  log_record_put(record, &n, sizeof(n));
+}
+
+static void log_record_begin(LogRecord *record, LogRecordKind kind) {
+  ASSERT(0 == record->len);
+  const u32 len = 0; // Set by `log_record_end`.
+  log_record_put(record, &len, sizeof(len));
+  log_record_put_u8(record, (u8)kind);
+}
+
+[[nodiscard]] static u64 log_record_end(LogRecord *record) {
+  ASSERT(record->len <= UINT32_MAX);
+  const u32 len = (u32)record->len;
+  memcpy(record->data, &len, sizeof(len));
+  return record->len;
+}
+
+[[nodiscard]] static u64 log_string_id(String s) {
+  return (u64)(uintptr_t)s.data;
+}
+
+// Strings are truncated to fit in `cap`, and the fields which do not fit are
+// left out.
+[[nodiscard]] static u64 log_record_encode_line(u8 *data, u64 cap, int level,
+                                                u64 timestamp_ns, u64 pid,
+                                                String msg,
+                                                const LogfmtField *fields,
+                                                u64 fields_len) {
+  LogRecord record = {.data = data, .cap = cap};
+  log_record_begin(&record, LOG_RECORD_KIND_LINE);
+  log_record_put_u8(&record, (u8)level);
+  log_record_put_u64(&record, timestamp_ns);
+  log_record_put_u64(&record, pid);
+  log_record_put_u64(&record, log_string_id(msg));
+  const u64 fields_len_offset = record.len;
+  log_record_put_u8(&record, 0);
+
+  u8 written = 0;
+  for (u64 i = 0; i < fields_len && written < UINT8_MAX; i++) {
+    const LogfmtField field = fields[i];
+    const u64 fixed_len = sizeof(u64) + sizeof(u8) + sizeof(u64);
+    if (!log_record_fits(&record, fixed_len)) {
+      break;
+    }
+
+    log_record_put_u64(&record, log_string_id(field.key));
+    log_record_put_u8(&record, (u8)field.value.kind);
+    switch (field.value.kind) {
+    case LOGFMT_VALUE_KIND_U64:
+      log_record_put_u64(&record, field.value.n);
+      break;
+    case LOGFMT_VALUE_KIND_I64:
+      log_record_put(&record, &field.value.i, sizeof(field.value.i));
+      break;
+    case LOGFMT_VALUE_KIND_STRING: {
+      const u64 room = record.cap - record.len - sizeof(u32);
+      const u32 len =
+          (u32)(field.value.s.len < room ? field.value.s.len : room);
+      log_record_put(&record, &len, sizeof(len));
+      log_record_put(&record, field.value.s.data, len);
+    } break;
+    default:
+      ASSERT(0);
+    }
+    written += 1;
+  }
+  record.data[fields_len_offset] = written;
+
+  return log_record_end(&record);
+}
+
+typedef enum {
+  // Drop the line and count it.
+  LOG_FULL_POLICY_DROP,
+  // Wait for the flusher to make room.
+  LOG_FULL_POLICY_BLOCK,
+} LogFullPolicy;
+
+typedef struct {
+  // Position of the slot in the ring when it is free, plus one when it holds
+  // a line ready to be written.
+  _Atomic u64 seq;
+  u32 len;
+  // Process which claimed the slot, 0 when free. See `log_slot_abandoned`.
+  _Atomic pid_t pid;
+  u8 data[LOG_LINE_MAX];
+} LogSlot;
+static_assert(0 == sizeof(LogSlot) % 64);
+
+// Bounded multi-producer queue (Vyukov), with a single consumer: the flusher.
+typedef struct {
+  alignas(64) _Atomic u64 head;
+  alignas(64) _Atomic u64 tail;
+  alignas(64) _Atomic u64 dropped;
+  LogFullPolicy policy;
+  LogFormat format;
+  // Power of two.
+  u64 slots_len;
+  LogSlot *slots;
+} LogRing;
+
+// Shared with the worker processes, which are forked afterwards.
+static LogRing *log_ring = nullptr;
+
+[[nodiscard]] static Error log_writev_all(struct iovec *iov, u64 iov_len) {
+  while (iov_len > 0) {
+    ssize_t n = writev(1, iov, (int)iov_len);
+    if (-1 == n) {
+      if (EINTR == errno) {
+        continue;
+      }
+      return (Error)errno;
+    }
+
+    u64 written = (u64)n;
+    while (iov_len > 0 && written >= iov->iov_len) {
+      written -= iov->iov_len;
+      iov += 1;
+      iov_len -= 1;
+    }
+    if (iov_len > 0) {
+      iov->iov_base = (u8 *)iov->iov_base + written;
+      iov->iov_len -= written;
+    }
+  }
+  return 0;
+}
+
+static void log_write(int level, String msg, const LogfmtField *fields,
+                      u64 fields_len) {
+  if (nullptr == log_ring) {
+    u8 data[LOG_LINE_MAX] = {0};
+    const u64 len = log_line_format(data, level, log_now_ns(), (u64)getpid(),
+                                    msg, fields, fields_len);
+    struct iovec iov = {.iov_base = data, .iov_len = len};
+    (void)log_writev_all(&iov, 1);
+    return;
+  }
+
+  const pid_t pid = getpid();
+  u64 pos = atomic_load_explicit(&log_ring->head, memory_order_relaxed);
+  LogSlot *slot = nullptr;
+  for (;;) {
+    slot = &log_ring->slots[pos & (log_ring->slots_len - 1)];
+    const u64 seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+
+    if (seq == pos) { // Free: try to claim it.
+      if (atomic_compare_exchange_weak_explicit(&log_ring->head, &pos,
+                                                pos + 1, memory_order_relaxed,
+                                                memory_order_relaxed)) {
+        break;
+      }
+    } else if (seq < pos) { // Full.
+      if (LOG_FULL_POLICY_DROP == log_ring->policy) {
+        atomic_fetch_add_explicit(&log_ring->dropped, 1, memory_order_relaxed);
+        return;
+      }
+      sched_yield();
+      pos = atomic_load_explicit(&log_ring->head, memory_order_relaxed);
+    } else { // Claimed by another producer meanwhile.
+      pos = atomic_load_explicit(&log_ring->head, memory_order_relaxed);
+    }
+  }
+
+  atomic_store_explicit(&slot->pid, pid, memory_order_relaxed);
+
+  slot->len = (u32)(LOG_FORMAT_BINARY == log_ring->format
+                        ? log_record_encode_line(
+                              slot->data, sizeof(slot->data), level,
+                              log_now_ns(), (u64)pid, msg, fields, fields_len)
+                        : log_line_format(slot->data, level, log_now_ns(),
+                                          (u64)pid, msg, fields, fields_len));
+
+  // Fails if the flusher gave up on this slot, see `log_slot_abandoned`: the
+  // line is lost.
+  u64 expected = pos;
+  (void)atomic_compare_exchange_strong_explicit(&slot->seq, &expected, pos + 1,
+                                                memory_order_release,
+                                                memory_order_relaxed);
+}
+
+// Ids of the strings of a binary line: the message, then the keys.
+[[nodiscard]] static u64 log_record_line_ids(const u8 *data, u64 ids[256]) {
+  u64 offset = LOG_RECORD_HEADER_LEN + sizeof(u8) + sizeof(u64) * 2;
+  memcpy(&ids[0], data + offset, sizeof(u64));
+  offset += sizeof(u64);
+  const u8 fields_len = data[offset];
+  offset += sizeof(u8);
+
+  for (u64 i = 0; i < fields_len; i++) {
+    memcpy(&ids[1 + i], data + offset, sizeof(u64));
+    offset += sizeof(u64);
+    const u8 kind = data[offset];
+    offset += sizeof(u8);
+
+    if (LOGFMT_VALUE_KIND_STRING == kind) {
+      u32 len = 0;
+      memcpy(&len, data + offset, sizeof(len));
+      offset += sizeof(len) + len;
+    } else {
+      offset += sizeof(u64);
+    }
+  }
+  return 1 + fields_len;
+}
+
+#define LOG_FLUSH_IOV_LEN 256
+#define LOG_FLUSH_DICT_LEN (16 * KiB)
+// Power of two.
+#define LOG_FLUSH_SEEN_IDS_LEN 4096
+
+// State of the flusher process, to write records in batches.
+typedef struct {
+  LogFormat format;
+  struct iovec iov[LOG_FLUSH_IOV_LEN];
+  u64 iov_len;
+  // Dictionary records of the batch.
+  u8 dict[LOG_FLUSH_DICT_LEN];
+  u64 dict_len;
+  // Ids whose string was written, in an open-addressing table.
+  u64 seen_ids[LOG_FLUSH_SEEN_IDS_LEN];
+  u64 seen_ids_len;
+  u8 report_line[LOG_LINE_MAX];
+  // Position of the claimed slot that the flusher waits on, and since when.
+  u64 stuck_pos;
+  u64 stuck_since_ns;
+  // Slots skipped because their producer died before publishing the line.
+  u64 lost;
+} LogFlusher;
+
+[[nodiscard]] static bool log_flusher_id_seen(LogFlusher *flusher, u64 id) {
+  u64 idx = (id * 0x9E37'79B9'7F4A'7C15) & (LOG_FLUSH_SEEN_IDS_LEN - 1);
+  for (u64 i = 0; i < LOG_FLUSH_SEEN_IDS_LEN; i++) {
+    const u64 slot =
+        flusher->seen_ids[(idx + i) & (LOG_FLUSH_SEEN_IDS_LEN - 1)];
+    if (id == slot) {
+      return true;
+    }
+    if (0 == slot) {
+      return false;
+    }
+  }
+  return false;
+}
+
+static void log_flusher_id_add(LogFlusher *flusher, u64 id) {
+  // Keep it sparse. When full, strings are written again, which is harmless.
+  if (flusher->seen_ids_len >= LOG_FLUSH_SEEN_IDS_LEN / 2) {
+    return;
+  }
+
+  u64 idx = (id * 0x9E37'79B9'7F4A'7C15) & (LOG_FLUSH_SEEN_IDS_LEN - 1);
+  while (0 != flusher->seen_ids[idx]) {
+    idx = (idx + 1) & (LOG_FLUSH_SEEN_IDS_LEN - 1);
+  }
+  flusher->seen_ids[idx] = id;
+  flusher->seen_ids_len += 1;
+}
+
+// Add a record to the batch, preceded by the strings it uses for the first
+// time, in binary format. Returns `false` when the batch is full: the batch
+// must then be written first.
+[[nodiscard]] static bool log_flusher_add(LogFlusher *flusher, u8 *data,
+                                          u64 len) {
+  if (LOG_FORMAT_BINARY == flusher->format) {
+    u64 ids[256] = {0};
+    const u64 ids_len = log_record_line_ids(data, ids);
+
+    for (u64 i = 0; i < ids_len; i++) {
+      if (log_flusher_id_seen(flusher, ids[i])) {
+        continue;
+      }
+
+      // The id is the address of a string literal, in this process too.
+      const char *s = (const char *)(uintptr_t)ids[i];
+      const u64 s_len = strlen(s);
+      LogRecord record = {
+          .data = flusher->dict + flusher->dict_len,
+          .cap = LOG_FLUSH_DICT_LEN - flusher->dict_len,
+      };
+      if (flusher->iov_len + 2 > LOG_FLUSH_IOV_LEN ||
+          !log_record_fits(&record,
+                           LOG_RECORD_HEADER_LEN + sizeof(u64) + s_len)) {
+        return false;
+      }
+      log_record_begin(&record, LOG_RECORD_KIND_DICT);
+      log_record_put_u64(&record, ids[i]);
+      log_record_put(&record, s, s_len);
+      const u64 record_len = log_record_end(&record);
+
+      flusher->iov[flusher->iov_len++] = (struct iovec){
+          .iov_base = record.data,
+          .iov_len = record_len,
+      };
+      flusher->dict_len += record_len;
+      log_flusher_id_add(flusher, ids[i]);
+    }
+  }
+
+  if (flusher->iov_len + 1 > LOG_FLUSH_IOV_LEN) {
+    return false;
+  }
+  flusher->iov[flusher->iov_len++] =
+      (struct iovec){.iov_base = data, .iov_len = len};
+  return true;
+}
+
+static void log_flusher_write(LogFlusher *flusher) {
+  // Nowhere to report an error.
+  (void)log_writev_all(flusher->iov, flusher->iov_len);
+  flusher->iov_len = 0;
+  flusher->dict_len = 0;
+}
+
+// How long the flusher waits on a claimed slot before checking whether its
+// producer is still alive.
+static const u64 LOG_SLOT_STALE_NS = 1'000'000'000;
+
+// A worker process which dies between claiming a slot and publishing its line
+// would stall the ring forever: the flusher writes lines in order, so the
+// ring fills up behind that slot. Such a slot is skipped once its producer is
+// gone.
+[[nodiscard]] static bool log_slot_abandoned(LogRing *ring, LogFlusher *flusher,
+                                             u64 pos) {
+  if (pos >= atomic_load_explicit(&ring->head, memory_order_relaxed)) {
+    return false; // Not claimed: the ring is only empty.
+  }
+
+  const u64 now_ns = log_now_ns();
+  if (flusher->stuck_pos != pos) {
+    flusher->stuck_pos = pos;
+    flusher->stuck_since_ns = now_ns;
+    return false;
+  }
+  if (now_ns - flusher->stuck_since_ns < LOG_SLOT_STALE_NS) {
+    return false;
+  }
+
+  // Without a pid, the producer may only be preempted between claiming the
+  // slot and storing its pid: skipping the slot would let the next lap of the
+  // ring write into it while the producer does. A producer dying in that
+  // window stalls the ring, a torn line would be worse.
+  LogSlot *slot = &ring->slots[pos & (ring->slots_len - 1)];
+  const pid_t pid = atomic_load_explicit(&slot->pid, memory_order_relaxed);
+  return 0 != pid && -1 == kill(pid, 0) && ESRCH == errno;
+}
+
+// Write the lines ready in the ring, in order. Returns how many slots were
+// consumed.
+static u64 log_ring_flush(LogRing *ring, LogFlusher *flusher) {
+  const u64 tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+
+  u64 count = 0;
+  for (;; count++) {
+    LogSlot *slot = &ring->slots[(tail + count) & (ring->slots_len - 1)];
+    if (tail + count + 1 !=
+        atomic_load_explicit(&slot->seq, memory_order_acquire)) {
+      break;
+    }
+    if (!log_flusher_add(flusher, slot->data, slot->len)) {
+      break;
+    }
+  }
+
+  if (0 == count) {
+    if (!log_slot_abandoned(ring, flusher, tail)) {
+      return 0;
+    }
+
+    // Make the slot available again without writing it. The producer, if it
+    // comes back after all, fails to publish.
+    LogSlot *slot = &ring->slots[tail & (ring->slots_len - 1)];
+    atomic_store_explicit(&slot->pid, 0, memory_order_relaxed);
+    u64 expected = tail;
+    if (!atomic_compare_exchange_strong_explicit(
+            &slot->seq, &expected, tail + ring->slots_len,
+            memory_order_release, memory_order_relaxed)) {
+      return 0; // Published meanwhile.
+    }
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_relaxed);
+    flusher->lost += 1;
+    return 1;
+  }
+
+  log_flusher_write(flusher);
+
+  // Make the slots available to the producers again.
+  for (u64 i = 0; i < count; i++) {
+    LogSlot *slot = &ring->slots[(tail + i) & (ring->slots_len - 1)];
+    atomic_store_explicit(&slot->pid, 0, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, tail + i + ring->slots_len,
+                          memory_order_release);
+  }
+  atomic_store_explicit(&ring->tail, tail + count, memory_order_relaxed);
+
+  return count;
+}
+
+// Write a line about lines which did not make it to the output.
+static void log_flusher_report(LogFlusher *flusher, String msg, u64 count) {
+  const LogfmtField field = L("count", count);
+  u8 *data = flusher->report_line;
+  const u64 len =
+      LOG_FORMAT_BINARY == flusher->format
+          ? log_record_encode_line(data, LOG_LINE_MAX, LOG_LEVEL_ERROR,
+                                   log_now_ns(), (u64)getpid(), msg, &field, 1)
+          : log_line_format(data, LOG_LEVEL_ERROR, log_now_ns(), (u64)getpid(),
+                            msg, &field, 1);
+  const bool added = log_flusher_add(flusher, data, len);
+  ASSERT(added); // The batch is empty.
+  log_flusher_write(flusher);
+}
+
+[[noreturn]] static void log_flusher_run(LogRing *ring, pid_t parent) {
+  // Too big for the stack.
+  LogFlusher *flusher =
+      mmap(nullptr, sizeof(LogFlusher), PROT_READ | PROT_WRITE,
+           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == flusher) {
+    _exit(1);
+  }
+  flusher->format = ring->format;
+  flusher->stuck_pos = UINT64_MAX;
+
+  if (LOG_FORMAT_BINARY == flusher->format) {
+    u8 data[LOG_RECORD_HEADER_LEN + sizeof(u8)] = {0};
+    LogRecord record = {.data = data, .cap = sizeof(data)};
+    log_record_begin(&record, LOG_RECORD_KIND_START);
+    log_record_put_u8(&record, LOG_BINARY_VERSION);
+    struct iovec iov = {.iov_base = data, .iov_len = log_record_end(&record)};
+    (void)log_writev_all(&iov, 1);
+  }
+
+  u64 dropped_reported = 0;
+  u64 lost_reported = 0;
+  for (;;) {
+    const u64 dropped =
+        atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+    if (dropped != dropped_reported) {
+      log_flusher_report(flusher, S("log lines dropped"),
+                         dropped - dropped_reported);
+      dropped_reported = dropped;
+    }
+    if (flusher->lost != lost_reported) {
+      log_flusher_report(flusher, S("log lines lost"),
+                         flusher->lost - lost_reported);
+      lost_reported = flusher->lost;
+    }
+
+    if (0 == log_ring_flush(ring, flusher)) {
+      // The server stopped: write what is left and stop.
+      if (getppid() != parent) {
+        while (log_ring_flush(ring, flusher) > 0) {
+        }
+        _exit(0);
+      }
+
+      // Idle.
+      const struct timespec idle = {.tv_nsec = 1'000'000};
+      (void)nanosleep(&idle, nullptr);
+    }
+  }
+}
+
+typedef struct {
+  u64 id;
+  String s;
+} LogDictEntry;
+
+typedef struct {
+  LogDictEntry *data;
+  u64 len, cap;
+} DynLogDictEntry;
+
+typedef struct {
+  u8 level;
+  u64 timestamp_ns;
+  u64 pid;
+  String msg;
+  LogfmtField *fields;
+  u64 fields_len;
+} LogDecodedLine;
+
+typedef struct {
+  LogRecordKind kind;
+  // Only for `LOG_RECORD_KIND_LINE`.
+  LogDecodedLine line;
+  String remaining;
+  Error err;
+} LogRecordDecodeResult;
+
+[[nodiscard]] static bool log_take(String *in, void *out, u64 len) {
+  if (in->len < len) {
+    return false;
+  }
+  if (len > 0) {
+    memcpy(out, in->data, len);
+  }
+  in->data += len;
+  in->len -= len;
+  return true;
+}
+
+// Strings of unknown ids, e.g. when the start of the log is missing, are
+// replaced by `?`.
+[[nodiscard]] static String log_dict_find(DynLogDictEntry dict, u64 id) {
+  for (u64 i = 0; i < dict.len; i++) {
+    if (id == dyn_at(dict, i).id) {
+      return dyn_at(dict, i).s;
+    }
+  }
+  return S("?");
+}
+
+// Decode one binary record. Strings point inside the input.
+// The dictionary grows in `dict_arena`, and the fields of a line are allocated
+// in `arena`, so that they can be freed once the line is written.
+[[maybe_unused]] [[nodiscard]] static LogRecordDecodeResult
+log_record_decode(String in, DynLogDictEntry *dict, Arena *dict_arena,
+                  Arena *arena) {
+  LogRecordDecodeResult res = {0};
+
+  u32 len = 0;
+  u8 kind = 0;
+  if (!log_take(&in, &len, sizeof(len)) || len < LOG_RECORD_HEADER_LEN ||
+      len - sizeof(len) > in.len || !log_take(&in, &kind, sizeof(kind))) {
+    res.err = EINVAL;
+    return res;
+  }
+  String payload = {.data = in.data, .len = len - LOG_RECORD_HEADER_LEN};
+  res.remaining = (String){.data = in.data + payload.len,
+                           .len = in.len - payload.len};
+  res.kind = (LogRecordKind)kind;
+
+  switch (kind) {
+  case LOG_RECORD_KIND_START: {
+    u8 version = 0;
+    if (!log_take(&payload, &version, sizeof(version)) ||
+        LOG_BINARY_VERSION != version) {
+      res.err = EINVAL;
+      return res;
+    }
+    // A new process: the ids are not valid anymore.
+    dict->len = 0;
+  } break;
+
+  case LOG_RECORD_KIND_DICT: {
+    LogDictEntry entry = {0};
+    if (!log_take(&payload, &entry.id, sizeof(entry.id))) {
+      res.err = EINVAL;
+      return res;
+    }
+    entry.s = payload;
+    *dyn_push(dict, dict_arena) = entry;
+  } break;
+
+  case LOG_RECORD_KIND_LINE: {
+    LogDecodedLine *line = &res.line;
+    u64 msg_id = 0;
+    u8 fields_len = 0;
+    if (!log_take(&payload, &line->level, sizeof(line->level)) ||
+        !log_take(&payload, &line->timestamp_ns, sizeof(line->timestamp_ns)) ||
+        !log_take(&payload, &line->pid, sizeof(line->pid)) ||
+        !log_take(&payload, &msg_id, sizeof(msg_id)) ||
+        !log_take(&payload, &fields_len, sizeof(fields_len))) {
+      res.err = EINVAL;
+      return res;
+    }
+    line->msg = log_dict_find(*dict, msg_id);
+    line->fields = arena_new(arena, LogfmtField, fields_len);
+    line->fields_len = fields_len;
+
+    for (u64 i = 0; i < fields_len; i++) {
+      LogfmtField *field = &line->fields[i];
+      u64 key_id = 0;
+      u8 value_kind = 0;
+      if (!log_take(&payload, &key_id, sizeof(key_id)) ||
+          !log_take(&payload, &value_kind, sizeof(value_kind))) {
+        res.err = EINVAL;
+        return res;
+      }
+      field->key = log_dict_find(*dict, key_id);
+      field->value.kind = (LogfmtValueKind)value_kind;
+
+      bool ok = false;
+      switch (value_kind) {
+      case LOGFMT_VALUE_KIND_U64:
+        ok = log_take(&payload, &field->value.n, sizeof(field->value.n));
+        break;
+      case LOGFMT_VALUE_KIND_I64:
+        ok = log_take(&payload, &field->value.i, sizeof(field->value.i));
+        break;
+      case LOGFMT_VALUE_KIND_STRING: {
+        u32 s_len = 0;
+        ok = log_take(&payload, &s_len, sizeof(s_len)) && s_len <= payload.len;
+        if (ok) {
+          field->value.s = (String){.data = payload.data, .len = s_len};
+          payload.data += s_len;
+          payload.len -= s_len;
+        }
+      } break;
+      default:
+        break;
+      }
+      if (!ok) {
+        res.err = EINVAL;
+        return res;
+      }
+    }
+  } break;
+
+  default:
+    res.err = EINVAL;
+    return res;
+  }
+
+  return res;
+}
+
+// Returns `nullptr` on failure.
+[[nodiscard]] static LogRing *log_ring_make(u64 slots_len, LogFullPolicy policy,
+                                            LogFormat format) {
+  ASSERT(slots_len > 0);
+  ASSERT(0 == (slots_len & (slots_len - 1)));
+
+  u8 *mem = mmap(nullptr, sizeof(LogRing) + slots_len * sizeof(LogSlot),
+                 PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if (MAP_FAILED == mem) {
+    return nullptr;
+  }
+
+  LogRing *ring = (LogRing *)(void *)mem;
+  ring->policy = policy;
+  ring->format = format;
+  ring->slots_len = slots_len;
+  ring->slots = (LogSlot *)(void *)(mem + sizeof(LogRing));
+  for (u64 i = 0; i < slots_len; i++) {
+    atomic_init(&ring->slots[i].seq, i);
+  }
+  return ring;
+}
+
+// Must be called before forking the workers.
+[[maybe_unused]] [[nodiscard]] static Error
+log_ring_start(u64 slots_len, LogFullPolicy policy, LogFormat format) {
+  ASSERT(nullptr == log_ring);
+
+  LogRing *ring = log_ring_make(slots_len, policy, format);
+  if (nullptr == ring) {
+    return (Error)errno;
+  }
+
+  const pid_t parent = getpid();
+  const pid_t pid = fork();
+  if (-1 == pid) {
+    return (Error)errno;
+  }
+  if (0 == pid) {
+    log_flusher_run(ring, parent);
+  }
+
+  log_ring = ring;
+  return 0;
+}
+
+#endif
@@ -0,0 +1,137 @@
+#include "log.c"
+#include <fcntl.h>
+#include <sys/stat.h>
+
+// Convert binary logs (`LOG_FORMAT=binary`) to logfmt, or to JSON lines with
+// `--json`, on stdout.
+// Usage: `./log_decode.bin [--json] http.log`.
+
+static void json_append_string(DynU8 *sb, String s, Arena *arena) {
+  static const u8 hex[] = "0123456789abcdef";
+
+  *dyn_push(sb, arena) = '"';
+  for (u64 i = 0; i < s.len; i++) {
+    const u8 c = s.data[i];
+    if ('"' == c || '\\' == c) {
+      *dyn_push(sb, arena) = '\\';
+      *dyn_push(sb, arena) = c;
+    } else if (c < 0x20) {
+      dyn_append_slice(sb, S("\\u00"), arena);
+      *dyn_push(sb, arena) = hex[c >> 4];
+      *dyn_push(sb, arena) = hex[c & 0xf];
+    } else {
+      *dyn_push(sb, arena) = c;
+    }
+  }
+  *dyn_push(sb, arena) = '"';
+}
+
+static void json_append_line(DynU8 *sb, LogDecodedLine line, Arena *arena) {
+  dyn_append_slice(sb, S("{\"level\":"), arena);
+  json_append_string(sb, log_level_to_string(line.level), arena);
+  dyn_append_slice(sb, S(",\"timestamp_ns\":"), arena);
+  dynu8_append_u64_to_string(sb, line.timestamp_ns, arena);
+  dyn_append_slice(sb, S(",\"pid\":"), arena);
+  dynu8_append_u64_to_string(sb, line.pid, arena);
+  dyn_append_slice(sb, S(",\"message\":"), arena);
+  json_append_string(sb, line.msg, arena);
+
+  for (u64 i = 0; i < line.fields_len; i++) {
+    const LogfmtField field = line.fields[i];
+    *dyn_push(sb, arena) = ',';
+    json_append_string(sb, field.key, arena);
+    *dyn_push(sb, arena) = ':';
+
+    switch (field.value.kind) {
+    case LOGFMT_VALUE_KIND_U64:
+      dynu8_append_u64_to_string(sb, field.value.n, arena);
+      break;
+    case LOGFMT_VALUE_KIND_I64:
+      if (field.value.i < 0) {
+        *dyn_push(sb, arena) = '-';
+      }
+      dynu8_append_u64_to_string(sb,
+                                 field.value.i < 0 ? -(u64)field.value.i
+                                                   : (u64)field.value.i,
+                                 arena);
+      break;
+    case LOGFMT_VALUE_KIND_STRING:
+      json_append_string(sb, field.value.s, arena);
+      break;
+    default:
+      ASSERT(0);
+    }
+  }
+  dyn_append_slice(sb, S("}\n"), arena);
+}
+
+int main(int argc, char *argv[]) {
+  bool json = false;
+  const char *path = nullptr;
+  for (int i = 1; i < argc; i++) {
+    if (0 == strcmp(argv[i], "--json")) {
+      json = true;
+    } else {
+      path = argv[i];
+    }
+  }
+  if (nullptr == path) {
+    log_at(LOG_LEVEL_ERROR, "missing log file", &(Arena){0});
+    return EINVAL;
+  }
+
+  const int fd = open(path, O_RDONLY);
+  struct stat st = {0};
+  if (-1 == fd || -1 == fstat(fd, &st)) {
+    log_at(LOG_LEVEL_ERROR, "failed to open log file", &(Arena){0},
+           L("error", errno));
+    return errno;
+  }
+  if (0 == st.st_size) {
+    return 0;
+  }
+
+  u8 *data = mmap(nullptr, (u64)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (MAP_FAILED == data) {
+    log_at(LOG_LEVEL_ERROR, "failed to map log file", &(Arena){0},
+           L("error", errno));
+    return errno;
+  }
+
+  Arena dict_arena = arena_make_from_virtual_mem(64 * 1024 * KiB);
+  Arena arena = arena_make_from_virtual_mem(64 * 1024 * KiB);
+  DynLogDictEntry dict = {0};
+  Writer writer = {.fd = 1};
+  String in = {.data = data, .len = (u64)st.st_size};
+
+  while (!slice_is_empty(in)) {
+    // Only what is needed for this record.
+    Arena tmp_arena = arena;
+    const LogRecordDecodeResult res =
+        log_record_decode(in, &dict, &dict_arena, &tmp_arena);
+    if (res.err) {
+      log_at(LOG_LEVEL_ERROR, "invalid log record", &arena, L("error", res.err),
+             L("offset", (u64)(in.data - data)));
+      return res.err;
+    }
+    in = res.remaining;
+
+    if (LOG_RECORD_KIND_LINE != res.kind) {
+      continue;
+    }
+
+    if (json) {
+      DynU8 sb = {0};
+      json_append_line(&sb, res.line, &tmp_arena);
+      (void)writer_write_all_sync(&writer, dyn_slice(String, sb));
+    } else {
+      u8 line[LOG_LINE_MAX] = {0};
+      const u64 len = log_line_format(line, res.line.level,
+                                      res.line.timestamp_ns, res.line.pid,
+                                      res.line.msg, res.line.fields,
+                                      res.line.fields_len);
+      (void)writer_write_all_sync(&writer,
+                                  (String){.data = line, .len = len});
+    }
+  }
+}
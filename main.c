@@ -1,35 +1,73 @@
-#include "./sqlite3.h"
-#include "http.c"
-
-static sqlite3 *db = nullptr;
-static sqlite3_stmt *db_insert_poll_stmt = nullptr;
-static sqlite3_stmt *db_select_poll_stmt = nullptr;
-static sqlite3_stmt *db_insert_vote_stmt = nullptr;
+#include "db.c"
 
 static const String user_id_cookie_name = S("__Secure-user_id");
 
+// Log lines waiting to be written, 1 KiB each.
+static const u64 LOG_RING_SLOTS_LEN = 4096;
+
+// Rendered `GET /poll/<poll_id>` pages, shared by all worker processes.
+// A page only depends on the user in one place, whether they created the poll,
+// so only the part before that hole is stored, and a hit is served as a
+// vectored write of the segments without rendering anything.
+// Entries are never invalidated: polls do not change once created, and votes
+// are not shown on the page.
+static ShmCache poll_page_cache = {0};
+static const u64 POLL_PAGE_CACHE_SLOTS_LEN = 1024;
+// Pages bigger than that are not cached, and are streamed to the socket.
+static const u64 POLL_PAGE_PREFIX_MAX_LEN = 4 * KiB;
+// The prefix, plus the id of the creator of the poll.
+static const u64 POLL_PAGE_CACHE_VALUE_CAP = 4 * KiB + 128;
+static const u64 POLL_PAGE_STREAM_BUFFER_LEN = 2 * KiB;
+
 typedef enum {
-  DB_ERR_NONE,
-  DB_ERR_NOT_FOUND,
-  DB_ERR_INVALID_USE,
-  DB_ERR_INVALID_DATA,
-} DatabaseError;
-
-typedef enum : u8 {
-  POLL_STATE_OPEN,
-  POLL_STATE_CLOSED,
-  POLL_STATE_MAX, // Pseudo-value.
-} PollState;
+  ROUTE_HOME,
+  ROUTE_STATIC_FILE,
+  ROUTE_CREATE_POLL,
+  ROUTE_GET_POLL,
+  ROUTE_CAST_VOTE,
+  ROUTE_METRICS,
+  ROUTE_NOT_FOUND,
+  ROUTE_MAX, // Pseudo-value.
+} Route;
+
+static const String route_to_s[ROUTE_MAX] = {
+    [ROUTE_HOME] = S("home"),
+    [ROUTE_STATIC_FILE] = S("static_file"),
+    [ROUTE_CREATE_POLL] = S("create_poll"),
+    [ROUTE_GET_POLL] = S("get_poll"),
+    [ROUTE_CAST_VOTE] = S("cast_vote"),
+    [ROUTE_METRICS] = S("metrics"),
+    [ROUTE_NOT_FOUND] = S("not_found"),
+};
+
+// Memory ceiling of the request for the rest of its handling, once routed.
+// Most requests stay well under `HTTP_SERVER_HANDLER_MEM_LEN`: these only
+// bound the rare big ones.
+static const u64 route_mem_max[ROUTE_MAX] = {
+    [ROUTE_HOME] = 16 * KiB,
+    [ROUTE_STATIC_FILE] = 16 * KiB,
+    [ROUTE_CREATE_POLL] = 512 * KiB,
+    [ROUTE_GET_POLL] = 512 * KiB,
+    [ROUTE_CAST_VOTE] = 256 * KiB,
+    [ROUTE_METRICS] = 64 * KiB,
+    [ROUTE_NOT_FOUND] = 16 * KiB,
+};
+
+// Shared by all worker processes, indexed by `Route`.
+static HttpArenaStats *route_arena_stats = nullptr;
+static HttpRequestStats *route_request_stats = nullptr;
+
+static void route_enter(Route route, HttpExchange *exchange, Arena *arena) {
+  exchange->arena_stats = &route_arena_stats[route];
+  exchange->request_stats = &route_request_stats[route];
+  http_arena_limit(arena, AT(route_mem_max, ROUTE_MAX, route));
+}
 
-typedef struct {
-  i64 db_id;
-  String human_readable_id;
-  PollState state;
-  String name;
-  StringSlice options;
-  String created_at;
-  String created_by;
-} Poll;
+// Common `<head>` content of all pages.
+#define PAGE_HEAD                                                              \
+  HTML_OPEN("link", HTML_ATTR("rel", "stylesheet") HTML_ATTR("href",           \
+                                                               "/main.css"))   \
+  HTML_ELEMENT("script", HTML_ATTR("src", "/main.js"), "")
 
 [[nodiscard]] static HttpResponse
 http_response_add_user_id_cookie(HttpResponse resp, String user_id,
@@ -50,72 +88,6 @@ http_response_add_user_id_cookie(HttpResponse resp, String user_id,
   return res;
 }
 
-[[nodiscard]] static DatabaseError db_create_poll(String req_id, Poll poll,
-                                                  Arena *arena) {
-  ASSERT(!slice_is_empty(poll.created_by));
-
-  int db_err = 0;
-  if (SQLITE_OK != (db_err = sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr,
-                                          nullptr, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to begin transaction", arena,
-        L("req.id", req_id), L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  if (SQLITE_OK !=
-      (db_err = sqlite3_bind_text(db_insert_poll_stmt, 1,
-                                  (const char *)poll.human_readable_id.data,
-                                  (int)poll.human_readable_id.len, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to bind parameter 1", arena,
-        L("req.id", req_id), L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  if (SQLITE_OK != (db_err = sqlite3_bind_text(db_insert_poll_stmt, 2,
-                                               (const char *)poll.name.data,
-                                               (int)poll.name.len, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to bind parameter 2", arena,
-        L("req.id", req_id), L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  String poll_options_encoded = json_encode_string_slice(poll.options, arena);
-
-  if (SQLITE_OK !=
-      (db_err = sqlite3_bind_text(db_insert_poll_stmt, 3,
-                                  (const char *)poll_options_encoded.data,
-                                  (int)poll_options_encoded.len, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to bind parameter 3", arena,
-        L("req.id", req_id), L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  if (SQLITE_OK !=
-      (db_err = sqlite3_bind_text(db_insert_poll_stmt, 4,
-                                  (const char *)poll.created_by.data,
-                                  (int)poll.created_by.len, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to bind parameter 4", arena,
-        L("req.id", req_id), L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  if (SQLITE_DONE != (db_err = sqlite3_step(db_insert_poll_stmt))) {
-    log(LOG_LEVEL_ERROR,
-        "failed to execute the prepared statement to insert a poll", arena,
-        L("req.id", req_id), L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  if (SQLITE_OK !=
-      (db_err = sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to commit creating a poll", arena,
-        L("req.id", req_id), L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  return DB_ERR_NONE;
-}
-
 [[nodiscard]] static HttpResponse http_respond_with_not_found() {
   HttpResponse res = {0};
   res.status = 404;
@@ -163,15 +135,14 @@ http_respond_with_unprocessable_entity(String req_id, Arena *arena) {
                                                      Arena *arena) {
   HttpResponse res = {0};
 
-  Poll poll = {.state = POLL_STATE_OPEN,
-               .human_readable_id = make_unique_id_u128_string(arena)};
+  Poll poll = {.state = POLL_STATE_OPEN, .id = id128_random()};
 
   poll.created_by =
       http_req_extract_cookie_with_name(req, user_id_cookie_name, arena);
   if (slice_is_empty(poll.created_by)) {
     poll.created_by = make_unique_id_u128_string(arena);
-    log(LOG_LEVEL_INFO, "generating new user id", arena, L("req.id", req.id),
-        L("user_id", poll.created_by));
+    log_at(LOG_LEVEL_INFO, "generating new user id", arena, L("req.id", req.id),
+           L("user_id", poll.created_by));
 
     res = http_response_add_user_id_cookie(res, poll.created_by, arena);
   }
@@ -179,15 +150,16 @@ http_respond_with_unprocessable_entity(String req_id, Arena *arena) {
   {
     FormDataParseResult form = form_data_parse(req.body, arena);
     if (form.err) {
-      log(LOG_LEVEL_ERROR, "failed to create poll due to invalid options",
-          arena, L("req.id", req.id), L("req.body", req.body));
+      log_at(LOG_LEVEL_ERROR, "failed to create poll due to invalid options",
+             arena, L("req.id", req.id), L("req.body", req.body));
       return http_respond_with_unprocessable_entity(req.id, arena);
     }
 
     DynString dyn_options = {0};
     for (u64 i = 0; i < form.form.len; i++) {
       FormDataKV kv = dyn_at(form.form, i);
-      String value = html_sanitize(kv.value, arena);
+      // Stored as is, and escaped when rendered.
+      String value = kv.value;
 
       if (string_eq(kv.key, S("name"))) {
         poll.name = value;
@@ -208,22 +180,25 @@ http_respond_with_unprocessable_entity(String req_id, Arena *arena) {
   case DB_ERR_INVALID_USE:
     return http_respond_with_internal_server_error(req.id, arena);
   case DB_ERR_INVALID_DATA:
-    log(LOG_LEVEL_ERROR, "failed to create poll due to invalid db data", arena,
-        L("req.id", req.id), L("req.body", req.body));
+    log_at(LOG_LEVEL_ERROR, "failed to create poll due to invalid db data",
+           arena, L("req.id", req.id), L("req.body", req.body));
     return http_respond_with_unprocessable_entity(req.id, arena);
   default:
     ASSERT(false);
   }
 
-  log(LOG_LEVEL_INFO, "created poll", arena, L("req.id", req.id),
-      L("poll.options.len", poll.options.len),
-      L("poll.id", poll.human_readable_id), L("poll.name", poll.name));
+  // The short encoding, for shorter urls.
+  String poll_id_encoded = id128_to_base62(poll.id, arena);
+
+  log_at(LOG_LEVEL_INFO, "created poll", arena, L("req.id", req.id),
+         L("poll.options.len", poll.options.len), L("poll.id", poll_id_encoded),
+         L("poll.name", poll.name));
 
   res.status = 301;
 
   DynU8 redirect = {0};
   dyn_append_slice(&redirect, S("/poll/"), arena);
-  dyn_append_slice(&redirect, poll.human_readable_id, arena);
+  dyn_append_slice(&redirect, poll_id_encoded, arena);
 
   http_push_header(&res.headers, S("Location"), dyn_slice(String, redirect),
                    arena);
@@ -231,338 +206,189 @@ http_respond_with_unprocessable_entity(String req_id, Arena *arena) {
   return res;
 }
 
+// A rendered poll page, up to the hole.
 typedef struct {
-  DatabaseError err;
-  Poll poll;
-} DbGetPollResult;
-
-[[nodiscard]] static DbGetPollResult
-db_get_poll(String req_id, String human_readable_poll_id, Arena *arena) {
-  DbGetPollResult res = {0};
-
-  int err = 0;
-  if (SQLITE_OK !=
-      (err = sqlite3_bind_text(db_select_poll_stmt, 1,
-                               (const char *)human_readable_poll_id.data,
-                               (int)human_readable_poll_id.len, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to bind parameter 1", arena,
-        L("req.id", req_id), L("error", res.err));
-    res.err = DB_ERR_INVALID_USE;
-    return res;
-  }
-
-  err = sqlite3_step(db_select_poll_stmt);
-  if (SQLITE_DONE == err) {
-    res.err = DB_ERR_NOT_FOUND;
-    return res;
-  }
-
-  if (SQLITE_ROW != err) {
-    log(LOG_LEVEL_ERROR, "failed to execute the prepared statement to get poll",
-        arena, L("req.id", req_id), L("error", err));
-    res.err = DB_ERR_INVALID_USE;
-    return res;
-  }
-
-  res.poll.db_id = sqlite3_column_int64(db_select_poll_stmt, 0);
-  ASSERT(0 != res.poll.db_id);
-  res.poll.name.data = (u8 *)sqlite3_column_text(db_select_poll_stmt, 1);
-  res.poll.name.len = (u64)sqlite3_column_bytes(db_select_poll_stmt, 1);
+  String created_by;
+  String prefix;
+} PollPage;
+
+// Shown to the creator of the poll.
+static const String poll_page_hole_creator = S(" by you.");
+// Shown to everyone else.
+static const String poll_page_hole_other = S(" by someone else.");
+static const String poll_page_suffix =
+    S(HTML_CLOSE("span") HTML_CLOSE("div") HTML_CLOSE("div")
+          HTML_ELEMENT("div", "", "") HTML_DOCUMENT_END);
+
+// Parts of the binary encoding, see `binary_encode_string_slice_parts`.
+[[nodiscard]] static StringSlice poll_page_encode(PollPage page,
+                                                  Arena *arena) {
+  String *fields = arena_new(arena, String, 2);
+  fields[0] = page.created_by;
+  fields[1] = page.prefix;
+  return binary_encode_string_slice_parts(
+      (StringSlice){.data = fields, .len = 2}, arena);
+}
 
-  int state = sqlite3_column_int(db_select_poll_stmt, 2);
-  if (state >= POLL_STATE_MAX) {
-    log(LOG_LEVEL_ERROR, "invalid poll state", arena, L("state", state),
-        L("req.id", req_id), L("error", err));
-    res.err = DB_ERR_INVALID_DATA;
-    return res;
+// Zero-copy: the page points inside `encoded`.
+[[nodiscard]] static bool poll_page_decode(String encoded, PollPage *page,
+                                           Arena *arena) {
+  BinaryDecodeStringSliceResult fields =
+      binary_decode_string_slice(encoded, arena);
+  if (fields.err || 2 != fields.string_slice.len) {
+    return false;
   }
-  res.poll.state = (PollState)state;
-
-  String options_json_encoded = {0};
-  options_json_encoded.data = (u8 *)sqlite3_column_text(db_select_poll_stmt, 3);
-  options_json_encoded.len = (u64)sqlite3_column_bytes(db_select_poll_stmt, 3);
-
-  JsonParseStringStrResult options_decoded =
-      json_decode_string_slice(options_json_encoded, arena);
-  if (options_decoded.err) {
-    log(LOG_LEVEL_ERROR, "invalid poll options", arena, L("req.id", req_id),
-        L("options", options_json_encoded), L("error", options_decoded.err));
-    res.err = DB_ERR_INVALID_DATA;
-    return res;
-  }
-
-  res.poll.options = options_decoded.string_slice;
-
-  res.poll.created_at.data = (u8 *)sqlite3_column_text(db_select_poll_stmt, 4);
-  res.poll.created_at.len = (u64)sqlite3_column_bytes(db_select_poll_stmt, 4);
-  ASSERT(!slice_is_empty(res.poll.created_at));
-
-  res.poll.created_by.data = (u8 *)sqlite3_column_text(db_select_poll_stmt, 5);
-  res.poll.created_by.len = (u64)sqlite3_column_bytes(db_select_poll_stmt, 5);
-  ASSERT(!slice_is_empty(res.poll.created_by));
 
-  return res;
+  *page = (PollPage){
+      .created_by = slice_at(fields.string_slice, 0),
+      .prefix = slice_at(fields.string_slice, 1),
+  };
+  return true;
 }
 
-[[nodiscard]] static String make_get_poll_html(Poll poll, String user_id,
-                                               Arena *arena) {
+// Only the poll values are written at runtime, the markup is constant.
+static void poll_page_write_prefix(Poll poll, BufWriter *w) {
   ASSERT(!slice_is_empty(poll.created_by));
-  ASSERT(!slice_is_empty(user_id));
 
-  DynU8 resp_body = {0};
-  HtmlDocument document = html_make(S("Poll"), arena);
-  HtmlElement tag_link_css = {.kind = HTML_LINK};
-  {
-    *dyn_push(&tag_link_css.attributes, arena) = (KeyValue){
-        .key = S("rel"),
-        .value = S("stylesheet"),
-    };
-    *dyn_push(&tag_link_css.attributes, arena) = (KeyValue){
-        .key = S("href"),
-        .value = S("/main.css"),
-    };
-  }
-  *dyn_push(&document.head.children, arena) = tag_link_css;
-  {
-    HtmlElement tag_script = {.kind = HTML_SCRIPT};
-    {
-      *dyn_push(&tag_script.attributes, arena) = (KeyValue){
-          .key = S("src"),
-          .value = S("/main.js"),
-      };
-    }
-    *dyn_push(&document.head.children, arena) = tag_script;
-  }
-
-  {
-    HtmlElement body_div = {.kind = HTML_DIV};
-    {
-      {
-        DynU8 text = {0};
-        dyn_append_slice(&text, S("The poll \""), arena);
-        dyn_append_slice(&text, poll.name, arena);
-        dyn_append_slice(&text, S("\" "), arena);
-
-        switch (poll.state) {
-        case POLL_STATE_OPEN:
-          dyn_append_slice(&text, S("is open."), arena);
-          break;
-        case POLL_STATE_CLOSED:
-          dyn_append_slice(&text, S("is closed."), arena);
-          break;
-        case POLL_STATE_MAX:
-          [[fallthrough]];
-        default:
-          ASSERT(0);
-        }
-
-        *dyn_push(&body_div.children, arena) =
-            (HtmlElement){.kind = HTML_TEXT, .text = dyn_slice(String, text)};
-      }
-      // TODO: Button to close the poll.
-
-      {
-        HtmlElement tag_ol = {.kind = HTML_OL};
-        *dyn_push(&tag_ol.attributes, arena) = (KeyValue){
-            .key = S("id"),
-            .value = S("poll-options-list"),
-        };
-
-        for (u64 i = 0; i < poll.options.len; i++) {
-          String option = dyn_at(poll.options, i);
-
-          HtmlElement tag_li = {.kind = HTML_LI};
-          *dyn_push(&tag_li.children, arena) =
-              (HtmlElement){.kind = HTML_TEXT, .text = option};
-
-          HtmlElement tag_button_up = {
-              .kind = HTML_BUTTON,
-              .text = S("↑"),
-          };
-          *dyn_push(&tag_button_up.attributes, arena) = (KeyValue){
-              .key = S("onclick"),
-              .value = S("raise_option(this)"),
-          };
-          *dyn_push(&tag_li.children, arena) = tag_button_up;
-
-          HtmlElement tag_button_down = {
-              .kind = HTML_BUTTON,
-              .text = S("↓"),
-          };
-          *dyn_push(&tag_button_down.attributes, arena) = (KeyValue){
-              .key = S("onclick"),
-              .value = S("lower_option(this)"),
-          };
-          *dyn_push(&tag_li.children, arena) = tag_button_down;
-
-          *dyn_push(&tag_ol.children, arena) = tag_li;
-        }
-        *dyn_push(&body_div.children, arena) = tag_ol;
-      }
-      {
-        HtmlElement created_at_div = {.kind = HTML_DIV};
-        DynU8 created_at_text = {0};
-        dyn_append_slice(&created_at_text, S("Created at: "), arena);
-        dyn_append_slice(&created_at_text, poll.created_at, arena);
-
-        if (string_eq(poll.created_by, user_id)) {
-          dyn_append_slice(&created_at_text, S(" by you."), arena);
-        } else {
-          dyn_append_slice(&created_at_text, S(" by someone else."), arena);
-        }
-
-        *dyn_push(&created_at_div.children, arena) = (HtmlElement){
-            .kind = HTML_TEXT,
-            .text = dyn_slice(String, created_at_text),
-        };
-        *dyn_push(&body_div.children, arena) = created_at_div;
-      }
-      *dyn_push(&document.body.children, arena) = body_div;
-      *dyn_push(&document.body.children, arena) =
-          (HtmlElement){.kind = HTML_DIV};
-    }
+  buf_writer_write(w, S(HTML_DOCUMENT_START("Poll", PAGE_HEAD)
+                             HTML_OPEN("div", "") HTML_OPEN("span", "")
+                                 "The poll \""));
+  html_text_write(w, poll.name);
 
-    html_document_to_string(document, &resp_body, arena);
-  }
+  switch (poll.state) {
+  case POLL_STATE_OPEN:
+    buf_writer_write(w, S("\" is open." HTML_CLOSE("span")));
+    break;
+  case POLL_STATE_CLOSED:
+    buf_writer_write(w, S("\" is closed." HTML_CLOSE("span")));
+    break;
+  case POLL_STATE_MAX:
+    [[fallthrough]];
+  default:
+    ASSERT(0);
+  }
+  // TODO: Button to close the poll.
+
+  buf_writer_write(w, S(HTML_OPEN("ol", HTML_ATTR("id", "poll-options-list"))));
+  for (u64 i = 0; i < poll.options.len; i++) {
+    String option = dyn_at(poll.options, i);
+
+    buf_writer_write(w, S(HTML_OPEN("li", "") HTML_OPEN("span", "")));
+    html_text_write(w, option);
+    buf_writer_write(
+        w, S(HTML_CLOSE("span") HTML_ELEMENT(
+               "button", HTML_ATTR("onclick", "raise_option(this)"), "↑")
+                 HTML_ELEMENT("button",
+                              HTML_ATTR("onclick", "lower_option(this)"), "↓")
+                     HTML_CLOSE("li")));
+  }
+  buf_writer_write(w, S(HTML_CLOSE("ol") HTML_OPEN("div", "")
+                             HTML_OPEN("span", "") "Created at: "));
+  html_text_write(w, poll.created_at);
+}
 
-  return dyn_slice(String, resp_body);
+typedef struct {
+  Poll poll;
+  bool by_user;
+} PollPageStream;
+
+// Render the whole page straight to the socket, with a bounded buffer.
+[[nodiscard]] static Error poll_page_stream(int fd, void *ctx, Arena *arena) {
+  PollPageStream *stream = ctx;
+
+  BufWriter w = buf_writer_make(fd, POLL_PAGE_STREAM_BUFFER_LEN, arena);
+  poll_page_write_prefix(stream->poll, &w);
+  buf_writer_write(&w, stream->by_user ? poll_page_hole_creator
+                                        : poll_page_hole_other);
+  buf_writer_write(&w, poll_page_suffix);
+  return buf_writer_flush(&w);
 }
 
-[[nodiscard]] static HttpResponse handle_get_poll(HttpRequest req,
-                                                  Arena *arena) {
+[[nodiscard]] static HttpResponse
+handle_get_poll(HttpRequest req, HttpExchange *exchange, Id128 poll_id,
+                Arena *arena) {
   ASSERT(HM_GET == req.method);
   ASSERT(2 == req.path_components.len);
-  String poll_id = dyn_at(req.path_components, 1);
-  ASSERT(32 == poll_id.len);
 
   HttpResponse res = {0};
+  PollPage page = {0};
+  // Only set for pages too big to be cached.
+  PollPageStream *stream = nullptr;
+
+  ShmCacheGetResult cached = shm_cache_get(&poll_page_cache, poll_id, arena);
+  if (!cached.hit || !poll_page_decode(cached.value, &page, arena)) {
+    DbGetPollResult get_poll = db_get_poll(req.id, poll_id, arena);
+
+    switch (get_poll.err) {
+    case DB_ERR_NONE:
+      break;
+    case DB_ERR_NOT_FOUND:
+      return http_respond_with_not_found();
+    case DB_ERR_INVALID_USE:
+      return http_respond_with_internal_server_error(req.id, arena);
+    case DB_ERR_INVALID_DATA:
+      return http_respond_with_unprocessable_entity(req.id, arena);
+      log_at(LOG_LEVEL_ERROR, "failed to get poll due to invalid db data",
+             arena, L("req.id", req.id), L("req.body", req.body));
+    default:
+      ASSERT(false);
+    }
 
-  DbGetPollResult get_poll = db_get_poll(req.id, poll_id, arena);
+    // Measure first, to allocate the page exactly, if it fits.
+    BufWriter measure = buf_writer_make_measure();
+    poll_page_write_prefix(get_poll.poll, &measure);
 
-  switch (get_poll.err) {
-  case DB_ERR_NONE:
-    break;
-  case DB_ERR_NOT_FOUND:
-    return http_respond_with_not_found();
-  case DB_ERR_INVALID_USE:
-    return http_respond_with_internal_server_error(req.id, arena);
-  case DB_ERR_INVALID_DATA:
-    return http_respond_with_unprocessable_entity(req.id, arena);
-    log(LOG_LEVEL_ERROR, "failed to get poll due to invalid db data", arena,
-        L("req.id", req.id), L("req.body", req.body));
-  default:
-    ASSERT(false);
+    if (measure.len <= POLL_PAGE_PREFIX_MAX_LEN) {
+      BufWriter w = buf_writer_make(-1, measure.len, arena);
+      poll_page_write_prefix(get_poll.poll, &w);
+      ASSERT(0 == w.err);
+
+      page = (PollPage){
+          .created_by = get_poll.poll.created_by,
+          .prefix = buf_writer_string(w),
+      };
+      shm_cache_put_parts(&poll_page_cache, poll_id, cached.ticket,
+                          poll_page_encode(page, arena));
+    } else {
+      stream = arena_new(arena, PollPageStream, 1);
+      stream->poll = get_poll.poll;
+      page.created_by = get_poll.poll.created_by;
+    }
   }
 
   String user_id =
       http_req_extract_cookie_with_name(req, user_id_cookie_name, arena);
   if (slice_is_empty(user_id)) {
     user_id = make_unique_id_u128_string(arena);
-    log(LOG_LEVEL_INFO, "generating new user id", arena, L("req.id", req.id),
-        L("user_id", user_id));
+    log_at(LOG_LEVEL_INFO, "generating new user id", arena, L("req.id", req.id),
+           L("user_id", user_id));
 
     res = http_response_add_user_id_cookie(res, user_id, arena);
   }
+  const bool by_user = string_eq(page.created_by, user_id);
+
+  if (nullptr != stream) {
+    stream->by_user = by_user;
+    exchange->body_write = poll_page_stream;
+    exchange->body_write_ctx = stream;
+  } else {
+    String *segments = arena_new(arena, String, 3);
+    segments[0] = page.prefix;
+    segments[1] = by_user ? poll_page_hole_creator : poll_page_hole_other;
+    segments[2] = poll_page_suffix;
+    exchange->body_segments = (StringSlice){.data = segments, .len = 3};
+  }
 
-  res.body =
-      dyn_slice(String, make_get_poll_html(get_poll.poll, user_id, arena));
   res.status = 200;
   http_push_header(&res.headers, S("Content-Type"), S("text/html"), arena);
 
   return res;
 }
 
-[[nodiscard]] static DatabaseError
-db_cast_vote(String req_id, String human_readable_poll_id, String user_id,
-             StringSlice vote_options, Arena *arena) {
-
-  int err = 0;
-  if (SQLITE_OK !=
-      (err = sqlite3_exec(db, "BEGIN IMMEDIATE", nullptr, nullptr, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to begin transaction", arena,
-        L("req.id", req_id), L("error", err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  DbGetPollResult get_poll = db_get_poll(req_id, human_readable_poll_id, arena);
-  if (get_poll.err) {
-    return get_poll.err;
-  }
-  ASSERT(0 != get_poll.poll.db_id);
-
-  // Check that the options sent match the options for the poll.
-  {
-    if (vote_options.len != get_poll.poll.options.len) {
-      return DB_ERR_INVALID_DATA;
-    }
-
-    for (u64 i_vote = 0; i_vote < vote_options.len; i_vote++) {
-      String vote_option = slice_at(vote_options, i_vote);
-
-      bool found = false;
-      for (u64 i_poll = 0; i_poll < get_poll.poll.options.len; i_poll++) {
-        String poll_option = slice_at(get_poll.poll.options, i_poll);
-
-        if (string_eq(vote_option, poll_option)) {
-          found = true;
-          break;
-        }
-      }
-
-      if (!found) {
-        return DB_ERR_INVALID_DATA;
-      }
-    }
-  }
-
-  if (SQLITE_OK !=
-      (err = sqlite3_bind_text(db_insert_vote_stmt, 1, (char *)user_id.data,
-                               (int)user_id.len, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to bind parameter 1", arena,
-        L("req.id", req_id), L("error", err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  if (SQLITE_OK !=
-      (err = sqlite3_bind_int64(db_insert_vote_stmt, 2, get_poll.poll.db_id))) {
-    log(LOG_LEVEL_ERROR, "failed to bind parameter 2", arena,
-        L("req.id", req_id), L("error", err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  String poll_options_encoded = json_encode_string_slice(vote_options, arena);
-  if (SQLITE_OK !=
-      (err = sqlite3_bind_text(db_insert_vote_stmt, 3,
-                               (const char *)poll_options_encoded.data,
-                               (int)poll_options_encoded.len, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to bind parameter 3", arena,
-        L("req.id", req_id), L("error", err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  if (SQLITE_DONE != (err = sqlite3_step(db_insert_vote_stmt))) {
-    log(LOG_LEVEL_ERROR,
-        "failed to execute the prepared statement to insert a vote", arena,
-        L("req.id", req_id), L("error", err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  if (SQLITE_OK !=
-      (err = sqlite3_exec(db, "COMMIT", nullptr, nullptr, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to commit creating a vote", arena,
-        L("req.id", req_id), L("error", err));
-    return DB_ERR_INVALID_USE;
-  }
-
-  return DB_ERR_NONE;
-}
-
-[[nodiscard]] static HttpResponse handle_cast_vote(HttpRequest req,
-                                                   Arena *arena) {
+[[nodiscard]] static HttpResponse
+handle_cast_vote(HttpRequest req, Id128 poll_id, Arena *arena) {
   ASSERT(HM_POST == req.method);
   ASSERT(3 == req.path_components.len);
-  String poll_id = dyn_at(req.path_components, 1);
-  ASSERT(32 == poll_id.len);
 
   HttpResponse res = {0};
 
@@ -570,15 +396,16 @@ db_cast_vote(String req_id, String human_readable_poll_id, String user_id,
   {
     FormDataParseResult form = form_data_parse(req.body, arena);
     if (form.err) {
-      log(LOG_LEVEL_ERROR, "failed to create vote due to invalid options",
-          arena, L("req.id", req.id), L("req.body", req.body));
+      log_at(LOG_LEVEL_ERROR, "failed to create vote due to invalid options",
+             arena, L("req.id", req.id), L("req.body", req.body));
       return http_respond_with_unprocessable_entity(req.id, arena);
     }
 
     DynString dyn_options = {0};
     for (u64 i = 0; i < form.form.len; i++) {
       FormDataKV kv = dyn_at(form.form, i);
-      String value = html_sanitize(kv.value, arena);
+      // Stored as is, and escaped when rendered.
+      String value = kv.value;
 
       if (string_eq(kv.key, S("option")) && !slice_is_empty(value)) {
         *dyn_push(&dyn_options, arena) = value;
@@ -592,9 +419,9 @@ db_cast_vote(String req_id, String human_readable_poll_id, String user_id,
   String user_id =
       http_req_extract_cookie_with_name(req, user_id_cookie_name, arena);
   if (slice_is_empty(user_id)) {
-    log(LOG_LEVEL_ERROR,
-        "failed to create vote due to missing/empty user-agent", arena,
-        L("req.id", req.id));
+    log_at(LOG_LEVEL_ERROR,
+           "failed to create vote due to missing/empty user-agent", arena,
+           L("req.id", req.id));
     return http_respond_with_unprocessable_entity(req.id, arena);
   }
 
@@ -606,15 +433,15 @@ db_cast_vote(String req_id, String human_readable_poll_id, String user_id,
   case DB_ERR_INVALID_USE:
     return http_respond_with_internal_server_error(req.id, arena);
   case DB_ERR_INVALID_DATA:
-    log(LOG_LEVEL_ERROR, "failed to create vote due to invalid db data", arena,
-        L("req.id", req.id), L("req.body", req.body));
+    log_at(LOG_LEVEL_ERROR, "failed to create vote due to invalid db data",
+           arena, L("req.id", req.id), L("req.body", req.body));
     return http_respond_with_unprocessable_entity(req.id, arena);
   default:
     ASSERT(false);
   }
 
-  log(LOG_LEVEL_INFO, "vote was cast", arena, L("req.id", req.id),
-      L("poll.id", poll_id));
+  log_at(LOG_LEVEL_INFO, "vote was cast", arena, L("req.id", req.id),
+         L("poll.id", id128_to_base62(poll_id, arena)));
 
   res.status = 200;
   // FIXME
@@ -622,132 +449,113 @@ db_cast_vote(String req_id, String human_readable_poll_id, String user_id,
   return res;
 }
 
-[[nodiscard]] static String make_home_html(Arena *arena) {
-  DynU8 res = {0};
-  HtmlDocument document = html_make(S("Create a poll"), arena);
-  {
-    HtmlElement tag_link_css = {.kind = HTML_LINK};
-    {
-      *dyn_push(&tag_link_css.attributes, arena) = (KeyValue){
-          .key = S("rel"),
-          .value = S("stylesheet"),
-      };
-      *dyn_push(&tag_link_css.attributes, arena) = (KeyValue){
-          .key = S("href"),
-          .value = S("/main.css"),
-      };
-    }
-    *dyn_push(&document.head.children, arena) = tag_link_css;
-  }
-  {
-    HtmlElement tag_script = {.kind = HTML_SCRIPT};
-    {
-      *dyn_push(&tag_script.attributes, arena) = (KeyValue){
-          .key = S("src"),
-          .value = S("/main.js"),
-      };
-    }
-    *dyn_push(&document.head.children, arena) = tag_script;
-  }
+static const String home_html = S(
+    HTML_DOCUMENT_START("Create a poll", PAGE_HEAD) HTML_ELEMENT(
+        "form", HTML_ATTR("action", "/poll") HTML_ATTR("method", "post"),
+        HTML_ELEMENT(
+            "fieldset", HTML_ATTR("id", "poll-form-fieldset"),
+            HTML_ELEMENT("legend", "", "New poll") HTML_ELEMENT(
+                "div", "",
+                HTML_ELEMENT("label", "", HTML_ELEMENT("span", "", "Name: "))
+                    HTML_ELEMENT("input",
+                                 HTML_ATTR("name", "name") HTML_ATTR(
+                                     "placeholder",
+                                     "Where do we go on vacation?"),
+                                 ""))
+                HTML_ELEMENT("button",
+                             HTML_ATTR("type", "button")
+                                 HTML_ATTR("id", "add-poll-option"),
+                             "+")
+                    HTML_ELEMENT("button", HTML_ATTR("type", "submit"),
+                                 "Create"))) HTML_DOCUMENT_END);
+
+// Serialized at startup.
+static HttpStaticResponse home_response = {0};
+
+static void metrics_write(BufWriter *w) {
+  String routes[1 + ROUTE_MAX] = {S("all")};
+  HttpRequestStats *request_stats[1 + ROUTE_MAX] = {http_server_request_stats};
+  HttpArenaStats *arena_stats[1 + ROUTE_MAX] = {http_server_arena_stats};
+  for (u64 i = 0; i < ROUTE_MAX; i++) {
+    routes[1 + i] = route_to_s[i];
+    request_stats[1 + i] = &route_request_stats[i];
+    arena_stats[1 + i] = &route_arena_stats[i];
+  }
+  http_request_stats_write_metrics(w, routes, request_stats, 1 + ROUTE_MAX);
+  http_phase_stats_write_metrics(w, http_server_phase_stats);
+  db_stats_write_metrics(w);
+  http_arena_stats_write_metrics(w, routes, arena_stats, 1 + ROUTE_MAX);
+
+  buf_writer_write(w, S("# TYPE http_arena_prefault_bytes gauge\n"
+                        "http_arena_prefault_bytes "));
+  buf_writer_u64(w, http_server_arena_prefault_len);
+  buf_writer_write(w, S("\n"));
+}
 
-  {
-    HtmlElement tag_form = {.kind = HTML_FORM};
-    *dyn_push(&tag_form.attributes, arena) = (KeyValue){
-        .key = S("action"),
-        .value = S("/poll"),
-    };
-    *dyn_push(&tag_form.attributes, arena) = (KeyValue){
-        .key = S("method"),
-        .value = S("post"),
-    };
-
-    {
-      HtmlElement tag_fieldset = {.kind = HTML_FIELDSET};
-      *dyn_push(&tag_fieldset.attributes, arena) = (KeyValue){
-          .key = S("id"),
-          .value = S("poll-form-fieldset"),
-      };
+[[nodiscard]] static HttpResponse handle_get_metrics(Arena *arena) {
+  BufWriter measure = buf_writer_make_measure();
+  metrics_write(&measure);
 
-      {
-        HtmlElement tag_legend = {.kind = HTML_LEGEND, .text = S("New poll")};
-        *dyn_push(&tag_fieldset.children, arena) = tag_legend;
-      }
-      HtmlElement tag_div_name = {.kind = HTML_DIV};
-      {
-        HtmlElement tag_label = {.kind = HTML_LABEL};
-        HtmlElement text = {.kind = HTML_TEXT, .text = S("Name: ")};
-        *dyn_push(&tag_label.children, arena) = text;
-        *dyn_push(&tag_div_name.children, arena) = tag_label;
-      }
-      {
-        HtmlElement tag_input = {.kind = HTML_INPUT};
-        *dyn_push(&tag_input.attributes, arena) =
-            (KeyValue){.key = S("name"), .value = S("name")};
-        *dyn_push(&tag_input.attributes, arena) = (KeyValue){
-            .key = S("placeholder"), .value = S("Where do we go on vacation?")};
-        *dyn_push(&tag_div_name.children, arena) = tag_input;
-      }
-      *dyn_push(&tag_fieldset.children, arena) = tag_div_name;
-
-      {
-        HtmlElement tag_button = {
-            .kind = HTML_BUTTON,
-            .text = S("+"),
-        };
-        *dyn_push(&tag_button.attributes, arena) = (KeyValue){
-            .key = S("type"),
-            .value = S("button"),
-        };
-        *dyn_push(&tag_button.attributes, arena) = (KeyValue){
-            .key = S("id"),
-            .value = S("add-poll-option"),
-        };
-        *dyn_push(&tag_fieldset.children, arena) = tag_button;
-      }
-      {
-        HtmlElement tag_button = {
-            .kind = HTML_BUTTON,
-            .text = S("Create"),
-        };
-        *dyn_push(&tag_button.attributes, arena) =
-            (KeyValue){.key = S("type"), .value = S("submit")};
-        *dyn_push(&tag_fieldset.children, arena) = tag_button;
-      }
-      *dyn_push(&tag_form.children, arena) = tag_fieldset;
-    }
+  BufWriter w = buf_writer_make(-1, measure.len, arena);
+  metrics_write(&w);
+  ASSERT(0 == w.err);
 
-    *dyn_push(&document.body.children, arena) = tag_form;
-  }
+  HttpResponse res = {0};
+  res.status = 200;
+  res.body = buf_writer_string(w);
+  http_push_header(&res.headers, S("Content-Type"),
+                   S("text/plain; version=0.0.4"), arena);
+  return res;
+}
 
-  html_document_to_string(document, &res, arena);
+// Links made before base62 have the poll id in hex: redirect them to the
+// canonical url, keeping the method and the body.
+[[nodiscard]] static HttpResponse
+handle_poll_id_redirect(HttpRequest req, Id128 poll_id, Arena *arena) {
+  DynU8 location = {0};
+  for (u64 i = 0; i < req.path_components.len; i++) {
+    *dyn_push(&location, arena) = '/';
+    dyn_append_slice(&location,
+                     1 == i ? id128_to_base62(poll_id, arena)
+                            : dyn_at(req.path_components, i),
+                     arena);
+  }
 
-  return dyn_slice(String, res);
+  HttpResponse res = {0};
+  res.status = 308;
+  http_push_header(&res.headers, S("Location"), dyn_slice(String, location),
+                   arena);
+  return res;
 }
 
-[[nodiscard]] static HttpResponse
-my_http_request_handler(HttpRequest req, void *ctx, Arena *arena) {
+[[nodiscard]] static HttpResponse route_request(HttpRequest req,
+                                                HttpExchange *exchange,
+                                                Arena *arena) {
   ASSERT(0 == req.err);
-  (void)ctx;
 
   String path0 = req.path_components.len >= 1 ? dyn_at(req.path_components, 0)
                                               : (String){0};
   String path1 = req.path_components.len >= 2 ? dyn_at(req.path_components, 1)
                                               : (String){0};
+  // Poll ids are decoded once here, at the boundary, and are integers from
+  // then on.
+  Id128ParseResult poll_id = id128_parse(path1);
   // Home page.
   if (HM_GET == req.method && ((req.path_components.len == 0) ||
                                ((req.path_components.len == 1) &&
                                 (string_eq(path0, S("index.html")))))) {
     // `GET /`
     // `GET /index.html`
+    route_enter(ROUTE_HOME, exchange, arena);
 
     HttpResponse res = {0};
-    res.status = 200;
-    res.body = make_home_html(arena);
-    http_push_header(&res.headers, S("Content-Type"), S("text/html"), arena);
+    res.status =
+        http_static_response_serve(home_response, req, exchange, arena);
     return res;
   } else if (HM_GET == req.method && 1 == req.path_components.len &&
              string_eq(path0, S("main.css"))) {
     // `GET /main.css`
+    route_enter(ROUTE_STATIC_FILE, exchange, arena);
 
     HttpResponse res = {0};
     res.status = 200;
@@ -757,6 +565,7 @@ my_http_request_handler(HttpRequest req, void *ctx, Arena *arena) {
   } else if (HM_GET == req.method && 1 == req.path_components.len &&
              string_eq(path0, S("main.js"))) {
     // `GET /main.js`
+    route_enter(ROUTE_STATIC_FILE, exchange, arena);
 
     HttpResponse res = {0};
     res.status = 200;
@@ -767,132 +576,132 @@ my_http_request_handler(HttpRequest req, void *ctx, Arena *arena) {
   } else if (HM_POST == req.method && 1 == req.path_components.len &&
              string_eq(path0, S("poll"))) {
     // `POST /poll`
+    route_enter(ROUTE_CREATE_POLL, exchange, arena);
 
     return handle_create_poll(req, arena);
+  } else if (((HM_GET == req.method && 2 == req.path_components.len) ||
+              (HM_POST == req.method && 3 == req.path_components.len)) &&
+             string_eq(path0, S("poll")) && poll_id.ok &&
+             ID128_BASE62_LEN != path1.len) {
+    // `GET /poll/<hex poll_id>`
+    // `POST /poll/<hex poll_id>/vote`
+    route_enter(HM_GET == req.method ? ROUTE_GET_POLL : ROUTE_CAST_VOTE,
+                exchange, arena);
+    return handle_poll_id_redirect(req, poll_id.id, arena);
   } else if (HM_GET == req.method && 2 == req.path_components.len &&
-             string_eq(path0, S("poll")) && 32 == path1.len) {
+             string_eq(path0, S("poll")) && poll_id.ok) {
     // `GET /poll/<poll_id>`
+    route_enter(ROUTE_GET_POLL, exchange, arena);
 
-    return handle_get_poll(req, arena);
+    return handle_get_poll(req, exchange, poll_id.id, arena);
   } else if (HM_POST == req.method && 3 == req.path_components.len &&
-             string_eq(path0, S("poll")) && 32 == path1.len) {
+             string_eq(path0, S("poll")) && poll_id.ok) {
     // `POST /poll/<poll_id>/vote`
-    return handle_cast_vote(req, arena);
+    route_enter(ROUTE_CAST_VOTE, exchange, arena);
+    return handle_cast_vote(req, poll_id.id, arena);
+  } else if (HM_GET == req.method && 1 == req.path_components.len &&
+             string_eq(path0, S("metrics"))) {
+    // `GET /metrics`
+    route_enter(ROUTE_METRICS, exchange, arena);
+
+    return handle_get_metrics(arena);
   } else {
+    route_enter(ROUTE_NOT_FOUND, exchange, arena);
     return http_respond_with_not_found();
   }
   ASSERT(0);
 }
 
-[[nodiscard]] static DatabaseError db_setup(Arena *arena) {
-  int db_err = 0;
-  if (SQLITE_OK != (db_err = sqlite3_initialize())) {
-    log(LOG_LEVEL_ERROR, "failed to initialize sqlite", arena,
-        L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
+[[nodiscard]] static HttpResponse
+my_http_request_handler(HttpRequest req, HttpExchange *exchange, void *ctx,
+                        Arena *arena) {
+  (void)ctx;
 
-  if (SQLITE_OK != (db_err = sqlite3_open("vote.db", &db))) {
-    log(LOG_LEVEL_ERROR, "failed to open db", arena, L("error", db_err));
-    return DB_ERR_INVALID_USE;
-  }
+  const u64 db_time_ns_before = db_time_ns;
+  HttpResponse res = route_request(req, exchange, arena);
+  exchange->db_ns = db_time_ns - db_time_ns_before;
+  return res;
+}
 
-  // See https://kerkour.com/sqlite-for-servers.
-  char *pragmas[] = {
-      "PRAGMA journal_mode = WAL",   "PRAGMA busy_timeout = 5000",
-      "PRAGMA synchronous = NORMAL", "PRAGMA cache_size = 1000000000",
-      "PRAGMA foreign_keys = true",  "PRAGMA temp_store = memory",
-  };
-  for (u64 i = 0; i < static_array_len(pragmas); i++) {
-    if (SQLITE_OK !=
-        (db_err = sqlite3_exec(db, AT(pragmas, static_array_len(pragmas), i),
-                               nullptr, nullptr, nullptr))) {
-      log(LOG_LEVEL_ERROR, "failed to execute pragmas", arena, L("i", i),
-          L("error", db_err));
-      return DB_ERR_INVALID_USE;
+int main() {
+  Arena arena = arena_make_from_virtual_mem(16 * KiB);
+
+  {
+    // `LOG_FULL_POLICY=block` makes requests wait when the log ring is full,
+    // instead of dropping lines.
+    // `LOG_FORMAT=binary` writes the compact binary format, to be read back
+    // with `log_decode.bin`.
+    const char *policy = getenv("LOG_FULL_POLICY");
+    const bool block = nullptr != policy && 0 == strcmp(policy, "block");
+    const char *format = getenv("LOG_FORMAT");
+    const bool binary = nullptr != format && 0 == strcmp(format, "binary");
+    Error err = log_ring_start(LOG_RING_SLOTS_LEN,
+                               block ? LOG_FULL_POLICY_BLOCK
+                                     : LOG_FULL_POLICY_DROP,
+                               binary ? LOG_FORMAT_BINARY : LOG_FORMAT_LOGFMT);
+    if (err) {
+      log_at(LOG_LEVEL_ERROR, "failed to start the logger", &arena,
+             L("error", err));
+      exit(EINVAL);
     }
   }
 
-  if (SQLITE_OK !=
-      (db_err = sqlite3_exec(
-           db,
-           "create table if not exists polls (id "
-           "integer primary key, name text, "
-           "state int, options text, human_readable_id text unique, "
-           "created_at text, created_by text) STRICT",
-           nullptr, nullptr, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to create polls table", arena,
-        L("error", db_err));
-    return DB_ERR_INVALID_USE;
+  home_response = http_static_response_make(S("text/html"), home_html, &arena);
+
+  // `DB_BACKEND=kv` selects the key-value store, otherwise SQLite is used.
+  const char *backend_name = getenv("DB_BACKEND");
+  const bool use_kv =
+      nullptr != backend_name && 0 == strcmp(backend_name, "kv");
+  const char *db_path = use_kv ? "vote.kv" : "vote.db";
+  if (DB_ERR_NONE != db_setup(use_kv ? &db_backend_kv : &db_backend_sqlite,
+                              db_path, &arena)) {
+    exit(EINVAL);
   }
-  if (SQLITE_OK !=
-      (db_err = sqlite3_exec(
-           db,
-           "create table if not exists votes (id "
-           "integer primary key, created_at text, user_id text unique, "
-           "poll_id text,"
-           "options text,"
-           "foreign key(poll_id) references polls(id)"
-           ") STRICT",
-           nullptr, nullptr, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to create votes table", arena,
-        L("error", db_err));
-    return DB_ERR_INVALID_USE;
+  if (!use_kv && DB_ERR_NONE != db_checkpointer_start(db_path, &arena)) {
+    exit(EINVAL);
   }
-
-  String db_insert_poll_sql = S("insert into polls (human_readable_id, name, "
-                                "state, options, created_at, created_by) "
-                                "values (?, ?, 0, ?, datetime('now'), ?)");
-  if (SQLITE_OK !=
-      (db_err = sqlite3_prepare_v2(db, (const char *)db_insert_poll_sql.data,
-                                   (int)db_insert_poll_sql.len,
-                                   &db_insert_poll_stmt, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to prepare statement to insert poll", arena,
-        L("error", db_err));
-    return DB_ERR_INVALID_USE;
+  if (DB_ERR_NONE != db_poll_cache_setup(&arena)) {
+    exit(EINVAL);
   }
-
-  String db_select_poll_sql = S("select id, name, state, options, created_at, "
-                                "created_by from polls where "
-                                "human_readable_id = ? limit 1");
-  if (SQLITE_OK !=
-      (db_err = sqlite3_prepare_v2(db, (const char *)db_select_poll_sql.data,
-                                   (int)db_select_poll_sql.len,
-                                   &db_select_poll_stmt, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to prepare statement to select poll", arena,
-        L("error", db_err));
-    return DB_ERR_INVALID_USE;
+  if (DB_ERR_NONE != db_stats_setup(&arena)) {
+    exit(EINVAL);
   }
-
-  String db_insert_vote_sql = S("insert or replace into votes (created_at, "
-                                "user_id, poll_id, options) values "
-                                "(datetime('now'), ?, ?, ?)");
-  if (SQLITE_OK !=
-      (db_err = sqlite3_prepare_v2(db, (const char *)db_insert_vote_sql.data,
-                                   (int)db_insert_vote_sql.len,
-                                   &db_insert_vote_stmt, nullptr))) {
-    log(LOG_LEVEL_ERROR, "failed to prepare statement to insert vote", arena,
-        L("error", db_err));
-    return DB_ERR_INVALID_USE;
+  {
+    Error err = shm_cache_init(&poll_page_cache, POLL_PAGE_CACHE_SLOTS_LEN,
+                               POLL_PAGE_CACHE_VALUE_CAP);
+    if (err) {
+      log_at(LOG_LEVEL_ERROR, "failed to create poll page cache", &arena,
+             L("error", err));
+      exit(EINVAL);
+    }
   }
 
-  ASSERT(nullptr != db);
-  ASSERT(nullptr != db_insert_poll_stmt);
-  ASSERT(nullptr != db_select_poll_stmt);
-  ASSERT(nullptr != db_insert_vote_stmt);
-
-  return DB_ERR_NONE;
-}
-
-int main() {
-  Arena arena = arena_make_from_virtual_mem(4 * KiB);
-
-  if (DB_ERR_NONE != db_setup(&arena)) {
+  route_arena_stats = http_arena_stats_make_shared(ROUTE_MAX);
+  if (nullptr == route_arena_stats) {
+    log_at(LOG_LEVEL_ERROR, "failed to create route arena stats", &arena,
+           L("error", errno));
     exit(EINVAL);
   }
-  ASSERT(nullptr != db);
+  route_request_stats = http_request_stats_make_shared(ROUTE_MAX);
+  if (nullptr == route_request_stats) {
+    log_at(LOG_LEVEL_ERROR, "failed to create route request stats", &arena,
+           L("error", errno));
+    exit(EINVAL);
+  }
+
+  // `LOG_SAMPLE_RATE=n` logs the start and end of 1 in n requests, and none
+  // with 0.
+  const char *sample_rate = getenv("LOG_SAMPLE_RATE");
+  if (nullptr != sample_rate) {
+    log_sample_rate = strtoull(sample_rate, nullptr, 10);
+  }
+
+  // `ARENA_AUTOTUNE=1` sizes the request arenas from the observed memory use.
+  const char *autotune = getenv("ARENA_AUTOTUNE");
+  http_server_arena_autotune =
+      nullptr != autotune && 0 == strcmp(autotune, "1");
 
   Error err = http_server_run(HTTP_SERVER_DEFAULT_PORT, my_http_request_handler,
                               nullptr, &arena);
-  log(LOG_LEVEL_INFO, "http server stopped", &arena, L("error", err));
+  log_at(LOG_LEVEL_INFO, "http server stopped", &arena, L("error", err));
 }
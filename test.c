@@ -1,3 +1,5 @@
+#include "cache.c"
+#include "db.c"
 #include "http.c"
 #include "submodules/cstd/lib.c"
 #include <sys/wait.h>
@@ -51,8 +53,9 @@ static void test_read_http_request_with_body() {
   ASSERT(string_eq(req.body, S("hello\r\nworld!")));
 }
 
-static HttpResponse handle_request_post(HttpRequest req, void *ctx,
-                                        Arena *arena) {
+static HttpResponse handle_request_post(HttpRequest req, HttpExchange *exchange,
+                                        void *ctx, Arena *arena) {
+  (void)exchange;
   (void)ctx;
 
   ASSERT(HM_POST == req.method);
@@ -141,8 +144,9 @@ static void test_http_server_post() {
   }
 }
 
-static HttpResponse handle_request_file(HttpRequest req, void *ctx,
-                                        Arena *arena) {
+static HttpResponse handle_request_file(HttpRequest req, HttpExchange *exchange,
+                                        void *ctx, Arena *arena) {
+  (void)exchange;
   (void)ctx;
 
   ASSERT(HM_GET == req.method);
@@ -257,6 +261,12 @@ static void test_form_data_parse() {
 
   ASSERT(string_eq(kv3.key, S("option")));
   ASSERT(string_eq(kv3.value, S("!")));
+
+  // Values without anything to decode are not copied.
+  ASSERT(kv0.value.data == form_data_raw.data + 4);
+
+  // Truncated escape sequence.
+  ASSERT(form_data_parse(S("foo=%E"), &arena).err);
 }
 
 static void test_json_encode_decode_string_slice() {
@@ -278,6 +288,431 @@ static void test_json_encode_decode_string_slice() {
   }
 }
 
+static void test_binary_encode_decode_string_slice() {
+  Arena arena = arena_make_from_virtual_mem(4 * KiB);
+
+  DynString dyn = {0};
+  *dyn_push(&dyn, &arena) = S("hello \"world\n\"!");
+  *dyn_push(&dyn, &arena) = S("");
+  *dyn_push(&dyn, &arena) = S("日");
+
+  String encoded =
+      binary_encode_string_slice(dyn_slice(StringSlice, dyn), &arena);
+  BinaryDecodeStringSliceResult decoded =
+      binary_decode_string_slice(encoded, &arena);
+  ASSERT(!decoded.err);
+  ASSERT(decoded.string_slice.len == dyn.len);
+  for (u64 i = 0; i < dyn.len; i++) {
+    String expected = dyn_at(dyn, i);
+    String got = AT(decoded.string_slice.data, decoded.string_slice.len, i);
+    ASSERT(string_eq(got, expected));
+  }
+
+  // Zero-copy: the decoded strings point inside the encoded input.
+  String first = AT(decoded.string_slice.data, decoded.string_slice.len, 0);
+  ASSERT(first.data >= encoded.data);
+  ASSERT(first.data + first.len <= encoded.data + encoded.len);
+
+  // Truncated input.
+  ASSERT(binary_decode_string_slice(slice_range(encoded, 0, encoded.len - 1),
+                                    &arena)
+             .err);
+  // Empty input.
+  ASSERT(binary_decode_string_slice((String){0}, &arena).err);
+
+  // Same encoding, in parts.
+  StringSlice parts =
+      binary_encode_string_slice_parts(dyn_slice(StringSlice, dyn), &arena);
+  DynU8 concatenated = {0};
+  for (u64 i = 0; i < parts.len; i++) {
+    dyn_append_slice(&concatenated, slice_at(parts, i), &arena);
+  }
+  ASSERT(string_eq(encoded, dyn_slice(String, concatenated)));
+}
+
+static void test_id128_encode_decode() {
+  Arena arena = arena_make_from_virtual_mem(4 * KiB);
+
+  Id128 id = {.hi = 0x0123'4567'89ab'cdef, .lo = 0xfedc'ba98'7654'3210};
+
+  String hex = id128_to_hex(id, &arena);
+  ASSERT(string_eq(hex, S("0123456789abcdeffedcba9876543210")));
+  Id128ParseResult parsed_hex = id128_parse(hex);
+  ASSERT(parsed_hex.ok);
+  ASSERT(id128_eq(id, parsed_hex.id));
+  // One hex form per id.
+  ASSERT(!id128_parse(S("0123456789ABCDEFFEDCBA9876543210")).ok);
+
+  String base62 = id128_to_base62(id, &arena);
+  ASSERT(string_eq(base62, S("0296tiiBb3UUmdjYQ3ySu0")));
+  Id128ParseResult parsed_base62 = id128_parse(base62);
+  ASSERT(parsed_base62.ok);
+  ASSERT(id128_eq(id, parsed_base62.id));
+
+  Id128 max = {.hi = UINT64_MAX, .lo = UINT64_MAX};
+  ASSERT(string_eq(id128_to_base62(max, &arena), S("7n42DGM5Tflk9n8mt7Fhc7")));
+  ASSERT(id128_eq(max, id128_parse(S("7n42DGM5Tflk9n8mt7Fhc7")).id));
+
+  u8 bytes[16] = {0};
+  id128_to_bytes(id, bytes);
+  ASSERT(0x01 == bytes[0]);
+  ASSERT(0x10 == bytes[15]);
+  ASSERT(id128_eq(id, id128_from_bytes(bytes)));
+
+  // Invalid: wrong length, wrong characters, overflow.
+  ASSERT(!id128_parse(S("")).ok);
+  ASSERT(!id128_parse(S("0123456789abcdeffedcba987654321")).ok);
+  ASSERT(!id128_parse(S("0123456789abcdeffedcba987654321g")).ok);
+  ASSERT(!id128_parse(S("0296tiiBb3UUmdjYQ3ySu!")).ok);
+  ASSERT(!id128_parse(S("7n42DGM5Tflk9n8mt7Fhc8")).ok);
+}
+
+static void test_shm_cache() {
+  Arena arena = arena_make_from_virtual_mem(4 * KiB);
+
+  ShmCache disabled = {0};
+  ASSERT(!shm_cache_get(&disabled, (Id128){.lo = 1}, &arena).hit);
+
+  ShmCache cache = {0};
+  ASSERT(0 == shm_cache_init(&cache, 16, 64));
+
+  // Ids only differing above their low byte still spread over the slots.
+  u64 slots_used = 0;
+  for (u64 i = 0; i < 16; i++) {
+    slots_used |= 1ULL << id128_hash_index((Id128){.lo = i << 8}, 16);
+  }
+  ASSERT(__builtin_popcountll(slots_used) >= 8);
+
+  Id128 key = {.hi = 1, .lo = 2};
+  ShmCacheGetResult miss = shm_cache_get(&cache, key, &arena);
+  ASSERT(!miss.hit);
+
+  shm_cache_put(&cache, key, miss.ticket, S("hello"));
+  ShmCacheGetResult hit = shm_cache_get(&cache, key, &arena);
+  ASSERT(hit.hit);
+  ASSERT(string_eq(hit.value, S("hello")));
+
+  // Too big: ignored.
+  shm_cache_put(&cache, key, hit.ticket, S("0123456789abcdef0123456789abcdef"
+                                           "0123456789abcdef0123456789abcdef"
+                                           "!"));
+  ASSERT(string_eq(shm_cache_get(&cache, key, &arena).value, S("hello")));
+
+  // A fill based on a lookup done before an invalidation is ignored.
+  shm_cache_invalidate(&cache, key);
+  ShmCacheGetResult stale = shm_cache_get(&cache, key, &arena);
+  ASSERT(!stale.hit);
+  shm_cache_invalidate(&cache, key);
+  shm_cache_put(&cache, key, stale.ticket, S("stale"));
+  ASSERT(!shm_cache_get(&cache, key, &arena).hit);
+
+  // Shared with child processes.
+  pid_t pid = fork();
+  ASSERT(-1 != pid);
+  if (0 == pid) {
+    ShmCacheGetResult res = shm_cache_get(&cache, key, &arena);
+    shm_cache_put(&cache, key, res.ticket, S("from child"));
+    exit(0);
+  }
+  int status = 0;
+  ASSERT(-1 != waitpid(pid, &status, 0));
+  ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+  ShmCacheGetResult from_child = shm_cache_get(&cache, key, &arena);
+  ASSERT(from_child.hit);
+  ASSERT(string_eq(from_child.value, S("from child")));
+
+  ASSERT(0 != atomic_load_explicit(&cache.stats->hits, memory_order_relaxed));
+
+  // A writer died holding the slot: the invalidation does not hang, and the
+  // slot is not used anymore.
+  pid = fork();
+  ASSERT(-1 != pid);
+  if (0 == pid) {
+    ShmCacheSlot *slot = shm_cache_slot(&cache, key);
+    atomic_fetch_add_explicit(&slot->seq, 1, memory_order_acquire);
+    exit(0);
+  }
+  ASSERT(-1 != waitpid(pid, &status, 0));
+  ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+  shm_cache_invalidate(&cache, key);
+  ASSERT(1 == atomic_load_explicit(&cache.stats->lost, memory_order_relaxed));
+  shm_cache_invalidate(&cache, key);
+  ShmCacheGetResult lost = shm_cache_get(&cache, key, &arena);
+  ASSERT(!lost.hit);
+  shm_cache_put(&cache, key, lost.ticket, S("lost"));
+  ASSERT(!shm_cache_get(&cache, key, &arena).hit);
+}
+
+static void test_db_kv() {
+  Arena arena = arena_make_from_virtual_mem(64 * KiB);
+
+  char path[] = "/tmp/test_db_kv_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(-1 != fd);
+  ASSERT(0 == close(fd));
+
+  String options[] = {S("pizza"), S("sushi")};
+  Poll poll = {
+      .id = {.hi = 1, .lo = 2},
+      .name = S("lunch"),
+      .options = {.data = options, .len = static_array_len(options)},
+      .created_by = S("alice"),
+  };
+  // Ranked: all the options, in the order of preference.
+  String vote[] = {S("sushi"), S("pizza")};
+  StringSlice vote_options = {.data = vote, .len = static_array_len(vote)};
+
+  // Like a previous run of the server, which crashed in the middle of an
+  // append.
+  pid_t pid = fork();
+  ASSERT(-1 != pid);
+  if (0 == pid) {
+    ASSERT(DB_ERR_NONE == db_kv_setup(path, &arena));
+    ASSERT(DB_ERR_NONE == db_kv_create_poll(S("req"), poll, &arena));
+    ASSERT(DB_ERR_INVALID_USE == db_kv_create_poll(S("req"), poll, &arena));
+    ASSERT(DB_ERR_NONE ==
+           db_kv_cast_vote(S("req"), poll.id, S("bob"), vote_options, &arena));
+
+    u64 file_len =
+        atomic_load_explicit(&kv_shared->file_len, memory_order_relaxed);
+    *(KvRecordHeader *)(void *)(kv_map + file_len) = (KvRecordHeader){
+        .checksum = 42,
+        .payload_len = 100,
+        .kind = KV_RECORD_KIND_VOTE,
+    };
+    exit(0);
+  }
+  int status = 0;
+  ASSERT(-1 != waitpid(pid, &status, 0));
+  ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+
+  // Replay.
+  ASSERT(DB_ERR_NONE == db_kv_setup(path, &arena));
+  ASSERT(1 == kv_shared->index_count);
+  {
+    DbGetPollResult res = db_kv_get_poll(S("req"), poll.id, &arena);
+    ASSERT(DB_ERR_NONE == res.err);
+    ASSERT(0 != res.poll.db_id);
+    ASSERT(id128_eq(poll.id, res.poll.id));
+    ASSERT(POLL_STATE_OPEN == res.poll.state);
+    ASSERT(string_eq(S("lunch"), res.poll.name));
+    ASSERT(string_eq(S("alice"), res.poll.created_by));
+    ASSERT(2 == res.poll.options.len);
+    ASSERT(string_eq(S("sushi"), slice_at(res.poll.options, 1)));
+  }
+
+  // Torn tail dropped.
+  u64 file_len =
+      atomic_load_explicit(&kv_shared->file_len, memory_order_relaxed);
+  KvRecordHeader *tail = (KvRecordHeader *)(void *)(kv_map + file_len);
+  ASSERT(KV_RECORD_KIND_NONE == tail->kind);
+  ASSERT(0 == tail->payload_len);
+
+  Id128 unknown = {.hi = 3, .lo = 4};
+  ASSERT(DB_ERR_NOT_FOUND == db_kv_get_poll(S("req"), unknown, &arena).err);
+  ASSERT(DB_ERR_NOT_FOUND ==
+         db_kv_cast_vote(S("req"), unknown, S("bob"), vote_options, &arena));
+  String bad_vote[] = {S("sushi"), S("tacos")};
+  ASSERT(DB_ERR_INVALID_DATA ==
+         db_kv_cast_vote(S("req"), poll.id, S("bob"),
+                         (StringSlice){.data = bad_vote,
+                                       .len = static_array_len(bad_vote)},
+                         &arena));
+
+  // Appending goes on after the recovered records.
+  poll.id = unknown;
+  ASSERT(DB_ERR_NONE == db_kv_create_poll(S("req"), poll, &arena));
+  ASSERT(DB_ERR_NONE == db_kv_get_poll(S("req"), unknown, &arena).err);
+  ASSERT(file_len <
+         atomic_load_explicit(&kv_shared->file_len, memory_order_relaxed));
+
+  // Concurrent writers, in worker processes forked after the setup like in
+  // the server.
+  const u64 workers_len = 4, polls_per_worker = 64;
+  for (u64 i = 0; i < workers_len; i++) {
+    pid = fork();
+    ASSERT(-1 != pid);
+    if (0 == pid) {
+      for (u64 j = 0; j < polls_per_worker; j++) {
+        poll.id = (Id128){.hi = 100 + i, .lo = j};
+        ASSERT(DB_ERR_NONE == db_kv_create_poll(S("req"), poll, &arena));
+        ASSERT(DB_ERR_NONE == db_kv_cast_vote(S("req"), poll.id, S("bob"),
+                                              vote_options, &arena));
+      }
+      exit(0);
+    }
+  }
+  for (u64 i = 0; i < workers_len; i++) {
+    ASSERT(-1 != wait(&status));
+    ASSERT(WIFEXITED(status) && 0 == WEXITSTATUS(status));
+  }
+  ASSERT(2 + workers_len * polls_per_worker == kv_shared->index_count);
+
+  // A writer dying with the lock does not block the others.
+  pid = fork();
+  ASSERT(-1 != pid);
+  if (0 == pid) {
+    ASSERT(0 == pthread_mutex_lock(&kv_shared->lock));
+    exit(0);
+  }
+  ASSERT(-1 != waitpid(pid, &status, 0));
+  poll.id = (Id128){.hi = 5, .lo = 6};
+  ASSERT(DB_ERR_NONE == db_kv_create_poll(S("req"), poll, &arena));
+
+  // No record was overwritten: the log replays completely.
+  const u64 index_count = kv_shared->index_count;
+  ASSERT(DB_ERR_NONE == db_kv_setup(path, &arena));
+  ASSERT(index_count == kv_shared->index_count);
+  for (u64 i = 0; i < workers_len; i++) {
+    for (u64 j = 0; j < polls_per_worker; j++) {
+      Id128 id = {.hi = 100 + i, .lo = j};
+      ASSERT(DB_ERR_NONE == db_kv_get_poll(S("req"), id, &arena).err);
+    }
+  }
+
+  ASSERT(0 == unlink(path));
+}
+
+static void test_db_sqlite_migrate_sanitized() {
+  Arena arena = arena_make_from_virtual_mem(64 * KiB);
+
+  char path[] = "/tmp/test_db_sqlite_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(-1 != fd);
+  ASSERT(0 == close(fd));
+
+  // Version 0 stored the values sanitized.
+  ASSERT(SQLITE_OK == sqlite3_open(path, &db));
+  ASSERT(SQLITE_OK ==
+         sqlite3_exec(
+             db,
+             "create table polls (id integer primary key, name text, state "
+             "int, options text, human_readable_id text unique, created_at "
+             "text, created_by text) STRICT;"
+             "create table votes (id integer primary key, created_at text, "
+             "user_id text unique, poll_id text, options text, foreign "
+             "key(poll_id) references polls(id)) STRICT;"
+             "insert into polls values (1, '&ltb&gt &#x27lunch&#x27', 0, "
+             "'[\"fish &amp chips\",\"&quotsushi&quot\",\"&ampamp\"]', "
+             "'0123456789ABCDEFFEDCBA9876543210', '2024-01-01', 'alice');"
+             "insert into votes values (1, '2024-01-01', 'bob', 1, "
+             "'[\"&ampamp\",\"&quotsushi&quot\",\"fish &amp chips\"]');",
+             nullptr, nullptr, nullptr));
+  ASSERT(SQLITE_OK == sqlite3_close(db));
+
+  ASSERT(DB_ERR_NONE == db_sqlite_setup(path, &arena));
+
+  Id128 poll_id = {.hi = 0x0123456789ABCDEF, .lo = 0xFEDCBA9876543210};
+  String options[] = {S("fish & chips"), S("\"sushi\""), S("&amp")};
+  DbGetPollResult get_poll = db_sqlite_get_poll(S("req"), poll_id, &arena);
+  ASSERT(DB_ERR_NONE == get_poll.err);
+  ASSERT(string_eq(S("<b> 'lunch'"), get_poll.poll.name));
+  ASSERT(static_array_len(options) == get_poll.poll.options.len);
+  for (u64 i = 0; i < static_array_len(options); i++) {
+    ASSERT(string_eq(options[i], get_poll.poll.options.data[i]));
+  }
+
+  sqlite3_stmt *stmt = nullptr;
+  ASSERT(SQLITE_OK == sqlite3_prepare_v2(db, "select options from votes", -1,
+                                         &stmt, nullptr));
+  ASSERT(SQLITE_ROW == sqlite3_step(stmt));
+  JsonParseStringStrResult vote = json_decode_string_slice(
+      (String){
+          .data = (u8 *)sqlite3_column_text(stmt, 0),
+          .len = (u64)sqlite3_column_bytes(stmt, 0),
+      },
+      &arena);
+  ASSERT(!vote.err);
+  ASSERT(static_array_len(options) == vote.string_slice.len);
+  for (u64 i = 0; i < static_array_len(options); i++) {
+    ASSERT(string_eq(options[static_array_len(options) - 1 - i],
+                     vote.string_slice.data[i]));
+  }
+  ASSERT(SQLITE_OK == sqlite3_finalize(stmt));
+
+  // The options as submitted are those of the poll.
+  StringSlice vote_options = {
+      .data = options,
+      .len = static_array_len(options),
+  };
+  ASSERT(DB_ERR_NONE == db_sqlite_cast_vote(S("req"), poll_id, S("carol"),
+                                            vote_options, &arena));
+
+  ASSERT(SQLITE_OK == sqlite3_finalize(db_insert_poll_stmt));
+  ASSERT(SQLITE_OK == sqlite3_finalize(db_select_poll_stmt));
+  ASSERT(SQLITE_OK == sqlite3_finalize(db_insert_vote_stmt));
+  ASSERT(SQLITE_OK == sqlite3_close(db));
+  ASSERT(0 == unlink(path));
+}
+
+static void test_db_sqlite_checkpointer() {
+  Arena arena = arena_make_from_virtual_mem(64 * KiB);
+
+  char path[] = "/tmp/test_db_sqlite_XXXXXX";
+  int fd = mkstemp(path);
+  ASSERT(-1 != fd);
+  ASSERT(0 == close(fd));
+  char wal_path[sizeof(path) + 4] = {0};
+  char shm_path[sizeof(path) + 4] = {0};
+  ASSERT(0 < snprintf(wal_path, sizeof(wal_path), "%s-wal", path));
+  ASSERT(0 < snprintf(shm_path, sizeof(shm_path), "%s-shm", path));
+
+  ASSERT(DB_ERR_NONE == db_sqlite_setup(path, &arena));
+  i64 cache_size = 0, mmap_size = 0;
+  ASSERT(DB_ERR_NONE ==
+         db_sqlite_query_i64("PRAGMA cache_size", &cache_size, &arena));
+  ASSERT(-16384 == cache_size);
+  ASSERT(DB_ERR_NONE ==
+         db_sqlite_query_i64("PRAGMA mmap_size", &mmap_size, &arena));
+  ASSERT(268435456 == mmap_size);
+
+  ASSERT(DB_ERR_NONE == db_checkpointer_start(path, &arena));
+
+  // Each transaction appends the page it modified to the WAL, which grows
+  // past the threshold since only the checkpointer checkpoints. Always the
+  // same page: the default build has little memory for the page cache.
+  ASSERT(SQLITE_OK == sqlite3_exec(db,
+                                   "insert into polls (name, state, options, "
+                                   "public_id, created_at, created_by) values "
+                                   "('', 0, x'', randomblob(16), '', '')",
+                                   nullptr, nullptr, nullptr));
+  for (u64 i = 0;; i++) {
+    struct stat st = {0};
+    ASSERT(0 == stat(wal_path, &st));
+    if ((u64)st.st_size >= DB_CHECKPOINT_WAL_BYTES_MIN) {
+      break;
+    }
+    ASSERT(i < 100'000);
+    ASSERT(SQLITE_OK == sqlite3_exec(db, "update polls set state = state + 1",
+                                     nullptr, nullptr, nullptr));
+  }
+
+  // `PASSIVE` then `TRUNCATE`, within a few intervals.
+  const struct timespec wait = {.tv_nsec = 10'000'000};
+  for (u64 i = 0;; i++) {
+    struct stat st = {0};
+    ASSERT(0 == stat(wal_path, &st));
+    if (0 == st.st_size) {
+      break;
+    }
+    ASSERT(i < 1'000);
+    ASSERT(0 == nanosleep(&wait, nullptr));
+  }
+
+  // Writes go on in the truncated WAL.
+  ASSERT(SQLITE_OK == sqlite3_exec(db, "update polls set state = state + 1",
+                                   nullptr, nullptr, nullptr));
+
+  ASSERT(SQLITE_OK == sqlite3_finalize(db_insert_poll_stmt));
+  ASSERT(SQLITE_OK == sqlite3_finalize(db_select_poll_stmt));
+  ASSERT(SQLITE_OK == sqlite3_finalize(db_insert_vote_stmt));
+  ASSERT(SQLITE_OK == sqlite3_close(db));
+  ASSERT(0 == unlink(path));
+  // Closing may have removed them already.
+  (void)unlink(wal_path);
+  (void)unlink(shm_path);
+}
+
 static void test_html_to_string() {
   Arena arena = arena_make_from_virtual_mem(4 * KiB);
 
@@ -298,6 +733,111 @@ static void test_html_to_string() {
   ASSERT(string_eq(expected, s));
 }
 
+static void test_html_template() {
+  Arena arena = arena_make_from_virtual_mem(4 * KiB);
+
+  HtmlDocument document = html_make(S("There and back again"), &arena);
+  HtmlElement tag_div = {.kind = HTML_DIV};
+  *dyn_push(&tag_div.attributes, &arena) =
+      (KeyValue){.key = S("id"), .value = S("hobbit")};
+  *dyn_push(&tag_div.children, &arena) =
+      (HtmlElement){.kind = HTML_TEXT, .text = S("hello world")};
+  *dyn_push(&document.body.children, &arena) = tag_div;
+
+  DynU8 sb = {0};
+  html_document_to_string(document, &sb, &arena);
+  String expected = dyn_slice(String, sb);
+
+  BufWriter w = buf_writer_make(-1, 1 * KiB, &arena);
+  buf_writer_write(&w, S(HTML_DOCUMENT_START("There and back again", "")
+                              HTML_OPEN("div", HTML_ATTR("id", "hobbit"))
+                                  HTML_OPEN("span", "")));
+  html_text_write(&w, S("hello world"));
+  buf_writer_write(
+      &w, S(HTML_CLOSE("span") HTML_CLOSE("div") HTML_DOCUMENT_END));
+
+  ASSERT(0 == w.err);
+  ASSERT(string_eq(expected, buf_writer_string(w)));
+}
+
+static void test_buf_writer() {
+  Arena arena = arena_make_from_virtual_mem(4 * KiB);
+
+  // Without a file descriptor, the output must fit.
+  {
+    BufWriter w = buf_writer_make(-1, 8, &arena);
+    buf_writer_write(&w, S("hello"));
+    ASSERT(0 == w.err);
+    buf_writer_write(&w, S(" world"));
+    ASSERT(ENOBUFS == w.err);
+    ASSERT(string_eq(S("hello"), buf_writer_string(w)));
+  }
+  // With a file descriptor, the buffer is flushed when full.
+  {
+    int fds[2] = {0};
+    ASSERT(0 == pipe(fds));
+
+    BufWriter w = buf_writer_make(fds[1], 4, &arena);
+    buf_writer_write(&w, S("hel"));
+    buf_writer_write(&w, S("lo"));
+    buf_writer_write(&w, S(" world, "));
+    html_text_write(&w, S("bye"));
+    ASSERT(0 == buf_writer_flush(&w));
+    close(fds[1]);
+
+    char buf[64] = {0};
+    i64 n = read(fds[0], buf, sizeof(buf));
+    ASSERT(n >= 0);
+    ASSERT(string_eq(S("hello world, bye"),
+                     (String){.data = (u8 *)buf, .len = (u64)n}));
+    close(fds[0]);
+  }
+}
+
+static void test_http_static_response() {
+  Arena arena = arena_make_from_virtual_mem(4 * KiB);
+
+  HttpStaticResponse static_res =
+      http_static_response_make(S("text/plain"), S("hello"), &arena);
+  ASSERT(string_eq(static_res.etag, S("\"a430d84680aabd0b\"")));
+  ASSERT(string_eq(static_res.ok,
+                   S("HTTP/1.1 200\r\nContent-Type: text/plain\r\n"
+                     "Content-Length: 5\r\nETag: \"a430d84680aabd0b\"\r\n"
+                     "Connection: close\r\n\r\nhello")));
+
+  // No `If-None-Match`.
+  {
+    HttpRequest req = {0};
+    HttpExchange exchange = {0};
+    ASSERT(200 ==
+           http_static_response_serve(static_res, req, &exchange, &arena));
+    ASSERT(string_eq(exchange.raw_response, static_res.ok));
+  }
+  // Stale etag.
+  {
+    HttpRequest req = {0};
+    *dyn_push(&req.headers, &arena) = (KeyValue){
+        .key = S("If-None-Match"),
+        .value = S("\"0000000000000000\""),
+    };
+    HttpExchange exchange = {0};
+    ASSERT(200 ==
+           http_static_response_serve(static_res, req, &exchange, &arena));
+  }
+  // Matching etag in a list.
+  {
+    HttpRequest req = {0};
+    *dyn_push(&req.headers, &arena) = (KeyValue){
+        .key = S("if-none-match"),
+        .value = S("\"0000000000000000\", \"a430d84680aabd0b\""),
+    };
+    HttpExchange exchange = {0};
+    ASSERT(304 ==
+           http_static_response_serve(static_res, req, &exchange, &arena));
+    ASSERT(string_eq(exchange.raw_response, static_res.not_modified));
+  }
+}
+
 static void test_extract_user_id_cookie() {
   Arena arena = arena_make_from_virtual_mem(4 * KiB);
 
@@ -372,6 +912,47 @@ static void test_html_sanitize() {
   ASSERT(string_eq(expected, sanitized));
 }
 
+static void test_html_escape() {
+  Arena arena = arena_make_from_virtual_mem(4 * KiB);
+
+  // Long enough to go through the vectorized path and the tail.
+  String s = S("<pre onclick=\"alert('hello')\"><code>int main() {}</code>"
+               "</pre> & nothing to escape in this rather long part");
+  String expected =
+      S("&lt;pre onclick=&quot;alert(&#39;hello&#39;)&quot;&gt;&lt;code&gt;"
+        "int main() {}&lt;/code&gt;&lt;/pre&gt; &amp; nothing to escape in "
+        "this rather long part");
+
+  BufWriter w = buf_writer_make(-1, 1 * KiB, &arena);
+  html_text_write(&w, s);
+  ASSERT(string_eq(expected, buf_writer_string(w)));
+
+  // Nothing to escape.
+  BufWriter clean = buf_writer_make(-1, 1 * KiB, &arena);
+  html_text_write(&clean, S("hello world"));
+  ASSERT(string_eq(S("hello world"), buf_writer_string(clean)));
+
+  // Same as a byte at a time search, wherever the character is compared to
+  // the vector width.
+  u8 text[70] = {0};
+  for (u64 i = 0; i <= sizeof(text); i++) {
+    memset(text, 'a', sizeof(text));
+    if (i < sizeof(text)) {
+      text[i] = '>';
+    }
+    ASSERT(i == html_escape_find((String){.data = text, .len = sizeof(text)}));
+  }
+
+  // Attribute values.
+  HtmlElement tag_div = {.kind = HTML_DIV};
+  *dyn_push(&tag_div.attributes, &arena) =
+      (KeyValue){.key = S("title"), .value = S("\"><script>")};
+  DynU8 tag = {0};
+  html_tag_to_string(tag_div, &tag, &arena);
+  ASSERT(string_eq(S("<div title=\"&quot;&gt;&lt;script&gt;\"></div>"),
+                   dyn_slice(String, tag)));
+}
+
 static void test_http_request_serialize() {
   Arena arena = arena_make_from_virtual_mem(4 * KiB);
 
@@ -399,6 +980,277 @@ static void test_http_request_serialize() {
   ASSERT(string_eq(serialized, expected));
 }
 
+static void test_http_request_arena() {
+  Arena arena = {0};
+  ASSERT(0 == http_request_arena_make(&arena, 8 * KiB, 4 * KiB));
+  ASSERT(8 * KiB == (u64)arena.end - (u64)arena.start);
+
+  // Past the pre-faulted part: zeroed, faulted in on demand.
+  u8 *data = arena_new(&arena, u8, 6 * KiB);
+  ASSERT(0 == data[0]);
+  ASSERT(0 == data[6 * KiB - 1]);
+
+  // Route ceiling.
+  http_arena_limit(&arena, 1 * KiB);
+  ASSERT(1 * KiB == (u64)arena.end - (u64)arena.start);
+  // Only lowers it.
+  http_arena_limit(&arena, 2 * KiB);
+  ASSERT(1 * KiB == (u64)arena.end - (u64)arena.start);
+}
+
+static void test_http_arena_stats() {
+  Arena arena = arena_make_from_virtual_mem(4 * KiB);
+
+  HttpArenaStats *stats = http_arena_stats_make_shared(1);
+  ASSERT(nullptr != stats);
+  ASSERT(0 == histogram_quantile(&stats->use, HISTOGRAM_UNIT_BYTES, 990));
+
+  for (u64 i = 0; i < 98; i++) {
+    http_arena_stats_record(stats, 1 * KiB, 4 * KiB);
+  }
+  http_arena_stats_record(stats, 6 * KiB, 4 * KiB);
+  http_arena_stats_record(stats, 128 * 1024 * KiB, 4 * KiB);
+  ASSERT(100 == stats->use.count);
+  ASSERT(2 == stats->overflows);
+  ASSERT(128 * 1024 * KiB == stats->max_use);
+
+  ASSERT(1 * KiB == histogram_quantile(&stats->use, HISTOGRAM_UNIT_BYTES, 500));
+  ASSERT(8 * KiB == histogram_quantile(&stats->use, HISTOGRAM_UNIT_BYTES, 990));
+  ASSERT(UINT64_MAX ==
+         histogram_quantile(&stats->use, HISTOGRAM_UNIT_BYTES, 1000));
+
+  String routes[] = {S("foo")};
+  HttpArenaStats *stats_all[] = {stats};
+  BufWriter w = buf_writer_make(-1, 4 * KiB, &arena);
+  http_arena_stats_write_metrics(&w, routes, stats_all, 1);
+  ASSERT(0 == w.err);
+  String metrics = buf_writer_string(w);
+  ASSERT(-1 != string_indexof_string(
+                   metrics, S("http_arena_use_bytes_bucket{route=\"foo\",le="
+                              "\"1024\"} 98\n")));
+  ASSERT(-1 != string_indexof_string(
+                   metrics, S("http_arena_use_bytes_bucket{route=\"foo\",le="
+                              "\"+Inf\"} 100\n")));
+  ASSERT(-1 !=
+         string_indexof_string(
+             metrics, S("http_arena_overflows_total{route=\"foo\"} 2\n")));
+}
+
+static void test_http_request_stats() {
+  Arena arena = arena_make_from_virtual_mem(32 * KiB);
+
+  HttpRequestStats *stats = http_request_stats_make_shared(1);
+  ASSERT(nullptr != stats);
+  ASSERT(0 == histogram_quantile(&stats->duration, HISTOGRAM_UNIT_NS, 990));
+
+  http_request_stats_record(stats, 200, 10'000);
+  http_request_stats_record(stats, 200, 50'000);
+  http_request_stats_record(stats, 404, 3'000'000'000);
+  // Out of range.
+  http_request_stats_record(stats, 999, 1);
+  ASSERT(2 == stats->responses[1]);
+  ASSERT(1 == stats->responses[3]);
+  ASSERT(1 == stats->responses[4]);
+  ASSERT(4 == stats->duration.count);
+  ASSERT(32'000 ==
+         histogram_quantile(&stats->duration, HISTOGRAM_UNIT_NS, 500));
+  ASSERT(UINT64_MAX ==
+         histogram_quantile(&stats->duration, HISTOGRAM_UNIT_NS, 1000));
+
+  String routes[] = {S("foo")};
+  HttpRequestStats *stats_all[] = {stats};
+  BufWriter w = buf_writer_make(-1, 8 * KiB, &arena);
+  http_request_stats_write_metrics(&w, routes, stats_all, 1);
+  ASSERT(0 == w.err);
+  String metrics = buf_writer_string(w);
+  ASSERT(-1 != string_indexof_string(
+                   metrics,
+                   S("http_requests_total{route=\"foo\",code=\"2xx\"} 2\n")));
+  ASSERT(-1 != string_indexof_string(
+                   metrics, S("http_request_duration_seconds_bucket{route="
+                              "\"foo\",le=\"0.000032\"} 2\n")));
+  ASSERT(-1 != string_indexof_string(
+                   metrics, S("http_request_duration_seconds_bucket{route="
+                              "\"foo\",le=\"+Inf\"} 4\n")));
+  ASSERT(-1 != string_indexof_string(
+                   metrics, S("http_request_duration_seconds_sum{route="
+                              "\"foo\"} 3.000060001\n")));
+  ASSERT(-1 != string_indexof_string(
+                   metrics, S("http_request_duration_seconds_count{route="
+                              "\"foo\"} 4\n")));
+
+  Histogram phases[HTTP_PHASE_MAX] = {0};
+  histogram_record(&phases[HTTP_PHASE_DB], HISTOGRAM_UNIT_NS, 1'500'000'000);
+  BufWriter phases_w = buf_writer_make(-1, 16 * KiB, &arena);
+  http_phase_stats_write_metrics(&phases_w, phases);
+  ASSERT(0 == phases_w.err);
+  String phases_metrics = buf_writer_string(phases_w);
+  ASSERT(-1 != string_indexof_string(
+                   phases_metrics,
+                   S("http_request_phase_duration_seconds_sum{phase=\"db\"} "
+                     "1.5\n")));
+  ASSERT(-1 != string_indexof_string(
+                   phases_metrics,
+                   S("http_request_phase_duration_seconds_count{phase="
+                     "\"write\"} 0\n")));
+}
+
+static void test_log_line_format() {
+  u8 data[LOG_LINE_MAX] = {0};
+
+  const LogfmtField fields[] = {
+      L("a", (u64)1),
+      L("b", -2),
+      L("c", S("x\"y")),
+  };
+  String line = {
+      .data = data,
+      .len = log_line_format(data, LOG_LEVEL_INFO, 123, 45, S("hello"),
+                             fields, static_array_len(fields)),
+  };
+  ASSERT(-1 != string_indexof_string(
+                   line, S("level=info timestamp_ns=123 pid=45 ")));
+  ASSERT(-1 != string_indexof_string(
+                   line, S(" message=\"hello\" a=1 b=-2 c=\"x\\\"y\"\n")));
+
+  // Truncated, but still a line.
+  u8 big[2 * LOG_LINE_MAX] = {0};
+  memset(big, 'x', sizeof(big));
+  const LogfmtField big_field =
+      L("big", ((String){.data = big, .len = sizeof(big)}));
+  ASSERT(LOG_LINE_MAX ==
+         log_line_format(data, LOG_LEVEL_INFO, 0, 0, S("big"), &big_field, 1));
+  ASSERT('\n' == data[LOG_LINE_MAX - 1]);
+
+  // Sampling.
+  log_sample_rate = 4;
+  ASSERT(log_sampled(8));
+  ASSERT(!log_sampled(9));
+  log_sample_rate = 0;
+  ASSERT(!log_sampled(8));
+  log_sample_rate = 1;
+}
+
+static void test_log_binary_roundtrip() {
+  Arena arena = arena_make_from_virtual_mem(256 * KiB);
+
+  LogFlusher *flusher = arena_new(&arena, LogFlusher, 1);
+  flusher->format = LOG_FORMAT_BINARY;
+
+  // Same literal, same id.
+  const String msg = S("hello");
+  const LogfmtField fields[] = {
+      L("a", (u64)1),
+      L("b", -2),
+      L("c", S("xyz")),
+  };
+  u8 first[LOG_LINE_MAX] = {0};
+  const u64 first_len =
+      log_record_encode_line(first, sizeof(first), LOG_LEVEL_INFO, 123, 45,
+                             msg, fields, static_array_len(fields));
+  u8 second[LOG_LINE_MAX] = {0};
+  const u64 second_len = log_record_encode_line(
+      second, sizeof(second), LOG_LEVEL_ERROR, 124, 45, msg, fields, 1);
+
+  ASSERT(log_flusher_add(flusher, first, first_len));
+  // The strings are only sent once.
+  ASSERT(4 + 1 == flusher->iov_len);
+  ASSERT(log_flusher_add(flusher, second, second_len));
+  ASSERT(4 + 1 + 1 == flusher->iov_len);
+
+  DynU8 out = {0};
+  for (u64 i = 0; i < flusher->iov_len; i++) {
+    dyn_append_slice(&out,
+                     ((String){.data = flusher->iov[i].iov_base,
+                               .len = flusher->iov[i].iov_len}),
+                     &arena);
+  }
+
+  String in = dyn_slice(String, out);
+  DynLogDictEntry dict = {0};
+  LogDecodedLine lines[2] = {0};
+  u64 lines_len = 0;
+  while (!slice_is_empty(in)) {
+    const LogRecordDecodeResult res =
+        log_record_decode(in, &dict, &arena, &arena);
+    ASSERT(0 == res.err);
+    if (LOG_RECORD_KIND_LINE == res.kind) {
+      ASSERT(lines_len < static_array_len(lines));
+      lines[lines_len++] = res.line;
+    }
+    in = res.remaining;
+  }
+  ASSERT(2 == lines_len);
+  ASSERT(4 == dict.len);
+
+  ASSERT(LOG_LEVEL_INFO == lines[0].level);
+  ASSERT(123 == lines[0].timestamp_ns);
+  ASSERT(45 == lines[0].pid);
+  ASSERT(string_eq(S("hello"), lines[0].msg));
+  ASSERT(3 == lines[0].fields_len);
+  ASSERT(string_eq(S("a"), lines[0].fields[0].key));
+  ASSERT(1 == lines[0].fields[0].value.n);
+  ASSERT(string_eq(S("b"), lines[0].fields[1].key));
+  ASSERT(-2 == lines[0].fields[1].value.i);
+  ASSERT(string_eq(S("c"), lines[0].fields[2].key));
+  ASSERT(string_eq(S("xyz"), lines[0].fields[2].value.s));
+
+  ASSERT(LOG_LEVEL_ERROR == lines[1].level);
+  ASSERT(string_eq(S("hello"), lines[1].msg));
+  ASSERT(1 == lines[1].fields_len);
+
+  // Truncated input.
+  ASSERT(EINVAL ==
+         log_record_decode((String){.data = first, .len = first_len - 1},
+                           &dict, &arena, &arena)
+             .err);
+}
+
+static void test_log_ring_dead_producer() {
+  Arena arena = arena_make_from_virtual_mem(256 * KiB);
+
+  LogRing *ring = log_ring_make(4, LOG_FULL_POLICY_BLOCK, LOG_FORMAT_LOGFMT);
+  ASSERT(nullptr != ring);
+  LogFlusher *flusher = arena_new(&arena, LogFlusher, 1);
+  flusher->format = LOG_FORMAT_LOGFMT;
+  flusher->stuck_pos = UINT64_MAX;
+
+  // Dies after claiming the first slot, before publishing the line.
+  pid_t pid = fork();
+  ASSERT(-1 != pid);
+  if (0 == pid) {
+    atomic_fetch_add_explicit(&ring->head, 1, memory_order_relaxed);
+    atomic_store_explicit(&ring->slots[0].pid, getpid(), memory_order_relaxed);
+    _exit(0);
+  }
+  int status = 0;
+  ASSERT(-1 != waitpid(pid, &status, 0));
+
+  log_ring = ring;
+  log_at(LOG_LEVEL_INFO, "after the dead producer", &arena);
+  log_ring = nullptr;
+
+  // Waits on the slot first.
+  ASSERT(0 == log_ring_flush(ring, flusher));
+  ASSERT(0 == flusher->lost);
+
+  // Without a pid, the producer may be alive, only preempted: still waits.
+  atomic_store_explicit(&ring->slots[0].pid, 0, memory_order_relaxed);
+  flusher->stuck_since_ns -= LOG_SLOT_STALE_NS;
+  ASSERT(0 == log_ring_flush(ring, flusher));
+  ASSERT(0 == flusher->lost);
+
+  atomic_store_explicit(&ring->slots[0].pid, pid, memory_order_relaxed);
+  ASSERT(1 == log_ring_flush(ring, flusher));
+  ASSERT(1 == flusher->lost);
+  ASSERT(1 == log_ring_flush(ring, flusher));
+  ASSERT(2 == atomic_load_explicit(&ring->tail, memory_order_relaxed));
+
+  // Both slots are free again.
+  ASSERT(4 == atomic_load_explicit(&ring->slots[0].seq, memory_order_relaxed));
+  ASSERT(5 == atomic_load_explicit(&ring->slots[1].seq, memory_order_relaxed));
+}
+
 int main() {
   test_read_http_request_without_body();
   test_read_http_request_with_body();
@@ -406,9 +1258,25 @@ int main() {
   test_http_server_serve_file();
   test_form_data_parse();
   test_json_encode_decode_string_slice();
+  test_binary_encode_decode_string_slice();
+  test_id128_encode_decode();
+  test_shm_cache();
+  test_db_kv();
+  test_db_sqlite_migrate_sanitized();
+  test_db_sqlite_checkpointer();
+  test_http_request_arena();
+  test_http_arena_stats();
+  test_http_request_stats();
+  test_log_line_format();
+  test_log_binary_roundtrip();
+  test_log_ring_dead_producer();
   test_html_to_string();
+  test_html_template();
+  test_buf_writer();
+  test_http_static_response();
   test_extract_user_id_cookie();
   test_html_sanitize();
+  test_html_escape();
   test_http_request_serialize();
   test_url_parse();
 }
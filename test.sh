@@ -4,6 +4,9 @@ set -f # disable globbing.
 
 CC="${CC:-clang}"
 WARNINGS="$(tr -s '\n' ' ' < compile_flags.txt)"
+# Same options as `sqlite3.o` was built with, see `install.sh`.
+SQLITE_OPTIONS_FILE="${SQLITE_OPTIONS_FILE:-sqlite_options.txt}"
+SQLITE_OPTIONS="$(grep -v '^#' "$SQLITE_OPTIONS_FILE" | tr -s '\n' ' ')"
 
 # shellcheck disable=SC2086
-"$CC" -O0 $WARNINGS -g3 test.c -o test.bin -fsanitize=address,undefined -fsanitize-trap=all && ASAN_OPTIONS='detect_leaks=0' ./test.bin
+"$CC" -O0 $WARNINGS -g3 test.c sqlite3.o -o test.bin $SQLITE_OPTIONS -fsanitize=address,undefined -fsanitize-trap=all && ASAN_OPTIONS='detect_leaks=0' ./test.bin